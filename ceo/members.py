@@ -114,7 +114,20 @@ def connected():
 
 ### Members ###
 
-def create_member(username, password, name, program, email, club_rep=False):
+def status_reporter(progress):
+    """Turns a callback for StatusMessages into one for progress reports."""
+
+    if progress is None:
+        return None
+
+    def report(data):
+        message = ceo_pb2.StatusMessage()
+        message.ParseFromString(data)
+        progress(message)
+    return report
+
+
+def create_member(username, password, name, program, email, club_rep=False, progress=None):
     """
     Creates a UNIX user account with options tailored to CSC members.
 
@@ -125,6 +138,7 @@ def create_member(username, password, name, program, email, club_rep=False):
         program  - the member's program of study
         club_rep - whether the user is a club rep
         email    - email to place in .forward
+        progress - called with each StatusMessage as the steps finish
 
     Exceptions:
         InvalidArgument - on bad account attributes provided
@@ -155,7 +169,7 @@ def create_member(username, password, name, program, email, club_rep=False):
         else:
             request.type = ceo_pb2.AddUser.MEMBER
 
-        out = remote.run_remote('adduser', request.SerializeToString())
+        out = remote.run_remote('adduser', request.SerializeToString(), status_reporter(progress))
 
         response = ceo_pb2.AddUserResponse()
         response.ParseFromString(out)
@@ -430,13 +444,14 @@ def set_shell(userid, shell):
 
 ### Clubs ###
 
-def create_club(username, name):
+def create_club(username, name, progress=None):
     """
     Creates a UNIX user account with options tailored to CSC-hosted clubs.
     
     Parameters:
         username - the desired UNIX username
         name     - the club name
+        progress - called with each StatusMessage as the steps finish
 
     Exceptions:
         InvalidArgument - on bad account attributes provided
@@ -456,7 +471,7 @@ def create_club(username, name):
         request.username = username
         request.realname = name
 
-        out = remote.run_remote('adduser', request.SerializeToString())
+        out = remote.run_remote('adduser', request.SerializeToString(), status_reporter(progress))
 
         response = ceo_pb2.AddUserResponse()
         response.ParseFromString(out)
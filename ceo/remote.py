@@ -1,5 +1,15 @@
 import os
+import struct
 import subprocess
+import tempfile
+
+# see src/net.h
+MSG_HEADERLEN = 8
+MSG_CHUNKLEN = 32768
+MSG_BUSY = 0x8000002
+MSG_TIMEOUT = 0x8000003
+MSG_FLAG_MORE = 0x40000000
+MSG_FLAG_PROGRESS = 0x20000000
 
 class RemoteException(Exception):
     """Exception class for bad argument values."""
@@ -8,11 +18,121 @@ class RemoteException(Exception):
     def __str__(self):
         return 'Error executing ceoc (%d)\n\n%s' % (self.status, self.stderr)
 
-def run_remote(op, data):
-    ceoc = '%s/ceoc' % os.environ.get('CEO_LIB_DIR', '/usr/lib/ceod')
-    addmember = subprocess.Popen([ceoc, op], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
-    out, err = addmember.communicate(data)
+def read_frames(stream):
+    """Yields the type and body of each frame ceoc --progress writes."""
+    while True:
+        header = stream.read(MSG_HEADERLEN)
+        if len(header) < MSG_HEADERLEN:
+            return
+        length, msgtype = struct.unpack('>II', header)
+        yield msgtype, stream.read(length)
+
+def write_message(stream, msgtype, body):
+    """Writes body as a message of msgtype, in chunks if it is big."""
+    for pos in range(0, len(body), MSG_CHUNKLEN):
+        chunk = body[pos:pos + MSG_CHUNKLEN]
+        flags = MSG_FLAG_MORE if pos + MSG_CHUNKLEN < len(body) else 0
+        stream.write(struct.pack('>II', len(chunk), msgtype | flags) + chunk)
+
+def ceoc_path():
+    return '%s/ceoc' % os.environ.get('CEO_LIB_DIR', '/usr/lib/ceod')
+
+def run_remote(op, data, progress=None):
+    """
+    Runs op on the server with data as its input and returns its output.
+    If progress is given, it is called with each progress report the op
+    sends, as soon as it arrives.
+    """
+    ceoc = ceoc_path()
+    if progress is None:
+        addmember = subprocess.Popen([ceoc, op], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = addmember.communicate(data)
+    else:
+        # stderr is only read at the end, so it must not fill up a pipe
+        errors = tempfile.TemporaryFile()
+        addmember = subprocess.Popen([ceoc, '--progress', op], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=errors)
+        # ceoc reads all of its input before it answers
+        addmember.stdin.write(data)
+        addmember.stdin.close()
+        out = ''
+        for msgtype, body in read_frames(addmember.stdout):
+            if msgtype & MSG_FLAG_PROGRESS:
+                progress(body)
+            else:
+                out += body
+        errors.seek(0)
+        err = errors.read()
+        errors.close()
     status = addmember.wait()
     if status:
         raise RemoteException(status, out, err)
     return out
+
+class Coprocess:
+    """
+    A ceoc --serve that runs requests one after another, keeping its
+    connection to each server open in between, so that a batch of them
+    pays for connecting and authenticating once rather than every time.
+    If it fails, the next request starts a fresh one.
+    """
+    def __init__(self):
+        self.ceoc = None
+
+    def start(self):
+        self.errors = tempfile.TemporaryFile()
+        self.ceoc = subprocess.Popen([ceoc_path(), '--serve'], stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE, stderr=self.errors)
+
+    def failed(self, out):
+        """Reaps a ceoc that has given up, returning the exception to raise."""
+        self.ceoc.stdin.close()
+        status = self.ceoc.wait()
+        self.errors.seek(0)
+        err = self.errors.read()
+        self.errors.close()
+        self.ceoc = None
+        return RemoteException(status or 1, out, err)
+
+    def run(self, op, data, progress=None):
+        """Runs op as run_remote does."""
+        if self.ceoc is None:
+            self.start()
+        out = ''
+        try:
+            write_message(self.ceoc.stdin, MSG_FLAG_PROGRESS if progress else 0, op + '\0' + data)
+            self.ceoc.stdin.flush()
+            for msgtype, body in read_frames(self.ceoc.stdout):
+                if msgtype & MSG_FLAG_PROGRESS:
+                    progress(body)
+                    continue
+                out += body
+                if not msgtype & MSG_FLAG_MORE:
+                    break
+            else:
+                raise self.failed(out)
+        except IOError:
+            raise self.failed(out)
+
+        if msgtype == MSG_BUSY:
+            retry_ms, = struct.unpack('>I', out)
+            raise RemoteException(os.EX_TEMPFAIL, '', 'server is busy, retry after %d ms' % retry_ms)
+        if msgtype == MSG_TIMEOUT:
+            timeout, = struct.unpack('>I', out)
+            raise RemoteException(os.EX_UNAVAILABLE, '', 'op %s timed out after %d seconds' % (op, timeout))
+        return out
+
+    def close(self):
+        if self.ceoc is not None:
+            self.ceoc.stdin.close()
+            self.ceoc.wait()
+            self.errors.close()
+            self.ceoc = None
+
+coprocess = Coprocess()
+
+def run_remote_persistent(op, data, progress=None):
+    """
+    Like run_remote, but over a ceoc co-process that lasts as long as we
+    do, so that it reuses its connections to the server.
+    """
+    return coprocess.run(op, data, progress)
@@ -188,6 +188,10 @@ class PassPage(WizardPanel):
             return True
         clear_status()
 
+def show_progress(message):
+    set_status(message.message)
+    redraw()
+
 class EndPage(WizardPanel):
     def __init__(self, state, utype='member'):
         self.utype = utype
@@ -221,7 +225,8 @@ class EndPage(WizardPanel):
                         self.state['password'],
                         self.state['name'],
                         self.state['program'],
-                        self.state['email'])
+                        self.state['email'],
+                        progress=show_progress)
                 members.register(self.state['userid'], self.state['terms'])
 
                 mailman_result = members.subscribe_to_mailing_list(self.state['userid'])
@@ -235,10 +240,12 @@ class EndPage(WizardPanel):
                         self.state['name'],
                         self.state['program'],
                         self.state['email'],
-                        club_rep=True)
+                        club_rep=True,
+                        progress=show_progress)
                 members.register_nonmember(self.state['userid'], self.state['terms'])
             elif self.utype == 'club':
-                members.create_club(self.state['userid'], self.state['name'])
+                members.create_club(self.state['userid'], self.state['name'],
+                                    progress=show_progress)
             else:
                 raise Exception("Internal Error")
         except members.InvalidArgument, e:
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "net.h"
+#include "gss.h"
+#include "ops.h"
+#include "config.h"
+#include "remote.h"
+#include "route.h"
+
+/* ceoc-agent keeps authenticated connections to the ceods that run our ops
+ * and runs the requests of local ceocs over them, so that each ceoc skips
+ * the connection setup and the Kerberos exchange. It listens on
+ * $XDG_RUNTIME_DIR/ceoc/agent, which only its own user may connect to, and
+ * hands each ceoc to a worker for the host of its op, picked as in ceoc for
+ * ops on several hosts (see route.c). Workers keep one connection each,
+ * pipelining the requests of all their ceocs over it if the server allows,
+ * and reconnect when the server hangs up, when the connection has been idle
+ * long enough that ceod may be about to, or when the context is about to
+ * expire.
+ *
+ * A ceoc talks to the agent as to an op, framed as on the network but
+ * without GSS: it sends its request as a message of the op's type, with
+ * MSG_FLAG_PROGRESS set if it wants progress reports, and gets back the
+ * reports and then the response (or MSG_BUSY or MSG_TIMEOUT, as ceod sent
+ * it). If anything goes wrong, the agent hangs up without a response.
+ * Nothing waits on a ceoc: requests are read as they come in, and a ceoc
+ * that has not sent the header of its request within ceod_header_timeout
+ * seconds, or all of it within ceod_body_timeout, is hung up on, as ceod
+ * does with its own clients. ceocs write the header in one go with the
+ * start of the body, so the agent can peek at it whole. */
+
+char *prog = NULL;
+
+static int terminate = 0;
+
+struct worker {
+    char *hostname;
+    pid_t pid;
+    int sock;
+    struct worker *next;
+};
+
+static struct worker *workers;
+
+/* a ceoc whose request header has not come in yet */
+struct waiting {
+    int fd;
+    long long since;    /* see monotonic_ms() */
+};
+
+static struct waiting *waiting;
+static int nwaiting;
+
+/* a ceoc handed to a worker, until its whole request is in */
+struct client {
+    int fd;
+    long long since;    /* see monotonic_ms() */
+    int complete;
+    struct strbuf in;   /* what it has sent so far */
+};
+
+/* a request from a local ceoc that a worker has sent on */
+struct pending {
+    int fd;             /* -1 once the ceoc has gone away */
+    struct op *op;
+    uint32_t reqid;
+    int progress;
+    long long sent;     /* see monotonic_ms() */
+    long long heard;    /* when the server last sent anything for it */
+    struct strbuf out;  /* the response so far, if it is chunked */
+    struct pending *next;
+};
+
+/* the connection a worker keeps to its host */
+struct remote {
+    struct op *op;      /* any op on the host, to connect with */
+    struct ceo_conn conn;
+    int connected;
+    uint32_t features;
+    uint32_t next_reqid;
+    long long last_used;
+    struct pending *pending;
+};
+
+static void usage() {
+    fprintf(stderr, "Usage: %s\n", prog);
+    exit(2);
+}
+
+static void signal_handler(int sig) {
+    terminate = 1;
+}
+
+static void setup_signals(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = signal_handler;
+
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+}
+
+static void free_pending(struct remote *r, struct pending *p) {
+    struct pending **pp = &r->pending;
+
+    while (*pp != p)
+        pp = &(*pp)->next;
+    *pp = p->next;
+
+    if (p->fd >= 0)
+        close(p->fd);
+    strbuf_release(&p->out);
+    free(p);
+}
+
+/* hangs up on the server and on every ceoc still waiting for it */
+static void drop_remote(struct remote *r) {
+    while (r->pending)
+        free_pending(r, r->pending);
+
+    if (r->connected)
+        close_remote(&r->conn);
+    r->connected = 0;
+}
+
+/* Makes sure there is a connection to send a new request on. One that is
+ * about to expire or to be dropped by ceod for idling is replaced, unless
+ * requests are still waiting on it. Returns -1 if the host cannot be
+ * reached, which it is then held back for. */
+static int connect_remote(struct remote *r) {
+    uint32_t wanted = CEO_FEATURE_PIPELINE | CEO_FEATURE_CHUNKED | CEO_FEATURE_PROGRESS;
+    int sent;
+
+    if (r->connected && !r->pending && remote_stale(r->last_used)) {
+        debug("reconnecting to %s", r->op->hostname);
+        drop_remote(r);
+    }
+    if (r->connected)
+        return 0;
+
+    if (ceod_compress_threshold)
+        wanted |= CEO_FEATURE_COMPRESS;
+
+    if (open_remote(&r->conn, r->op, wanted, NULL, &r->features, &sent)) {
+        route_failed(r->op, 0);
+        return -1;
+    }
+    r->connected = 1;
+    r->next_reqid = 1;
+    debug("connected to %s", r->op->hostname);
+    return 0;
+}
+
+/* Puts the request in buf together from its frames into in, as
+ * ceo_read_message() would, or if in is NULL only checks that it is all
+ * there. Returns 1 if it is, 0 if more is to come and -1 if it is
+ * malformed. */
+static int parse_request(struct strbuf *buf, struct strbuf *in, uint32_t *msgtype) {
+    struct ceo_frame_header hdr;
+    uint32_t first = 0;
+    size_t pos = 0;
+    ssize_t size;
+
+    while ((size = ceo_parse_frame(buf->buf + pos, buf->len - pos, MSG_HEADERLEN, &hdr)) > 0) {
+        if (!pos)
+            first = hdr.type & ~MSG_FLAG_MORE;
+        else if ((hdr.type & ~MSG_FLAG_MORE) != first)
+            return -1;
+        if (in)
+            strbuf_add(in, buf->buf + pos + MSG_HEADERLEN, hdr.len);
+        pos += size;
+        if (!(hdr.type & MSG_FLAG_MORE)) {
+            *msgtype = hdr.type;
+            return 1;
+        }
+    }
+
+    return size < 0 ? -1 : 0;
+}
+
+/* Reads whatever the ceoc has sent. Returns 1 once its whole request is
+ * in, and -1 if it hung up or sent something else. */
+static int read_client(struct client *c) {
+    uint32_t msgtype;
+
+    for (;;) {
+        ssize_t bytes;
+
+        strbuf_grow(&c->in, 16384);
+        bytes = read(c->fd, c->in.buf + c->in.len, strbuf_avail(&c->in));
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && errno == EAGAIN)
+            break;
+        if (bytes <= 0)
+            return -1;
+        strbuf_setlen(&c->in, c->in.len + bytes);
+    }
+
+    return parse_request(&c->in, NULL, &msgtype);
+}
+
+/* The response goes to the ceoc with blocking writes, since it waits for
+ * it; one that stops reading holds us up for ceod_body_timeout at most. */
+static int make_blocking(int fd) {
+    struct timeval tv = { .tv_sec = ceod_body_timeout };
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+        errorpe("cannot set up ceoc socket");
+        return -1;
+    }
+    return 0;
+}
+
+/* sends on the request of the ceoc c, which is all in */
+static void send_request(struct remote *r, struct client *c) {
+    struct strbuf in = STRBUF_INIT, cipher = STRBUF_INIT;
+    int fd = c->fd;
+    struct pending *p;
+    uint32_t msgtype;
+    struct op *op;
+
+    parse_request(&c->in, &in, &msgtype);
+    strbuf_release(&c->in);
+
+    if (!(op = find_op_id(msgtype & ~MSG_FLAG_PROGRESS)) || route_to(op, r->op->hostname) ||
+            make_blocking(fd) || connect_remote(r)) {
+        close(fd);
+        strbuf_release(&in);
+        return;
+    }
+
+    p = xcalloc(1, sizeof(*p));
+    p->fd = fd;
+    p->op = op;
+    p->reqid = r->next_reqid++;
+    p->progress = !!(msgtype & MSG_FLAG_PROGRESS);
+    p->sent = p->heard = monotonic_ms();
+    p->next = r->pending;
+    r->pending = p;
+
+    gss_encipher_frames(&in, &cipher, op->id, p->reqid, r->features);
+    if (full_write(r->conn.fd, cipher.buf, cipher.len)) {
+        errorpe("write");
+        drop_remote(r);
+    }
+    r->last_used = monotonic_ms();
+
+    strbuf_release(&in);
+    strbuf_release(&cipher);
+}
+
+static struct pending *find_pending(struct remote *r, uint32_t reqid) {
+    for (struct pending *p = r->pending; p; p = p->next) {
+        if (!(r->features & CEO_FEATURE_PIPELINE) || p->reqid == reqid)
+            return p;
+    }
+    return NULL;
+}
+
+static void answer(struct pending *p, void *buf, size_t len, uint32_t msgtype) {
+    if (p->fd >= 0 && ceo_write_message(p->fd, buf, len, msgtype)) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+/* passes a frame from the server on to the ceoc it is for */
+static int handle_frame(struct remote *r) {
+    struct strbuf frame = STRBUF_INIT, plain = STRBUF_INIT;
+    uint32_t msgtype, type, reqid = 0;
+    int pipelined = r->features & CEO_FEATURE_PIPELINE;
+    struct pending *p;
+    int ret = -1;
+
+    if (remote_read_frame(&r->conn, &frame, &msgtype, pipelined ? &reqid : NULL))
+        goto out;
+
+    p = find_pending(r, reqid);
+    if (!p) {
+        error("response to unknown request %u from %s", reqid, r->op->hostname);
+        goto out;
+    }
+    p->heard = monotonic_ms();
+    type = msgtype & ~MSG_FLAG_COMPRESSED;
+
+    if (type == MSG_BUSY || type == MSG_TIMEOUT) {
+        uint32_t retry_ms;
+
+        if (type == MSG_BUSY && frame.len == sizeof(retry_ms)) {
+            memcpy(&retry_ms, frame.buf, sizeof(retry_ms));
+            route_failed(p->op, ntohl(retry_ms));
+        }
+        answer(p, frame.buf, frame.len, type);
+        free_pending(r, p);
+        ret = 0;
+        goto out;
+    }
+
+    if ((type & ~(MSG_FLAG_MORE | MSG_FLAG_PROGRESS)) != p->op->id) {
+        error("unexpected message type 0x%x from %s", type, r->op->hostname);
+        goto out;
+    }
+
+    if (type & MSG_FLAG_PROGRESS) {
+        gss_decipher_frame(&frame, &plain, msgtype);
+        if (p->progress)
+            answer(p, plain.buf, plain.len, type);
+    } else {
+        gss_decipher_frame(&frame, &p->out, msgtype);
+        if (!(type & MSG_FLAG_MORE)) {
+            route_done(p->op, monotonic_ms() - p->sent);
+            answer(p, p->out.buf, p->out.len, type);
+            free_pending(r, p);
+        }
+    }
+    ret = 0;
+
+out:
+    strbuf_release(&frame);
+    strbuf_release(&plain);
+    return ret;
+}
+
+/* How long until a request waiting on r is overdue (see response_timeout()),
+ * in ms for poll(): 0 if one is already, -1 if none can be. */
+static int next_overdue(struct remote *r, struct pending **overdue) {
+    long long now = monotonic_ms(), first = -1;
+
+    *overdue = NULL;
+    for (struct pending *p = r->pending; p; p = p->next) {
+        long long left, timeout = response_timeout(p->op);
+
+        if (!timeout)
+            continue;
+        left = p->heard + timeout - now;
+        if (left <= 0) {
+            *overdue = p;
+            return 0;
+        }
+        if (first < 0 || left < first)
+            first = left;
+    }
+    return first;
+}
+
+static void drop_client(struct client *clients, int *nclients, int i) {
+    close(clients[i].fd);
+    strbuf_release(&clients[i].in);
+    clients[i] = clients[--*nclients];
+}
+
+static struct client *find_client(struct client *clients, int nclients, int fd) {
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i].fd == fd)
+            return &clients[i];
+    }
+    return NULL;
+}
+
+/* Hangs up on ceocs that are taking too long to send their requests, and
+ * returns how long until the next one would be, for poll(). */
+static int expire_clients(struct client *clients, int *nclients, int wait) {
+    long long now = monotonic_ms();
+
+    for (int i = 0; ceod_body_timeout && i < *nclients; ) {
+        long long left = clients[i].since + ceod_body_timeout * 1000LL - now;
+
+        if (clients[i].complete) {
+            i++;
+        } else if (left <= 0) {
+            debug("ceoc took too long to send its request");
+            drop_client(clients, nclients, i);
+        } else {
+            if (wait < 0 || left < wait)
+                wait = left;
+            i++;
+        }
+    }
+    return wait;
+}
+
+static void worker_main(int handoff, struct op *op) {
+    struct remote r;
+    struct client *clients = NULL;
+    int nclients = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.op = op;
+
+    signal(SIGINT, SIG_IGN);
+    client_acquire_creds("ceod", op->hostname);
+
+    while (handoff >= 0 || nclients || r.pending) {
+        struct pollfd *pfds = xcalloc(nclients + 2, sizeof(*pfds));
+        struct pending *overdue;
+        int npfds = 0, wait;
+
+        /* the request may have run, so its ceoc hears nothing back and
+         * the next ones steer clear of the host */
+        wait = next_overdue(&r, &overdue);
+        if (overdue) {
+            error("%s stopped answering op %s", op->hostname, overdue->op->name);
+            route_failed(overdue->op, 0);
+            drop_remote(&r);
+            free(pfds);
+            continue;
+        }
+
+        wait = expire_clients(clients, &nclients, wait);
+
+        if (handoff >= 0)
+            pfds[npfds++] = (struct pollfd) { .fd = handoff, .events = POLLIN };
+        if (r.connected)
+            pfds[npfds++] = (struct pollfd) { .fd = r.conn.fd, .events = POLLIN };
+        for (int i = 0; i < nclients; i++) {
+            if (!clients[i].complete)
+                pfds[npfds++] = (struct pollfd) { .fd = clients[i].fd, .events = POLLIN };
+        }
+
+        if (poll(pfds, npfds, wait) < 0 && errno != EINTR)
+            fatalpe("poll");
+
+        for (int i = 0; i < npfds; i++) {
+            if (!pfds[i].revents)
+                continue;
+
+            if (pfds[i].fd == handoff) {
+                int fd = ceo_receive_fd(handoff);
+
+                if (fd < 0) {
+                    close(handoff);
+                    handoff = -1;
+                    continue;
+                }
+                clients = xrealloc(clients, (nclients + 1) * sizeof(*clients));
+                clients[nclients++] = (struct client) { .fd = fd, .since = monotonic_ms(), .in = STRBUF_INIT };
+            } else if (r.connected && pfds[i].fd == r.conn.fd) {
+                /* frames already buffered do not wake poll */
+                do {
+                    if (handle_frame(&r)) {
+                        if (r.pending) {
+                            error("lost connection to %s", op->hostname);
+                            route_failed(r.pending->op, 0);
+                        }
+                        drop_remote(&r);
+                        break;
+                    }
+                } while (r.conn.rpos < r.conn.rbuf.len);
+            } else {
+                struct client *c = find_client(clients, nclients, pfds[i].fd);
+                int ret = read_client(c);
+
+                if (ret < 0)
+                    drop_client(clients, &nclients, c - clients);
+                else if (ret)
+                    c->complete = 1;
+            }
+        }
+
+        /* without pipelining, one request at a time */
+        for (int i = 0; i < nclients && (!r.pending || (r.features & CEO_FEATURE_PIPELINE)); ) {
+            if (!clients[i].complete) {
+                i++;
+                continue;
+            }
+            send_request(&r, &clients[i]);
+            clients[i] = clients[--nclients];
+        }
+
+        free(pfds);
+    }
+
+    drop_remote(&r);
+    while (nclients)
+        drop_client(clients, &nclients, 0);
+    free(clients);
+    free_gss();
+    exit(0);
+}
+
+/* starts a worker for the host of op, to be handed the ceoc on fd */
+static struct worker *spawn_worker(int listener, struct op *op, int fd) {
+    struct worker *w;
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv))
+        fatalpe("socketpair");
+
+    pid = fork();
+    if (pid < 0)
+        fatalpe("fork");
+
+    if (!pid) {
+        /* it comes through sv, so that each worker has it once */
+        close(fd);
+        close(listener);
+        close(sv[0]);
+        for (w = workers; w; w = w->next)
+            close(w->sock);
+        for (int i = 0; i < nwaiting; i++)
+            close(waiting[i].fd);
+        worker_main(sv[1], op);
+    }
+
+    close(sv[1]);
+
+    w = xcalloc(1, sizeof(*w));
+    w->hostname = xstrdup(op->hostname);
+    w->pid = pid;
+    w->sock = sv[0];
+    w->next = workers;
+    workers = w;
+
+    debug("started worker %d for %s", pid, op->hostname);
+
+    return w;
+}
+
+static void forget_worker(struct worker *w) {
+    struct worker **wp = &workers;
+
+    while (*wp != w)
+        wp = &(*wp)->next;
+    *wp = w->next;
+
+    close(w->sock);
+    free(w->hostname);
+    free(w);
+}
+
+/* only our own ceocs get to use our tickets */
+static int check_peer(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        errorpe("getsockopt: SO_PEERCRED");
+        return -1;
+    }
+    if (cred.uid != getuid()) {
+        error("refusing connection from uid %d", (int)cred.uid);
+        return -1;
+    }
+    return 0;
+}
+
+/* What the ceoc on fd wants, from the header of its request. The socket
+ * is only read once poll says so, and a ceoc writes the header whole, so
+ * anything less means it has gone or is not a ceoc. */
+static struct op *peek_op(int fd) {
+    uint32_t header[2];
+
+    if (recv(fd, header, sizeof(header), MSG_PEEK|MSG_DONTWAIT) != sizeof(header))
+        return NULL;
+
+    return find_op_id(ntohl(header[1]) & ~(MSG_FLAG_MORE | MSG_FLAG_PROGRESS));
+}
+
+static void hand_off(int listener, int fd) {
+    struct op *op = peek_op(fd);
+    struct worker *w;
+
+    if (!op) {
+        close(fd);
+        return;
+    }
+
+    route_op(op);
+
+    for (w = workers; w; w = w->next) {
+        if (!strcmp(w->hostname, op->hostname))
+            break;
+    }
+
+    /* a worker that has died gets replaced */
+    if (w && ceo_send_fd(w->sock, fd)) {
+        debug("worker %d for %s is gone", w->pid, w->hostname);
+        forget_worker(w);
+        w = NULL;
+    }
+    if (!w && ceo_send_fd(spawn_worker(listener, op, fd)->sock, fd))
+        errorpe("sendmsg");
+
+    close(fd);
+}
+
+/* Hangs up on ceocs that have waited too long to say what they want, and
+ * returns how long until the next one would be, for poll(). */
+static int expire_waiting(void) {
+    long long now = monotonic_ms();
+    int wait = -1;
+
+    for (int i = 0; ceod_header_timeout && i < nwaiting; ) {
+        long long left = waiting[i].since + ceod_header_timeout * 1000LL - now;
+
+        if (left <= 0) {
+            debug("ceoc took too long to send its request");
+            close(waiting[i].fd);
+            waiting[i] = waiting[--nwaiting];
+        } else {
+            if (wait < 0 || left < wait)
+                wait = left;
+            i++;
+        }
+    }
+    return wait;
+}
+
+static int open_agent_socket(struct strbuf *path) {
+    struct sockaddr_un addr;
+    int sock;
+
+    if (runtime_dir(path))
+        fatal("XDG_RUNTIME_DIR is not set");
+    if (mkdir(path->buf, 0700) && errno != EEXIST)
+        fatalpe("mkdir: %s", path->buf);
+    strbuf_addstr(path, "/agent");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path->len >= sizeof(addr.sun_path))
+        fatal("socket path too long: %s", path->buf);
+    strcpy(addr.sun_path, path->buf);
+
+    sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fatalpe("socket");
+
+    /* a socket nobody answers on was left behind by an agent that died */
+    if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        fatal("another agent is listening on %s", path->buf);
+    unlink(path->buf);
+
+    umask(077);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        fatalpe("bind: %s", path->buf);
+    if (listen(sock, 128))
+        fatalpe("listen");
+
+    return sock;
+}
+
+int main(int argc, char *argv[]) {
+    struct strbuf path = STRBUF_INIT;
+    int listener;
+
+    prog = xstrdup(basename(argv[0]));
+    init_log(prog, LOG_PID, LOG_USER, 1);
+
+    if (argc != 1)
+        usage();
+
+    configure();
+    /* ops need it to tell which of them are local */
+    setup_fqdn();
+    setup_ops();
+    setup_signals();
+
+    listener = open_agent_socket(&path);
+    notice("listening on %s", path.buf);
+
+    while (!terminate) {
+        struct pollfd *pfds = xcalloc(nwaiting + 1, sizeof(*pfds));
+        int wait = expire_waiting();
+
+        pfds[0] = (struct pollfd) { .fd = listener, .events = POLLIN };
+        for (int i = 0; i < nwaiting; i++)
+            pfds[i + 1] = (struct pollfd) { .fd = waiting[i].fd, .events = POLLIN };
+
+        if (poll(pfds, nwaiting + 1, wait) < 0) {
+            if (errno != EINTR)
+                fatalpe("poll");
+            free(pfds);
+            continue;
+        }
+
+        /* pfds[i + 1] went with waiting[i] before any of them moved */
+        for (int i = nwaiting - 1; i >= 0; i--) {
+            if (pfds[i + 1].revents) {
+                int fd = waiting[i].fd;
+
+                waiting[i] = waiting[--nwaiting];
+                hand_off(listener, fd);
+            }
+        }
+
+        if (pfds[0].revents) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+
+            if (fd < 0) {
+                if (errno != EINTR && errno != EAGAIN)
+                    errorpe("accept");
+            } else if (check_peer(fd)) {
+                close(fd);
+            } else {
+                waiting = xrealloc(waiting, (nwaiting + 1) * sizeof(*waiting));
+                waiting[nwaiting++] = (struct waiting) { .fd = fd, .since = monotonic_ms() };
+            }
+        }
+
+        free(pfds);
+    }
+
+    /* workers finish what they have and exit once their socket closes */
+    unlink(path.buf);
+    close(listener);
+    while (nwaiting)
+        close(waiting[--nwaiting].fd);
+    free(waiting);
+    while (workers)
+        forget_worker(workers);
+
+    strbuf_release(&path);
+    free_fqdn();
+    free_config();
+    free_ops();
+    free(prog);
+
+    return 0;
+}
@@ -1,108 +1,435 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <sysexits.h>
+#include <sys/un.h>
 
 #include "util.h"
 #include "net.h"
 #include "gss.h"
 #include "ops.h"
 #include "config.h"
+#include "remote.h"
+#include "route.h"
 
 char *prog = NULL;
 
+/* With --progress we ask for the op's progress reports, and they go to
+ * stdout as they come, followed by the response, each framed as on the
+ * network (see net.h) so that the caller can tell them apart. */
+static int progress;
+
+static int serve;
+
 static struct option opts[] = {
+    { "progress", 0, NULL, 'p' },
+    { "serve", 0, NULL, 's' },
     { NULL, 0, NULL, '\0' },
 };
 
 static void usage() {
-    fprintf(stderr, "Usage: %s op\n", prog);
+    fprintf(stderr, "Usage: %s [--progress] op\n       %s --serve\n", prog, prog);
     exit(2);
 }
 
-static void send_gss_token(int sock, struct sockaddr *addr, socklen_t addrlen, gss_buffer_t token) {
-    OM_uint32 maj_stat, min_stat;
+/* how long the server asked us to wait in a MSG_BUSY response */
+static uint32_t busy_retry_ms(struct strbuf *msg) {
+    uint32_t retry_ms;
 
-    if (ceo_send_message(sock, token->value, token->length, MSG_AUTH))
-        fatalpe("write");
+    if (msg->len != sizeof(retry_ms))
+        fatal("bad busy response from server");
+    memcpy(&retry_ms, msg->buf, sizeof(retry_ms));
+    return ntohl(retry_ms);
+}
+
+/* exits if the server did not run op, with what it sent instead */
+static void check_refusal(struct op *op, uint32_t msgtype, struct strbuf *msg) {
+    if (msgtype == MSG_BUSY) {
+        error("%s is busy, retry after %u ms", op->hostname, busy_retry_ms(msg));
+        exit(EX_TEMPFAIL);
+    }
+
+    if (msgtype == MSG_TIMEOUT) {
+        uint32_t timeout;
 
-    maj_stat = gss_release_buffer(&min_stat, token);
-    if (maj_stat != GSS_S_COMPLETE)
-        gss_fatal("gss_release_buffer", maj_stat, min_stat);
+        if (msg->len != sizeof(timeout))
+            fatal("bad timeout response from server");
+        memcpy(&timeout, msg->buf, sizeof(timeout));
+        error("op %s timed out on %s after %u seconds", op->name, op->hostname, ntohl(timeout));
+        exit(EX_UNAVAILABLE);
+    }
 }
 
-static void client_gss_auth(int sock, struct sockaddr *addr, socklen_t addrlen) {
-    gss_buffer_desc incoming_tok, outgoing_tok;
-    struct strbuf msg = STRBUF_INIT;
+/* Runs op through ceoc-agent if one is listening, which has the connection
+ * to the server open already. Returns -1 if there is no agent to ask. */
+static int run_agent(struct op *op, struct strbuf *in, struct strbuf *out) {
+    struct strbuf path = STRBUF_INIT, msg = STRBUF_INIT;
+    struct sockaddr_un addr;
     uint32_t msgtype;
-    int complete;
+    int sock;
 
-    complete = initial_client_token(&outgoing_tok);
+    if (runtime_dir(&path))
+        return -1;
+    strbuf_addstr(&path, "/agent");
 
-    for (;;) {
-        if (outgoing_tok.length)
-            send_gss_token(sock, addr, addrlen, &outgoing_tok);
-        else if (!complete)
-            fatal("no token to send during auth");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.len >= sizeof(addr.sun_path)) {
+        strbuf_release(&path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path.buf);
+    strbuf_release(&path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fatalpe("socket");
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
 
-        if (complete)
+    if (ceo_write_message(sock, in->buf, in->len, progress ? op->id | MSG_FLAG_PROGRESS : op->id))
+        fatalpe("write");
+
+    for (;;) {
+        if (ceo_read_message(sock, &msg, &msgtype))
+            fatal("no response received for op %s", op->name);
+        if (msgtype != (op->id | MSG_FLAG_PROGRESS))
             break;
+        if (ceo_write_message(STDOUT_FILENO, msg.buf, msg.len, msgtype))
+            fatalpe("write");
+    }
+
+    check_refusal(op, msgtype, &msg);
+    if (msgtype != op->id)
+        fatal("wrong message type from agent: expected %d got %d", op->id, msgtype);
+    strbuf_addbuf(out, &msg);
+
+    close(sock);
+    strbuf_release(&msg);
+
+    return 0;
+}
+
+/* the features we ask for, with progress reports if we pass them on */
+static uint32_t wanted_features(int reports) {
+    uint32_t wanted = CEO_FEATURE_PIPELINE | CEO_FEATURE_CHUNKED;
+    struct strbuf dir = STRBUF_INIT;
+
+    if (reports)
+        wanted |= CEO_FEATURE_PROGRESS;
+    if (ceod_compress_threshold)
+        wanted |= CEO_FEATURE_COMPRESS;
+    if (!ticket_dir(&dir))
+        wanted |= CEO_FEATURE_RESUME;
+
+    strbuf_release(&dir);
+    return wanted;
+}
+
+static void send_request(struct ceo_conn *conn, struct op *op, struct strbuf *in, uint32_t reqid,
+                         uint32_t features) {
+    struct strbuf cipher = STRBUF_INIT;
+
+    gss_encipher_frames(in, &cipher, op->id, reqid, features);
+    if (full_write(conn->fd, cipher.buf, cipher.len))
+        fatalpe("write");
+
+    strbuf_release(&cipher);
+}
+
+/* Reads the response to request reqid for op onto the end of out, and
+ * passes its progress reports on to the reports fd as they come, unless it
+ * is -1. Returns its type: op->id, or MSG_BUSY or MSG_TIMEOUT with what the
+ * server sent in out as it is. If the server goes quiet for longer than
+ * response_timeout() or hangs up, the request may still have run, so
+ * rather than trying another host we exit, holding this one back. */
+static uint32_t read_response(struct ceo_conn *conn, struct op *op, uint32_t reqid, uint32_t features,
+                              struct strbuf *out, int reports) {
+    struct strbuf frame = STRBUF_INIT, report = STRBUF_INIT;
+    uint32_t msgtype, type, resp_id;
+    int pipelined = features & CEO_FEATURE_PIPELINE;
 
-        if (ceo_receive_message(sock, &msg, &msgtype))
-            fatal("connection closed during auth");
+    conn->timeouts[CONN_IDLE] = response_timeout(op);
 
-        if (msgtype != MSG_AUTH)
-            fatal("unexpected message type 0x%x", msgtype);
+    for (;;) {
+        if (remote_read_frame(conn, &frame, &msgtype, pipelined ? &resp_id : NULL)) {
+            route_failed(op, 0);
+            fatal("no response received from %s for op %s", op->hostname, op->name);
+        }
 
-        incoming_tok.value = msg.buf;
-        incoming_tok.length = msg.len;
+        if (pipelined && resp_id != reqid)
+            fatal("response to unknown request %u from server", resp_id);
 
-        complete = process_client_token(&incoming_tok, &outgoing_tok);
+        type = msgtype & ~MSG_FLAG_COMPRESSED;
+
+        if (type == (op->id | MSG_FLAG_PROGRESS) && (features & CEO_FEATURE_PROGRESS)) {
+            if (reports < 0)
+                continue;
+            strbuf_reset(&report);
+            gss_decipher_frame(&frame, &report, msgtype);
+            if (ceo_write_message(reports, report.buf, report.len, type))
+                fatalpe("write");
+            continue;
+        }
+
+        /* all but the last chunk of a big response */
+        if (!(type & MSG_FLAG_MORE))
+            break;
+        if ((type & ~MSG_FLAG_MORE) != op->id)
+            fatal("unexpected chunk of message type %d from server", type & ~MSG_FLAG_MORE);
+        gss_decipher_frame(&frame, out, msgtype);
     }
 
+    if (type == MSG_BUSY || type == MSG_TIMEOUT)
+        strbuf_addbuf(out, &frame);
+    else if (type == op->id)
+        gss_decipher_frame(&frame, out, msgtype);
+    else
+        fatal("wrong message type from server: expected %d got %d", op->id, type);
+
+    strbuf_release(&frame);
+    strbuf_release(&report);
+    return type;
+}
+
+/* Asks for a ticket for our next connection, which the server sends once
+ * it has answered every request before this. */
+static void ask_ticket(struct ceo_conn *conn, uint32_t wanted, uint32_t features) {
+    struct strbuf out = STRBUF_INIT;
+    int pipelined = features & CEO_FEATURE_PIPELINE;
+    size_t frame = pipelined ? ceo_frame_start_id(&out) : ceo_frame_start(&out);
+    uint32_t next = htonl(wanted | CEO_FEATURE_PROGRESS);
+
+    strbuf_add(&out, &next, sizeof(next));
+    if (pipelined)
+        ceo_frame_finish_id(&out, frame, MSG_TICKET, 0);
+    else
+        ceo_frame_finish(&out, frame, MSG_TICKET);
+    if (full_write(conn->fd, out.buf, out.len))
+        fatalpe("write");
+
+    strbuf_release(&out);
+}
+
+/* keeps the ticket asked for, once the responses before it are in */
+static void keep_ticket(struct ceo_conn *conn, const char *hostname, uint32_t features) {
+    struct strbuf msg = STRBUF_INIT;
+    uint32_t msgtype, reqid;
+
+    if (!remote_read_frame(conn, &msg, &msgtype, (features & CEO_FEATURE_PIPELINE) ? &reqid : NULL) &&
+            msgtype == MSG_TICKET)
+        save_ticket(hostname, &msg, features);
+
     strbuf_release(&msg);
 }
 
+/* Runs op on the first of its hosts that can be reached and is not busy,
+ * which is the only one for most ops. */
 void run_remote(struct op *op, struct strbuf *in, struct strbuf *out) {
-    const char *hostname = op->hostname;
-    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    struct sockaddr_in addr;
-    uint32_t msgtype;
-    struct strbuf in_cipher = STRBUF_INIT, out_cipher = STRBUF_INIT;
+    uint32_t msgtype, features, wanted = wanted_features(progress);
+    struct ceo_conn conn;
+    long long start;
+    int sent;
 
     if (!in->len)
         fatal("no data to send");
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(9987);
-    addr.sin_addr = op->addr;
+    route_op(op);
 
-    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
-        fatalpe("connect");
+    for (;;) {
+        client_acquire_creds("ceod", op->hostname);
+
+        start = monotonic_ms();
+        if (open_remote(&conn, op, wanted, in, &features, &sent)) {
+            route_failed(op, 0);
+            if (sent)
+                fatal("lost %s after sending it op %s", op->hostname, op->name);
+            if (next_route(op))
+                fatal("cannot reach %s for op %s", op->nhosts > 1 ? "any host" : op->hostname, op->name);
+            continue;
+        }
 
-    client_acquire_creds("ceod", hostname);
-    client_gss_auth(sock, (sa *)&addr, sizeof(addr));
+        /* otherwise it is on its way already */
+        if (!sent)
+            send_request(&conn, op, in, 1, features);
 
-    gss_encipher(in, &in_cipher);
+        if (features & CEO_FEATURE_RESUME)
+            ask_ticket(&conn, wanted, features);
 
-    if (ceo_send_message(sock, in_cipher.buf, in_cipher.len, op->id))
-        fatalpe("write");
+        msgtype = read_response(&conn, op, 1, features, out, progress ? STDOUT_FILENO : -1);
 
-    if (ceo_receive_message(sock, &out_cipher, &msgtype))
-        fatal("no response received for op %s", op->name);
+        /* it has not been run, so another host may */
+        if (msgtype == MSG_BUSY && op->nhosts > 1) {
+            debug("%s is busy", op->hostname);
+            route_failed(op, busy_retry_ms(out));
+            if (!next_route(op)) {
+                close_remote(&conn);
+                strbuf_reset(out);
+                continue;
+            }
+        }
+        break;
+    }
 
-    gss_decipher(&out_cipher, out);
+    check_refusal(op, msgtype, out);
+    route_done(op, monotonic_ms() - start);
 
-    if (msgtype != op->id)
-        fatal("wrong message type from server: expected %d got %d", op->id, msgtype);
+    if (features & CEO_FEATURE_RESUME)
+        keep_ticket(&conn, op->hostname, features);
 
-    if (close(sock))
+    if (close(conn.fd))
         fatalpe("close");
 
-    strbuf_release(&in_cipher);
-    strbuf_release(&out_cipher);
+    ceo_conn_release(&conn);
+}
+
+/* With --serve, ceoc runs one request after another as they come in on
+ * stdin, for as long as stdin is open, keeping a connection to each host it
+ * has talked to. Every request is a message framed as on the network (see
+ * net.h) whose body is the name of the op, a NUL and the op's request, and
+ * whose type is MSG_FLAG_PROGRESS if we are to pass on the op's progress
+ * reports, or 0. The reports and then the response (or MSG_BUSY or
+ * MSG_TIMEOUT, as ceod sent it) go to stdout framed as with --progress.
+ * If anything goes wrong, ceoc exits without a response. Requests for an
+ * op on several hosts go to whichever route_op() picks for each, but do
+ * not fail over: if the host cannot be reached or stops answering, ceoc
+ * exits as for anything else, and the host is held back from the next
+ * ceoc's requests.
+ *
+ * Each host has a GSS session of its own, which is made current (see
+ * gss_switch_session()) while we talk to it. */
+struct serve_host {
+    char *hostname;
+    struct gss_session *sess;
+    struct ceo_conn conn;
+    int connected;
+    uint32_t wanted, features, reqid;
+    long long last_used;
+    struct serve_host *next;
+};
+
+static struct serve_host *serve_hosts;
+
+static struct serve_host *serve_host(struct op *op) {
+    struct serve_host *h;
+
+    route_op(op);
+
+    for (h = serve_hosts; h; h = h->next) {
+        if (!strcmp(h->hostname, op->hostname))
+            break;
+    }
+
+    if (!h) {
+        h = xcalloc(1, sizeof(*h));
+        h->hostname = xstrdup(op->hostname);
+        h->sess = gss_session_new();
+        h->wanted = wanted_features(0);
+        h->next = serve_hosts;
+        serve_hosts = h;
+    }
+
+    gss_switch_session(h->sess);
+    return h;
+}
+
+static void serve_request(struct serve_host *h, struct op *op, struct strbuf *in, int reports) {
+    struct strbuf out = STRBUF_INIT;
+    long long start;
+    uint32_t type;
+    int sent;
+
+    /* ops do more work for a connection with progress reports, so we only
+     * ask for them once a request wants them */
+    if (h->connected && (remote_stale(h->last_used) || (reports && !(h->wanted & CEO_FEATURE_PROGRESS)))) {
+        debug("reconnecting to %s", h->hostname);
+        close_remote(&h->conn);
+        h->connected = 0;
+    }
+    if (reports)
+        h->wanted |= CEO_FEATURE_PROGRESS;
+
+    start = monotonic_ms();
+    if (h->connected) {
+        send_request(&h->conn, op, in, ++h->reqid, h->features);
+    } else {
+        client_acquire_creds("ceod", h->hostname);
+        /* the next ceoc's requests for op go elsewhere */
+        if (open_remote(&h->conn, op, h->wanted, in, &h->features, &sent)) {
+            route_failed(op, 0);
+            fatal("cannot reach %s", h->hostname);
+        }
+        h->connected = 1;
+        h->reqid = 1;
+        if (!sent)
+            send_request(&h->conn, op, in, h->reqid, h->features);
+    }
+
+    type = read_response(&h->conn, op, h->reqid, h->features, &out, reports ? STDOUT_FILENO : -1);
+    if (ceo_write_message(STDOUT_FILENO, out.buf, out.len, type))
+        fatalpe("write");
+    h->last_used = monotonic_ms();
+
+    if (type == op->id)
+        route_done(op, h->last_used - start);
+    else if (type == MSG_BUSY)
+        route_failed(op, busy_retry_ms(&out));
+
+    strbuf_release(&out);
+}
+
+/* hangs up on every host, taking a ticket for next time if it offers one */
+static void close_serve_hosts(void) {
+    while (serve_hosts) {
+        struct serve_host *h = serve_hosts;
+
+        serve_hosts = h->next;
+        gss_switch_session(h->sess);
+        if (h->connected && (h->features & CEO_FEATURE_RESUME)) {
+            ask_ticket(&h->conn, h->wanted, h->features);
+            keep_ticket(&h->conn, h->hostname, h->features);
+        }
+        if (h->connected)
+            close_remote(&h->conn);
+        gss_switch_session(NULL);
+        gss_session_free(h->sess);
+        free(h->hostname);
+        free(h);
+    }
+}
+
+static int serve_main(void) {
+    struct strbuf in = STRBUF_INIT;
+    uint32_t flags;
+    int ret;
+
+    while (!(ret = ceo_read_message(STDIN_FILENO, &in, &flags))) {
+        size_t namelen = strnlen(in.buf, in.len);
+        struct op *op;
+
+        if (namelen == in.len)
+            fatal("malformed request");
+        op = find_op(in.buf);
+        if (!op)
+            fatal("no such op: %s", in.buf);
+        if (namelen + 1 == in.len)
+            fatal("no data to send for op %s", op->name);
+
+        strbuf_remove(&in, 0, namelen + 1);
+        serve_request(serve_host(op), op, &in, flags & MSG_FLAG_PROGRESS);
+    }
+    if (ret < 0)
+        fatal("failed to read request");
+
+    close_serve_hosts();
+    strbuf_release(&in);
+
+    return 0;
 }
 
 int client_main(char *op_name) {
@@ -117,10 +444,15 @@ int client_main(char *op_name) {
     if (strbuf_read(&in, STDIN_FILENO, 0) < 0)
         fatalpe("read");
 
-    run_remote(op, &in, &out);
+    if (run_agent(op, &in, &out))
+        run_remote(op, &in, &out);
 
-    if (strbuf_write(&out, STDOUT_FILENO) < 0)
+    if (progress) {
+        if (ceo_write_message(STDOUT_FILENO, out.buf, out.len, op->id))
+            fatalpe("write");
+    } else if (strbuf_write(&out, STDOUT_FILENO) < 0) {
         fatalpe("write");
+    }
 
     strbuf_release(&in);
     strbuf_release(&out);
@@ -137,11 +469,18 @@ int main(int argc, char *argv[]) {
     init_log(prog, LOG_PID, LOG_USER, 1);
 
     configure();
-    setup_ops();
+    /* ops need it to tell which of them are local */
     setup_fqdn();
+    setup_ops();
 
-    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "ps", opts, NULL)) != -1) {
         switch (opt) {
+            case 'p':
+                progress = 1;
+                break;
+            case 's':
+                serve = 1;
+                break;
             case '?':
                 usage();
                 break;
@@ -150,12 +489,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (argc - optind != 1)
-        usage();
-
-    op = argv[optind++];
-
-    ret = client_main(op);
+    if (serve) {
+        if (progress || argc != optind)
+            usage();
+        ret = serve_main();
+    } else {
+        if (argc - optind != 1)
+            usage();
+        op = argv[optind++];
+        ret = client_main(op);
+    }
 
     free_gss();
     free_fqdn();
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "strbuf.h"
+#include "net.h"
+#include "ceo.pb-c.h"
+
+/* Shows what CEO_FEATURE_COMPRESS costs and saves for a frame: for a few
+ * representative bodies, the size and the time to compress and inflate it
+ * at a few zlib levels. Frames under ceod_compress_threshold and those that
+ * do not shrink go out as they are. */
+
+static const char *words[] = {
+    "successfully", "created", "ldap", "account", "principal", "group",
+    "home", "directory", "set", "quota", "unable", "to", "for",
+    "Computer Science", "Mathematics", "Software Engineering", "Statistics",
+};
+
+static const char *names[] = {
+    "Calum", "Dalek", "Michael", "Spang", "Jennifer", "Wong", "Ahmed",
+    "Khan", "Sarah", "Lee", "Ivan", "Petrov", "Maria", "Garcia",
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_response(struct strbuf *out, int count) {
+    Ceo__AddUserResponse r;
+    Ceo__StatusMessage *messages = xcalloc(count, sizeof(*messages));
+    Ceo__StatusMessage **list = xcalloc(count, sizeof(*list));
+    char (*text)[128] = xcalloc(count, sizeof(*text));
+
+    ceo__add_user_response__init(&r);
+    for (int i = 0; i < count; i++) {
+        ceo__status_message__init(&messages[i]);
+        snprintf(text[i], sizeof(text[i]), "%s %s %s %s", words[i % 2 ? 10 : 0],
+                 words[1 + i % 3], words[2 + i % 8], words[12]);
+        messages[i].status = i % 7 ? 0 : -2;
+        messages[i].message = text[i];
+        list[i] = &messages[i];
+    }
+    r.n_messages = count;
+    r.messages = list;
+
+    strbuf_grow(out, ceo__add_user_response__get_packed_size(&r));
+    strbuf_setlen(out, ceo__add_user_response__pack(&r, (uint8_t *)out->buf));
+
+    free(text);
+    free(list);
+    free(messages);
+}
+
+/* what a listing of members might look like, one per line */
+static void add_listing(struct strbuf *out, size_t size) {
+    unsigned seed = 1;
+
+    while (out->len < size) {
+        seed = seed * 1103515245 + 12345;
+        strbuf_addf(out, "%c%c%s%u\t%s %s\t%s\t%c%d\n",
+                    'a' + seed % 26, 'a' + (seed >> 8) % 26, "user", (seed >> 16) % 1000,
+                    names[seed % 14], names[(seed >> 4) % 14], words[13 + (seed >> 12) % 4],
+                    "wsf"[(seed >> 20) % 3], 2000 + (seed >> 24) % 25);
+    }
+    strbuf_setlen(out, size);
+}
+
+static void add_random(struct strbuf *out, size_t size) {
+    unsigned seed = 7;
+
+    while (out->len < size) {
+        seed = seed * 1103515245 + 12345;
+        strbuf_addch(out, seed >> 16);
+    }
+}
+
+static void bench(const char *name, struct strbuf *body, int count) {
+    static const int levels[] = { 1, 3, 6, 9 };
+    struct strbuf packed = STRBUF_INIT, plain = STRBUF_INIT;
+
+    for (int l = 0; l < sizeof(levels) / sizeof(*levels); l++) {
+        int level = levels[l];
+        double start, deflate_us, inflate_us;
+        int shrinks = 0;
+
+        start = now();
+        for (int i = 0; i < count; i++) {
+            strbuf_reset(&packed);
+            shrinks = !ceo_compress(body->buf, body->len, &packed, level);
+        }
+        deflate_us = (now() - start) / count * 1e6;
+
+        if (!shrinks) {
+            printf("%-22s %8zu %6d %10s %7s %12.1f\n", name, body->len, level, "no gain", "", deflate_us);
+            continue;
+        }
+
+        start = now();
+        for (int i = 0; i < count; i++) {
+            strbuf_reset(&plain);
+            if (ceo_decompress(packed.buf, packed.len, &plain))
+                fatal("ceo_decompress failed");
+        }
+        inflate_us = (now() - start) / count * 1e6;
+
+        if (plain.len != body->len || memcmp(plain.buf, body->buf, plain.len))
+            fatal("%s does not survive compression", name);
+
+        printf("%-22s %8zu %6d %10zu %6.1f%% %12.1f %12.1f\n", name, body->len, level,
+               packed.len, 100.0 * packed.len / body->len, deflate_us, inflate_us);
+    }
+
+    strbuf_release(&packed);
+    strbuf_release(&plain);
+}
+
+int main(int argc, char *argv[]) {
+    struct strbuf body = STRBUF_INIT;
+    int count = 2000;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (count <= 0) {
+        fprintf(stderr, "usage: %s [runs per body]\n", argv[0]);
+        exit(2);
+    }
+
+    init_log("compress-bench", 0, LOG_USER, 1);
+
+    printf("%-22s %8s %6s %10s %7s %12s %12s\n",
+           "body", "bytes", "level", "packed", "ratio", "deflate us", "inflate us");
+
+    add_response(&body, 6);
+    bench("AddUserResponse (6)", &body, count);
+    strbuf_reset(&body);
+
+    add_response(&body, 32);
+    bench("AddUserResponse (32)", &body, count);
+    strbuf_reset(&body);
+
+    add_listing(&body, 4096);
+    bench("listing 4 KiB", &body, count);
+    strbuf_reset(&body);
+
+    add_listing(&body, MSG_CHUNKLEN);
+    bench("listing chunk", &body, count);
+    strbuf_reset(&body);
+
+    add_random(&body, MSG_CHUNKLEN);
+    bench("random chunk", &body, count);
+
+    strbuf_release(&body);
+
+    return 0;
+}
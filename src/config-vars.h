@@ -22,3 +22,45 @@ CONFIG_STR(ldap_sudo_base)
 CONFIG_STR(ldap_sasl_mech)
 CONFIG_STR(ldap_sasl_realm)
 CONFIG_STR(ldap_admin_principal)
+
+/* options for ceod and its clients, which older files may lack */
+CONFIG_STR_OPT(ceod_listen_address, "0.0.0.0")
+CONFIG_INT_OPT(ceod_port, 9987)
+CONFIG_INT_OPT(ceod_listen_backlog, 128)
+CONFIG_STR_OPT(ceod_local_socket, "")
+CONFIG_INT_OPT(ceod_fastopen, 0)
+CONFIG_INT_OPT(ceod_reuseport, 0)
+CONFIG_INT_OPT(ceod_pipeline_depth, 8)
+CONFIG_INT_OPT(ceod_conn_memory, 16777216)
+CONFIG_INT_OPT(ceod_compress_threshold, 4096)
+CONFIG_INT_OPT(ceod_compress_level, 1)
+CONFIG_INT_OPT(ceod_resume_lifetime, 0)
+CONFIG_INT_OPT(ceod_resume_cache, 4096)
+CONFIG_INT_OPT(ceod_replay_cache, 0)
+CONFIG_INT_OPT(ceod_replay_window, 600)
+CONFIG_STR_OPT(ceod_replay_file, "/var/lib/ceod/replay")
+CONFIG_INT_OPT(ceod_idle_timeout, 300)
+CONFIG_INT_OPT(ceod_header_timeout, 10)
+CONFIG_INT_OPT(ceod_body_timeout, 30)
+CONFIG_INT_OPT(ceod_keepalive, 60)
+CONFIG_INT_OPT(ceod_connect_timeout, 5)
+CONFIG_INT_OPT(ceod_host_holdoff, 30)
+CONFIG_INT_OPT(ceod_response_timeout, 300)
+
+CONFIG_INT_OPT(ceod_max_inflight, 0)
+CONFIG_INT_OPT(ceod_queue_length, 64)
+CONFIG_INT_OPT(ceod_queue_timeout, 5000)
+CONFIG_INT_OPT(ceod_principal_rate, 0)
+CONFIG_INT_OPT(ceod_principal_burst, 20)
+CONFIG_STR_OPT(ceod_interactive_groups, "")
+CONFIG_INT_OPT(ceod_min_share, 10)
+
+CONFIG_INT_OPT(ceod_op_worker_lifetime, 3600)
+CONFIG_STR_OPT(ceod_cgroup, "")
+
+CONFIG_INT_OPT(ceod_pool_size, 0)
+CONFIG_INT_OPT(ceod_pool_min_spare, 2)
+CONFIG_INT_OPT(ceod_pool_max_spare, 8)
+CONFIG_INT_OPT(ceod_pool_max_requests, 1000)
+CONFIG_INT_OPT(ceod_reactor_threads, 0)
+CONFIG_INT_OPT(ceod_reactor_op_threads, 16)
@@ -11,23 +11,35 @@
 
 #define CONFIG_STR(x) char *x = DEF_STR;
 #define CONFIG_INT(x) long  x = DEF_INT;
+#define CONFIG_STR_OPT(x, def) CONFIG_STR(x)
+#define CONFIG_INT_OPT(x, def) CONFIG_INT(x)
 #include "config-vars.h"
 #undef CONFIG_STR
 #undef CONFIG_INT
+#undef CONFIG_STR_OPT
+#undef CONFIG_INT_OPT
 
+/* variables without a default must be set in the file */
 struct config_var {
     const char *name;
     void *p;
     enum { CONFIG_TYPE_STR, CONFIG_TYPE_INT } type;
+    int optional;
+    const char *str_default;
+    long int_default;
 };
 
 #define CONFIG_STR(x) {#x, &x, CONFIG_TYPE_STR },
 #define CONFIG_INT(x) {#x, &x, CONFIG_TYPE_INT },
+#define CONFIG_STR_OPT(x, def) {#x, &x, CONFIG_TYPE_STR, 1, def },
+#define CONFIG_INT_OPT(x, def) {#x, &x, CONFIG_TYPE_INT, 1, NULL, def },
 static struct config_var config_vars[] = {
 #include "config-vars.h"
 };
 #undef CONFIG_STR
 #undef CONFIG_INT
+#undef CONFIG_STR_OPT
+#undef CONFIG_INT_OPT
 
 const char *default_config_dir = "/etc/csc";
 const char *config_filename = "accounts.cf";
@@ -68,12 +80,18 @@ void configure(void) {
     for (i = 0; i < sizeof(config_vars)/sizeof(*config_vars); i++) {
         switch (config_vars[i].type) {
             case CONFIG_TYPE_STR:
-                if (*(char **)config_vars[i].p == DEF_STR)
+                if (*(char **)config_vars[i].p != DEF_STR)
+                    break;
+                if (!config_vars[i].optional)
                     badconf("undefined string variable: %s", config_vars[i].name);
+                *(char **)config_vars[i].p = xstrdup(config_vars[i].str_default);
                 break;
             case CONFIG_TYPE_INT:
-                if (*(long *)config_vars[i].p == DEF_INT)
+                if (*(long *)config_vars[i].p != DEF_INT)
+                    break;
+                if (!config_vars[i].optional)
                     badconf("undefined integer variable: %s", config_vars[i].name);
+                *(long *)config_vars[i].p = config_vars[i].int_default;
                 break;
             default:
                 fatal("unknown config var type %d", config_vars[i].type);
@@ -1,8 +1,12 @@
 #define CONFIG_STR(x) extern char *x;
 #define CONFIG_INT(x) extern long x;
+#define CONFIG_STR_OPT(x, def) CONFIG_STR(x)
+#define CONFIG_INT_OPT(x, def) CONFIG_INT(x)
 #include "config-vars.h"
 #undef CONFIG_STR
 #undef CONFIG_INT
+#undef CONFIG_STR_OPT
+#undef CONFIG_INT_OPT
 
 void configure(void);
 void free_config(void);
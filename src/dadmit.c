@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "net.h"
+#include "config.h"
+#include "daemon.h"
+#include "ops.h"
+
+/* Admission control, shared through anonymous shared memory by every slave,
+ * pool worker and reactor thread. At most ceod_max_inflight ops run at once
+ * and up to ceod_queue_length more may wait ceod_queue_timeout milliseconds
+ * for a free slot. Every principal also has a token bucket that refills at
+ * ceod_principal_rate ops per minute and holds at most ceod_principal_burst
+ * tokens. Refused requests are answered with MSG_BUSY and a retry delay.
+ *
+ * Every request falls into a scheduling class: the class= option of its op
+ * in etc/ops, except that normal ops run as interactive for members of
+ * ceod_interactive_groups. A free slot goes to the most urgent class that
+ * has requests waiting, but a less urgent class with fewer than
+ * ceod_min_share percent of the slots running goes first, so that it
+ * cannot starve. SIGUSR1 makes ceod log the queue depth and wait times of
+ * each class.
+ *
+ * Every running or waiting slot is claimed with a token of its own, which
+ * admit_op() hands back so that only the job that claimed a slot releases
+ * it; reactor threads all share a pid. Slots also record the pid that holds
+ * them and when that process started, so that the slots of a slave that
+ * died without releasing them can be reclaimed, even once its pid has been
+ * given to another process. */
+
+#define BUCKET_COUNT 1024
+#define BUCKET_PROBE 8
+#define BUCKET_NAMELEN 64
+
+struct bucket {
+    char user[BUCKET_NAMELEN];
+    double tokens;
+    struct timespec stamp;
+};
+
+struct owner {
+    unsigned long long token; /* 0 if the slot is free */
+    unsigned long long start; /* see process_start() */
+    pid_t pid;
+    int class;
+};
+
+struct class_stats {
+    unsigned long admitted;
+    unsigned long refused;
+    unsigned long long wait_ms;
+    unsigned long max_wait_ms;
+};
+
+struct admission {
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    struct bucket buckets[BUCKET_COUNT];
+    struct class_stats stats[OP_CLASSES];
+    unsigned long long next_token;
+    struct owner owners[]; /* ceod_max_inflight running, then ceod_queue_length waiting */
+};
+
+static struct admission *adm;
+static size_t adm_size;
+
+static void lock_admission(void) {
+    int err = pthread_mutex_lock(&adm->lock);
+
+    if (err == EOWNERDEAD)
+        pthread_mutex_consistent(&adm->lock);
+    else if (err)
+        fatal("pthread_mutex_lock: %s", strerror(err));
+}
+
+static void unlock_admission(void) {
+    pthread_mutex_unlock(&adm->lock);
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static struct bucket *find_bucket(const char *user) {
+    unsigned long hash = 5381;
+    struct bucket *oldest = NULL;
+
+    for (const char *p = user; *p; p++)
+        hash = hash * 33 + (unsigned char)*p;
+
+    for (int i = 0; i < BUCKET_PROBE; i++) {
+        struct bucket *b = &adm->buckets[(hash + i) % BUCKET_COUNT];
+
+        if (!strncmp(b->user, user, BUCKET_NAMELEN - 1))
+            return b;
+        if (!*b->user || !oldest || elapsed_ms(&b->stamp, &oldest->stamp) > 0)
+            oldest = b;
+        if (!*b->user)
+            break;
+    }
+
+    /* an evicted bucket was idle longest, so it would have refilled anyway */
+    memset(oldest, 0, sizeof(*oldest));
+    strncpy(oldest->user, user, BUCKET_NAMELEN - 1);
+    oldest->tokens = ceod_principal_burst;
+    clock_gettime(CLOCK_MONOTONIC, &oldest->stamp);
+
+    return oldest;
+}
+
+/* gives back the token of a request that was refused all the same */
+static void refund_token(const char *user) {
+    struct bucket *b;
+
+    if (!ceod_principal_rate)
+        return;
+
+    b = find_bucket(user);
+    if (++b->tokens > ceod_principal_burst)
+        b->tokens = ceod_principal_burst;
+}
+
+static int take_token(const char *user, const struct timespec *now, uint32_t *retry_ms) {
+    struct bucket *b;
+    double per_ms = ceod_principal_rate / 60000.0;
+
+    if (!ceod_principal_rate)
+        return 0;
+
+    b = find_bucket(user);
+    b->tokens += elapsed_ms(&b->stamp, now) * per_ms;
+    if (b->tokens > ceod_principal_burst)
+        b->tokens = ceod_principal_burst;
+    b->stamp = *now;
+
+    if (b->tokens < 1) {
+        *retry_ms = (1 - b->tokens) / per_ms + 1;
+        return -1;
+    }
+
+    b->tokens -= 1;
+    return 0;
+}
+
+/* when pid started, in clock ticks since boot, or 0 if that is unknown */
+static unsigned long long process_start(pid_t pid) {
+    unsigned long long start = 0;
+    char path[32], buf[1024], *p;
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    /* the 22nd field, counting from the end of the command name */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+                            "%*d %*d %*d %*d %*d %*d %llu", &start) != 1)
+        return 0;
+
+    return start;
+}
+
+/* ours, looked up again in each process forked since */
+static unsigned long long own_start(void) {
+    static unsigned long long start;
+    static pid_t pid;
+
+    if (pid != getpid()) {
+        pid = getpid();
+        start = process_start(pid);
+    }
+    return start;
+}
+
+static void reclaim_slots(struct owner *owners, int count) {
+    pid_t self = getpid();
+
+    for (int i = 0; i < count; i++) {
+        if (!owners[i].token || owners[i].pid == self)
+            continue;
+        if ((kill(owners[i].pid, 0) && errno == ESRCH) || process_start(owners[i].pid) != owners[i].start) {
+            warn("reclaiming admission slot of dead process %d", owners[i].pid);
+            owners[i].token = 0;
+        }
+    }
+}
+
+static int claim_slot(struct owner *owners, int count, int class) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < count; i++) {
+            if (!owners[i].token) {
+                owners[i].token = ++adm->next_token;
+                owners[i].start = own_start();
+                owners[i].pid = getpid();
+                owners[i].class = class;
+                return i;
+            }
+        }
+
+        reclaim_slots(owners, count);
+    }
+
+    return -1;
+}
+
+static int free_slots(const struct owner *owners, int count) {
+    int n = 0;
+
+    for (int i = 0; i < count; i++)
+        if (!owners[i].token)
+            n++;
+    return n;
+}
+
+static void count_classes(const struct owner *owners, int count, int *per_class) {
+    for (int i = 0; i < count; i++)
+        if (owners[i].token)
+            per_class[owners[i].class]++;
+}
+
+static int reserved_slots(void) {
+    int reserved = ceod_max_inflight * ceod_min_share / 100;
+
+    return ceod_min_share && !reserved ? 1 : reserved;
+}
+
+/* the class that the next free slot belongs to */
+static int next_class(void) {
+    int running[OP_CLASSES] = { 0 }, waiting[OP_CLASSES] = { 0 };
+
+    count_classes(adm->owners, ceod_max_inflight, running);
+    count_classes(adm->owners + ceod_max_inflight, ceod_queue_length, waiting);
+
+    for (int class = OP_CLASS_INTERACTIVE + 1; class < OP_CLASSES; class++)
+        if (waiting[class] && running[class] < reserved_slots())
+            return class;
+
+    for (int class = 0; class < OP_CLASSES; class++)
+        if (waiting[class])
+            return class;
+
+    return -1;
+}
+
+static uint32_t busy_retry_ms(void) {
+    return ceod_queue_timeout ? ceod_queue_timeout : 1000;
+}
+
+static int wait_for_slot(int class, const struct timespec *now) {
+    struct owner *waiters = adm->owners + ceod_max_inflight;
+    struct timespec deadline = *now;
+    unsigned long long token;
+    int slot = -1, waiter;
+
+    waiter = claim_slot(waiters, ceod_queue_length, class);
+    if (waiter < 0)
+        return -1;
+    token = waiters[waiter].token;
+
+    deadline.tv_sec += ceod_queue_timeout / 1000;
+    deadline.tv_nsec += (ceod_queue_timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    for (int woken = 0, expired = 0; ; woken = 1) {
+        int next = next_class();
+
+        /* A dead waiter could be holding up its class: a slot is free, but
+         * it goes to a class that nobody alive is waiting to take it for.
+         * The claim is tried once more after the timeout for that reason. */
+        if (woken && next != class && free_slots(adm->owners, ceod_max_inflight)) {
+            reclaim_slots(waiters, ceod_queue_length);
+            next = next_class();
+        }
+
+        if (next == class && (slot = claim_slot(adm->owners, ceod_max_inflight, class)) >= 0)
+            break;
+        if (expired)
+            break;
+
+        int err = pthread_cond_timedwait(&adm->freed, &adm->lock, &deadline);
+        if (err == EOWNERDEAD) {
+            pthread_mutex_consistent(&adm->lock);
+        } else if (err == ETIMEDOUT) {
+            expired = 1;
+        } else if (err) {
+            fatal("pthread_cond_timedwait: %s", strerror(err));
+        }
+    }
+
+    if (waiters[waiter].token == token)
+        waiters[waiter].token = 0;
+
+    /* with us gone, the next free slot may belong to another class */
+    pthread_cond_broadcast(&adm->freed);
+
+    return slot;
+}
+
+static int request_class(struct op *op, const char *user) {
+    char *groups, *group, *save;
+    int class = op->class;
+
+    if (class != OP_CLASS_NORMAL || !*ceod_interactive_groups)
+        return class;
+
+    groups = xstrdup(ceod_interactive_groups);
+    for (group = strtok_r(groups, " ,", &save); group; group = strtok_r(NULL, " ,", &save)) {
+        if (check_group(user, group)) {
+            class = OP_CLASS_INTERACTIVE;
+            break;
+        }
+    }
+    free(groups);
+
+    return class;
+}
+
+static void account_admission(int class, const struct timespec *from) {
+    struct class_stats *stats = &adm->stats[class];
+    struct timespec now;
+    long waited;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = elapsed_ms(from, &now);
+
+    stats->admitted++;
+    stats->wait_ms += waited;
+    if (waited > stats->max_wait_ms)
+        stats->max_wait_ms = waited;
+}
+
+/* Fills in held for release_op(), or returns -1 with *retry_ms set if the
+ * request must be refused. May block for up to ceod_queue_timeout. */
+int admit_op(struct op *op, const char *user, uint32_t *retry_ms, struct admit_token *held) {
+    struct timespec now;
+    int class, slot;
+
+    held->slot = -1;
+    held->token = 0;
+
+    if (!adm)
+        return 0;
+
+    class = request_class(op, user);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lock_admission();
+
+    if (take_token(user, &now, retry_ms)) {
+        adm->stats[class].refused++;
+        unlock_admission();
+        notice("rate limit exceeded by %s, retry in %u ms", user, *retry_ms);
+        return -1;
+    }
+
+    if (!ceod_max_inflight) {
+        account_admission(class, &now);
+        unlock_admission();
+        return 0;
+    }
+
+    if (next_class() < 0)
+        slot = claim_slot(adm->owners, ceod_max_inflight, class);
+    else
+        slot = -1;
+    if (slot < 0)
+        slot = wait_for_slot(class, &now);
+
+    if (slot < 0) {
+        /* it did not cost the principal an op */
+        refund_token(user);
+        adm->stats[class].refused++;
+    } else {
+        held->slot = slot;
+        held->token = adm->owners[slot].token;
+        account_admission(class, &now);
+    }
+
+    unlock_admission();
+
+    if (slot < 0) {
+        *retry_ms = busy_retry_ms();
+        notice("too many ops in flight, refusing %s (%s)", user, op_class_names[class]);
+        return -1;
+    }
+
+    return 0;
+}
+
+void release_op(const struct admit_token *held) {
+    if (!adm || held->slot < 0)
+        return;
+
+    lock_admission();
+    /* unless it was taken from us as if we were dead */
+    if (adm->owners[held->slot].token == held->token)
+        adm->owners[held->slot].token = 0;
+    pthread_cond_broadcast(&adm->freed);
+    unlock_admission();
+}
+
+void log_admission_stats(void) {
+    int running[OP_CLASSES] = { 0 }, waiting[OP_CLASSES] = { 0 };
+    struct class_stats stats[OP_CLASSES];
+
+    if (!adm)
+        return;
+
+    lock_admission();
+    count_classes(adm->owners, ceod_max_inflight, running);
+    count_classes(adm->owners + ceod_max_inflight, ceod_queue_length, waiting);
+    memcpy(stats, adm->stats, sizeof(stats));
+    unlock_admission();
+
+    for (int class = 0; class < OP_CLASSES; class++) {
+        notice("class %s: %d running, %d waiting, %lu admitted, %lu refused, "
+               "%llu ms average wait, %lu ms longest wait",
+               op_class_names[class], running[class], waiting[class],
+               stats[class].admitted, stats[class].refused,
+               stats[class].admitted ? stats[class].wait_ms / stats[class].admitted : 0,
+               stats[class].max_wait_ms);
+    }
+}
+
+void setup_admission(void) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    if (ceod_max_inflight < 0)
+        badconf("ceod_max_inflight must not be negative");
+    if (ceod_queue_length < 0)
+        badconf("ceod_queue_length must not be negative");
+    if (ceod_queue_timeout < 0)
+        badconf("ceod_queue_timeout must not be negative");
+    if (ceod_principal_rate < 0)
+        badconf("ceod_principal_rate must not be negative");
+    if (ceod_principal_rate && ceod_principal_burst < 1)
+        badconf("ceod_principal_burst must be positive");
+    if (ceod_min_share < 0 || ceod_min_share > 100)
+        badconf("ceod_min_share must be between 0 and 100");
+
+    if (!ceod_max_inflight && !ceod_principal_rate)
+        return;
+
+    adm_size = sizeof(*adm) + (ceod_max_inflight + ceod_queue_length) * sizeof(struct owner);
+    adm = mmap(NULL, adm_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (adm == MAP_FAILED)
+        fatalpe("mmap");
+    memset(adm, 0, adm_size);
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&adm->lock, &mattr))
+        fatal("pthread_mutex_init failed");
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&adm->freed, &cattr))
+        fatal("pthread_cond_init failed");
+    pthread_condattr_destroy(&cattr);
+}
+
+void free_admission(void) {
+    if (!adm)
+        return;
+
+    munmap(adm, adm_size);
+    adm = NULL;
+}
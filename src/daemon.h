@@ -1,7 +1,127 @@
+#include <signal.h>
+
 /* dmain.c */
 extern int terminate;
 extern int fatal_signal;
+extern int report_stats;
+extern int local_listener;
+
+struct ceo_conn;
+struct gss_session;
+struct sockaddr_storage;
+
+int open_listener(int reuseport);
+int accept_client(int server, struct sockaddr_storage *addr, const sigset_t *sigmask);
+int trust_local_peer(int sock, struct gss_session *sess, char *addrstr, size_t len);
+int conn_timeout(int phase);
+void set_conn_timeouts(struct ceo_conn *conn);
+void count_reaped(int phase);
+void log_stats(void);
 
 /* dslave.c */
 void slave_main(int sock, struct sockaddr *addr);
+void serve_client(int sock, struct sockaddr *addr);
+void setup_slave_sigs(void);
+void free_slave(void);
 void setup_slave(void);
+uint32_t server_features(uint32_t wanted);
+uint32_t local_features(uint32_t wanted);
+
+/* dadmit.c */
+struct op;
+
+void setup_admission(void);
+void free_admission(void);
+/* the running slot admit_op() gave a job, to give back to release_op() */
+struct admit_token {
+    int slot;
+    unsigned long long token;
+};
+
+int admit_op(struct op *op, const char *user, uint32_t *retry_ms, struct admit_token *held);
+void release_op(const struct admit_token *held);
+void log_admission_stats(void);
+
+/* dcgroup.c */
+
+struct op_cgroup {
+    int fd; /* cgroup.procs */
+    char path[1024];
+};
+
+struct cgroup_usage {
+    unsigned long long cpu_usec;
+    unsigned long long user_usec;
+    unsigned long long system_usec;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+};
+
+void setup_cgroups(void);
+int make_op_cgroup(struct op *op, struct op_cgroup *cg);
+int read_cgroup_usage(struct op_cgroup *cg, struct cgroup_usage *usage);
+void log_op_usage(struct op *op, const char *user, const struct cgroup_usage *before, const struct cgroup_usage *after);
+void remove_op_cgroup(struct op_cgroup *cg, struct cgroup_usage *usage);
+
+/* dpool.c */
+void setup_pool(void);
+void pool_main(int sock);
+
+/* dop.c */
+
+struct spawn_feed;
+struct spawn_progress;
+
+/* run_op() results besides success */
+enum {
+    OP_FAILED = -1,
+    OP_TIMEDOUT = SPAWN_TIMEDOUT,
+    OP_CANCELLED = SPAWN_CANCELLED,
+};
+
+struct op_job {
+    struct op *op;
+    char *user;
+    uint32_t reqid;
+    int cancel_fd;
+    struct strbuf in;
+    struct strbuf out;
+    int status;
+    uint32_t retry_ms;
+    const struct spawn_feed *feed;
+    void (*progress)(struct op_job *job, const char *msg, size_t len);
+    void (*done)(struct op_job *job);
+    void *data;
+    struct op_job *next;
+};
+
+int op_streams_input(struct op *op);
+int run_op(struct op *op, const char *user, struct strbuf *in, struct strbuf *out, int cancel_fd,
+           const struct spawn_feed *feed, const struct spawn_progress *progress);
+struct op_job *new_job(struct op *op, const char *user);
+void run_job(struct op_job *job);
+void free_job(struct op_job *job);
+void start_op_workers(void);
+void stop_op_workers(void);
+void start_runners(int count);
+void stop_runners(void);
+void submit_job(struct op_job *job);
+
+/* dresume.c */
+void setup_resume(void);
+void free_resume(void);
+int issue_ticket(struct gss_session *sess, uint32_t features, struct strbuf *out);
+int resume_session(struct gss_session *sess, const void *ticket, size_t len, uint32_t wanted,
+                   uint32_t *features);
+void count_handshake(const struct timespec *start);
+void log_resume_stats(void);
+
+/* dreplay.c */
+void setup_replay(void);
+void free_replay(void);
+int check_replay(const void *token, size_t len);
+void log_replay_stats(void);
+
+/* dreactor.c */
+void setup_reactor(void);
+void reactor_main(int sock);
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "util.h"
+#include "net.h"
+#include "config.h"
+#include "daemon.h"
+#include "ops.h"
+
+/* Resource isolation and accounting with cgroup v2. When ceod_cgroup is
+ * set, every local op gets a cgroup below it, named after the op and
+ * carrying the limits from its cpu_weight, memory_max and io_max options.
+ * Each exec'd op, op worker or zygote then runs in a cgroup of its own
+ * below that one, which is where its cpu and io usage is read back from
+ * and which is killed off and removed when it is done.
+ *
+ * For a persistent op worker the usage of a single request is the
+ * difference between readings taken before and after it; the children of
+ * a zygote can only be accounted for together, when the zygote stops. */
+
+static const char *const controllers[] = { "cpu", "memory", "io", NULL };
+
+static int write_cgroup_file(const char *dir, const char *name, const char *value) {
+    char path[1024];
+    int fd, ret = 0;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY|O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (full_write(fd, value, strlen(value)))
+        ret = -1;
+    if (close(fd))
+        ret = -1;
+
+    return ret;
+}
+
+static FILE *open_cgroup_file(const char *dir, const char *name) {
+    char path[1024];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+        return NULL;
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    return fdopen(fd, "r");
+}
+
+/* lets the children of dir use whichever of our controllers it has */
+static void enable_controllers(const char *dir) {
+    char available[256] = "", *save;
+    FILE *fp = open_cgroup_file(dir, "cgroup.controllers");
+
+    if (fp) {
+        if (!fgets(available, sizeof(available), fp))
+            available[0] = '\0';
+        fclose(fp);
+    }
+
+    for (char *c = strtok_r(available, " \n", &save); c; c = strtok_r(NULL, " \n", &save)) {
+        char enable[16];
+
+        for (int i = 0; controllers[i]; i++) {
+            if (strcmp(c, controllers[i]))
+                continue;
+            snprintf(enable, sizeof(enable), "+%s", c);
+            if (write_cgroup_file(dir, "cgroup.subtree_control", enable))
+                warnpe("cannot enable cgroup controller %s in %s", c, dir);
+        }
+    }
+}
+
+static void set_limit(struct op *op, const char *dir, const char *name, const char *value, int configured) {
+    if (!write_cgroup_file(dir, name, value))
+        return;
+    if (configured)
+        badconf("cannot set %s for op %s to '%s': %s", name, op->name, value, strerror(errno));
+    if (errno != ENOENT)
+        warnpe("cannot reset %s for op %s", name, op->name);
+}
+
+/* removes the cgroups of executions that an earlier ceod left behind */
+static void remove_stale_cgroups(const char *dir) {
+    char path[1024];
+    DIR *dp = opendir(dir);
+    struct dirent *de;
+
+    if (!dp)
+        return;
+
+    while ((de = readdir(dp))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= sizeof(path))
+            continue;
+        if (rmdir(path))
+            warnpe("cannot remove stale cgroup %s", path);
+    }
+
+    closedir(dp);
+}
+
+static void setup_op_cgroup(struct op *op) {
+    char dir[1024], weight[16];
+
+    if (snprintf(dir, sizeof(dir), "%s/%s", ceod_cgroup, op->name) >= sizeof(dir))
+        badconf("ceod_cgroup path too long");
+    if (mkdir(dir, 0755) && errno != EEXIST)
+        fatalpe("mkdir: %s", dir);
+
+    remove_stale_cgroups(dir);
+
+    snprintf(weight, sizeof(weight), "%d", op->cpu_weight ?: 100);
+    set_limit(op, dir, "cpu.weight", weight, op->cpu_weight);
+    set_limit(op, dir, "memory.max", op->memory_max ?: "max", !!op->memory_max);
+    if (op->io_max)
+        set_limit(op, dir, "io.max", op->io_max, 1);
+
+    enable_controllers(dir);
+}
+
+void setup_cgroups(void) {
+    struct statfs sfs;
+
+    if (!*ceod_cgroup) {
+        for (struct op *op = list_ops(); op; op = op->next)
+            if (op->local && (op->cpu_weight || op->memory_max || op->io_max))
+                warn("ignoring resource limits of op %s without ceod_cgroup", op->name);
+        return;
+    }
+
+    if (statfs(ceod_cgroup, &sfs))
+        badconf("ceod_cgroup: %s: %s", ceod_cgroup, strerror(errno));
+    if (sfs.f_type != CGROUP2_SUPER_MAGIC)
+        badconf("ceod_cgroup: %s is not in a cgroup v2 hierarchy", ceod_cgroup);
+
+    enable_controllers(ceod_cgroup);
+
+    for (struct op *op = list_ops(); op; op = op->next)
+        if (op->local)
+            setup_op_cgroup(op);
+}
+
+/* Creates a cgroup for one execution of op and opens its cgroup.procs as
+ * cg->fd, for spawn_process(). cg->fd is -1 if cgroups are not in use. */
+int make_op_cgroup(struct op *op, struct op_cgroup *cg) {
+    static unsigned long serial;
+    unsigned long n = __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED);
+    char procs[1024];
+
+    cg->fd = -1;
+    if (!*ceod_cgroup)
+        return 0;
+
+    if (snprintf(cg->path, sizeof(cg->path), "%s/%s/%d-%lu", ceod_cgroup, op->name, getpid(), n) >= sizeof(cg->path) ||
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", cg->path) >= sizeof(procs)) {
+        error("cgroup path for op %s too long", op->name);
+        return -1;
+    }
+
+    if (mkdir(cg->path, 0755)) {
+        errorpe("mkdir: %s", cg->path);
+        return -1;
+    }
+
+    cg->fd = open(procs, O_WRONLY|O_CLOEXEC);
+    if (cg->fd < 0) {
+        errorpe("open: %s", procs);
+        rmdir(cg->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_usage(const char *dir, struct cgroup_usage *usage) {
+    char key[64];
+    unsigned long long value, rbytes, wbytes;
+    FILE *fp;
+
+    memset(usage, 0, sizeof(*usage));
+
+    fp = open_cgroup_file(dir, "cpu.stat");
+    if (!fp) {
+        warnpe("cannot read cpu.stat of %s", dir);
+        return -1;
+    }
+    while (fscanf(fp, "%63s %llu", key, &value) == 2) {
+        if (!strcmp(key, "usage_usec"))
+            usage->cpu_usec = value;
+        else if (!strcmp(key, "user_usec"))
+            usage->user_usec = value;
+        else if (!strcmp(key, "system_usec"))
+            usage->system_usec = value;
+    }
+    fclose(fp);
+
+    /* only there with the io controller; one line per device */
+    fp = open_cgroup_file(dir, "io.stat");
+    if (fp) {
+        char line[512];
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%*s rbytes=%llu wbytes=%llu", &rbytes, &wbytes) == 2) {
+                usage->read_bytes += rbytes;
+                usage->write_bytes += wbytes;
+            }
+        }
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+int read_cgroup_usage(struct op_cgroup *cg, struct cgroup_usage *usage) {
+    if (cg->fd < 0) {
+        memset(usage, 0, sizeof(*usage));
+        return -1;
+    }
+
+    return read_usage(cg->path, usage);
+}
+
+/* logs what op used for user, since before if not NULL; a NULL user
+ * stands for everything a zygote has run */
+void log_op_usage(struct op *op, const char *user, const struct cgroup_usage *before, const struct cgroup_usage *after) {
+    struct cgroup_usage zero = { 0 }, d;
+
+    if (!before)
+        before = &zero;
+
+    d.cpu_usec = after->cpu_usec - before->cpu_usec;
+    d.user_usec = after->user_usec - before->user_usec;
+    d.system_usec = after->system_usec - before->system_usec;
+    d.read_bytes = after->read_bytes - before->read_bytes;
+    d.write_bytes = after->write_bytes - before->write_bytes;
+
+    notice("op %s %s%s used %llu.%03llus cpu (%llu.%03llus user, %llu.%03llus system), read %llu bytes, wrote %llu bytes",
+           op->name, user ? "for " : "via zygote", user ?: "",
+           d.cpu_usec / 1000000, d.cpu_usec / 1000 % 1000,
+           d.user_usec / 1000000, d.user_usec / 1000 % 1000,
+           d.system_usec / 1000000, d.system_usec / 1000 % 1000,
+           d.read_bytes, d.write_bytes);
+}
+
+static int cgroup_populated(const char *dir) {
+    char key[64];
+    int value, populated = 0;
+    FILE *fp = open_cgroup_file(dir, "cgroup.events");
+
+    if (!fp)
+        return 0;
+    while (fscanf(fp, "%63s %d", key, &value) == 2)
+        if (!strcmp(key, "populated"))
+            populated = value;
+    fclose(fp);
+
+    return populated;
+}
+
+/* Kills whatever is left in the cgroup, reads its final usage (if usage is
+ * not NULL) and removes it. */
+void remove_op_cgroup(struct op_cgroup *cg, struct cgroup_usage *usage) {
+    if (cg->fd < 0) {
+        if (usage)
+            memset(usage, 0, sizeof(*usage));
+        return;
+    }
+
+    close(cg->fd);
+    cg->fd = -1;
+
+    if (cgroup_populated(cg->path)) {
+        if (write_cgroup_file(cg->path, "cgroup.kill", "1"))
+            warnpe("cannot kill %s", cg->path);
+        for (int i = 0; i < 100 && cgroup_populated(cg->path); i++)
+            usleep(10000);
+    }
+
+    if (usage)
+        read_usage(cg->path, usage);
+
+    if (rmdir(cg->path))
+        warnpe("cannot remove cgroup %s", cg->path);
+}
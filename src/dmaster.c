@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,6 +11,11 @@
 #include <netdb.h>
 #include <alloca.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "util.h"
 #include "net.h"
@@ -31,9 +37,14 @@ char *prog = NULL;
 
 int terminate = 0;
 int fatal_signal;
+int report_stats = 0;
+int local_listener = -1;
 
 static int detach = 0;
 
+/* connections reaped for each kind of timeout, counted across processes */
+static unsigned long *reaped;
+
 static void usage() {
     fprintf(stderr, "Usage: %s [--detach]\n", prog);
     exit(2);
@@ -46,6 +57,8 @@ static void signal_handler(int sig) {
         terminate = 1;
         fatal_signal = sig;
         signal(sig, SIG_DFL);
+    } else if (sig == SIGUSR1) {
+        report_stats = 1;
     } else if (sig == SIGSEGV) {
         error("segmentation fault");
         signal(sig, SIG_DFL);
@@ -64,6 +77,7 @@ static void setup_signals(void) {
     sigaction(SIGINT,  &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
 
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
@@ -119,13 +133,11 @@ static void setup_auth(void) {
 }
 
 static void accept_one_client(int server) {
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    memset(&addr, 0, addrlen);
+    struct sockaddr_storage addr;
 
-    int client = accept(server, (sa *)&addr, &addrlen);
+    int client = accept_client(server, &addr, NULL);
     if (client < 0) {
-        if (errno == EINTR)
+        if (errno == EINTR || errno == EAGAIN)
             return;
         fatalpe("accept");
     }
@@ -133,6 +145,8 @@ static void accept_one_client(int server) {
     pid_t pid = fork();
     if (!pid) {
         close(server);
+        if (local_listener >= 0)
+            close(local_listener);
         slave_main(client, (sa *)&addr);
         exit(0);
     }
@@ -140,16 +154,59 @@ static void accept_one_client(int server) {
     close(client);
 }
 
-static int master_main(void) {
+static void setup_reaping(void) {
+    reaped = mmap(NULL, CONN_PHASES * sizeof(*reaped), PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (reaped == MAP_FAILED)
+        fatalpe("mmap");
+}
+
+/* how long a connection may spend in phase, in ms (0 for no limit) */
+int conn_timeout(int phase) {
+    switch (phase) {
+        case CONN_IDLE:
+            return ceod_idle_timeout * 1000;
+        case CONN_HEADER:
+            return ceod_header_timeout * 1000;
+        default:
+            return ceod_body_timeout * 1000;
+    }
+}
+
+void set_conn_timeouts(struct ceo_conn *conn) {
+    for (int phase = 0; phase < CONN_PHASES; phase++)
+        conn->timeouts[phase] = conn_timeout(phase);
+}
+
+void count_reaped(int phase) {
+    __atomic_fetch_add(&reaped[phase], 1, __ATOMIC_RELAXED);
+}
+
+/* logged on SIGUSR1 */
+void log_stats(void) {
+    log_admission_stats();
+    log_resume_stats();
+    log_replay_stats();
+
+    notice("reaped connections: %lu idle, %lu in a header, %lu in a body, %lu not reading",
+           reaped[CONN_IDLE], reaped[CONN_HEADER], reaped[CONN_BODY], reaped[CONN_WRITE]);
+}
+
+/* With SO_REUSEPORT every worker or event loop gets a listener of its own and
+ * the kernel spreads new connections over them. Connections still queued on
+ * a listener are reset when it closes, so a pool worker that is retired or
+ * recycled serves them first (see dpool.c). */
+int open_listener(int reuseport) {
     int sock, opt;
     struct sockaddr_in addr;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(9987);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(ceod_port);
+    if (inet_pton(AF_INET, ceod_listen_address, &addr.sin_addr) != 1)
+        badconf("invalid ceod_listen_address: %s", ceod_listen_address);
 
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sock = socket(PF_INET, SOCK_STREAM|SOCK_CLOEXEC, IPPROTO_TCP);
     if (sock < 0)
         fatalpe("socket");
 
@@ -157,23 +214,202 @@ static int master_main(void) {
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
         fatalpe("setsockopt");
 
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+        fatalpe("setsockopt");
+
+    if (ceod_fastopen && ceo_set_fastopen(sock, ceod_fastopen))
+        fatalpe("setsockopt");
+
+    /* both are inherited by accepted sockets */
+    if (ceo_set_nodelay(sock))
+        fatalpe("setsockopt");
+    if (ceod_keepalive && ceo_set_keepalive(sock, ceod_keepalive))
+        fatalpe("setsockopt");
+
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
         fatalpe("bind");
 
-    if (listen(sock, 128))
+    if (listen(sock, ceod_listen_backlog))
+        fatalpe("listen");
+
+    return sock;
+}
+
+/* The local socket, for clients on this host. Anyone may connect; who they
+ * are comes from the kernel (see trust_local_peer()). It is non-blocking, as
+ * every process that waits on it may find its connection already taken. */
+static int open_local_listener(void) {
+    struct sockaddr_un addr;
+    int sock;
+
+    if (!*ceod_local_socket)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(ceod_local_socket) >= sizeof(addr.sun_path))
+        badconf("ceod_local_socket is too long: %s", ceod_local_socket);
+    strcpy(addr.sun_path, ceod_local_socket);
+
+    sock = socket(PF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fatalpe("socket");
+
+    /* left behind by an earlier ceod */
+    if (unlink(ceod_local_socket) && errno != ENOENT)
+        fatalpe("unlink: %s", ceod_local_socket);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        fatalpe("bind: %s", ceod_local_socket);
+    /* anyone on the host may connect, as themselves */
+    if (chmod(ceod_local_socket, 0666))
+        fatalpe("chmod: %s", ceod_local_socket);
+
+    if (listen(sock, ceod_listen_backlog))
         fatalpe("listen");
 
+    return sock;
+}
+
+/* Waits for a connection on server or on the local socket and accepts it.
+ * Returns -1 with errno set to EAGAIN if someone else got to it first. With
+ * sigmask, signals are let in (as in ppoll()) only while it waits, so a
+ * signal that ends the wait cannot land after a connection is taken. */
+int accept_client(int server, struct sockaddr_storage *addr, const sigset_t *sigmask) {
+    struct pollfd fds[2] = {
+        { .fd = server, .events = POLLIN },
+        { .fd = local_listener, .events = POLLIN },
+    };
+    int nfds = local_listener < 0 ? 1 : 2;
+    socklen_t addrlen = sizeof(*addr);
+
+    memset(addr, 0, addrlen);
+
+    if (nfds == 1 && !sigmask)
+        return accept(server, (sa *)addr, &addrlen);
+
+    if (ppoll(fds, nfds, NULL, sigmask) < 0)
+        return -1;
+
+    return accept(nfds == 2 && fds[1].revents ? local_listener : server, (sa *)addr, &addrlen);
+}
+
+/* A client on the local socket is whoever the kernel says its uid is, so
+ * sess is authenticated as that user without further ado. Names the peer
+ * in addrstr for the logs. */
+int trust_local_peer(int sock, struct gss_session *sess, char *addrstr, size_t len) {
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    struct passwd pw, *result;
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    char *buf = NULL;
+    int err;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) {
+        errorpe("getsockopt");
+        return -1;
+    }
+    snprintf(addrstr, len, "uid %u", (unsigned)cred.uid);
+
+    /* the limit is only a hint, and may not be given at all */
+    if (size <= 0)
+        size = 1024;
+    for (;;) {
+        buf = xrealloc(buf, size);
+        err = getpwuid_r(cred.uid, &pw, buf, size, &result);
+        if (err != ERANGE || size >= 1 << 20)
+            break;
+        size *= 2;
+    }
+    if (!result) {
+        if (err)
+            error("getpwuid_r: %s", strerror(err));
+        else
+            error("no user has uid %u", (unsigned)cred.uid);
+        free(buf);
+        return -1;
+    }
+
+    gss_session_trust(sess, pw.pw_name);
+    notice("local client is %s", pw.pw_name);
+
+    free(buf);
+    return 0;
+}
+
+static void check_listen_config(void) {
+    if (ceod_port <= 0 || ceod_port > 65535)
+        badconf("invalid ceod_port: %ld", ceod_port);
+    if (ceod_listen_backlog <= 0)
+        badconf("ceod_listen_backlog must be positive");
+    if (ceod_fastopen < 0)
+        badconf("ceod_fastopen must not be negative");
+    if (ceod_pipeline_depth < 1)
+        badconf("ceod_pipeline_depth must be positive");
+    if (ceod_conn_memory < MSG_CHUNKLEN)
+        badconf("ceod_conn_memory must be at least %d", MSG_CHUNKLEN);
+    if (ceod_compress_threshold < 0)
+        badconf("ceod_compress_threshold must not be negative");
+    if (ceod_compress_level < 1 || ceod_compress_level > 9)
+        badconf("ceod_compress_level must be between 1 and 9");
+    if (ceod_idle_timeout < 0 || ceod_header_timeout < 0 || ceod_body_timeout < 0)
+        badconf("ceod timeouts must not be negative");
+    if (ceod_keepalive < 0)
+        badconf("ceod_keepalive must not be negative");
+    if (ceod_reuseport && !ceod_pool_size && !ceod_reactor_threads)
+        badconf("ceod_reuseport requires ceod_pool_size or ceod_reactor_threads");
+}
+
+static int master_main(void) {
+    int sock = -1;
+
+    check_listen_config();
+    setup_reaping();
+
+    if (!ceod_reuseport)
+        sock = open_listener(0);
+    local_listener = open_local_listener();
+
+    /* workers that wait on both listeners may be woken for a connection
+     * that another one takes */
+    if (sock >= 0 && local_listener >= 0 &&
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK))
+        fatalpe("fcntl");
+
     setup_fqdn();
     setup_signals();
+    setup_replay();
     setup_auth();
     setup_ops();
+    setup_cgroups();
+    setup_admission();
+    setup_resume();
+    setup_pool();
+    setup_reactor();
     setup_daemon();
 
     notice("now accepting connections");
 
-    while (!terminate)
-        accept_one_client(sock);
+    if (ceod_pool_size) {
+        pool_main(sock);
+    } else if (ceod_reactor_threads) {
+        reactor_main(sock);
+    } else {
+        while (!terminate) {
+            accept_one_client(sock);
+            if (report_stats) {
+                report_stats = 0;
+                log_stats();
+            }
+        }
+    }
+
+    if (local_listener >= 0 && unlink(ceod_local_socket))
+        warnpe("unlink: %s", ceod_local_socket);
 
+    free_admission();
+    free_resume();
+    free_replay();
     free_gss();
     free_fqdn();
     free_ops();
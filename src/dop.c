@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "strbuf.h"
+#include "net.h"
+#include "config.h"
+#include "daemon.h"
+#include "ops.h"
+
+/* Running ops on behalf of a client. run_op() blocks until the op has
+ * finished; the runner threads let a caller that must not block (the
+ * reactor) hand ops off and be called back when they are done.
+ *
+ * Ops with mode=persistent are normally exec'd like any other, but in a
+ * long-lived process (a pool worker or the reactor) they run as op workers
+ * instead: the op is started once with CEO_OP_WORKER set and then handles
+ * one request after another over a socketpair, framed as on the network.
+ * A request is the client's username, a NUL and the op's input; the reply
+ * is the op's output, possibly after progress reports framed with
+ * MSG_FLAG_PROGRESS, which the op only sends if the request had that flag
+ * as well. Ops that are exec'd send theirs to CEO_PROGRESS_FD instead, if
+ * it is set (see struct spawn_progress). Idle op workers are kept for reuse, and one that
+ * fails or exits is simply replaced by a fresh one on the next request.
+ *
+ * Ops with mode=zygote get a zygote per process instead (or a few, if
+ * several threads hand the op requests at once), started as ceod's own
+ * user. For each request we hand it one end of a new socketpair, and it
+ * forks a child that drops to the op's user and serves the request on that
+ * socket, so every request still gets a process of its own without paying
+ * for exec, dynamic linking and reading the configuration. */
+
+struct op_worker {
+    struct op *op;
+    pid_t pid;
+    int fd;
+    struct op_cgroup cgroup;
+    struct op_worker *next;
+};
+
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct op_worker *idle_workers;
+static struct op_worker *zygotes;
+static int keep_workers;
+
+static struct op_worker *spawn_op_worker(struct op *op) {
+    struct op_worker *worker = xmalloc(sizeof(*worker));
+    char *envp[16];
+    char *argv[] = { op->path, NULL, };
+    char timeout[16];
+    int sv[2];
+    pid_t pid;
+
+    if (make_op_cgroup(op, &worker->cgroup)) {
+        free(worker);
+        return NULL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv)) {
+        errorpe("socketpair");
+        remove_op_cgroup(&worker->cgroup, NULL);
+        free(worker);
+        return NULL;
+    }
+
+    int fds[SPAWN_FDS] = { sv[1], sv[1], -1, -1 };
+
+    snprintf(timeout, sizeof(timeout), "%d", op->timeout);
+
+    if (op->mode == OP_ZYGOTE)
+        make_env(envp, "LANG", "C", "CEO_CONFIG_DIR", config_dir,
+                       "CEO_OP_WORKER", "zygote", "CEO_OP_USER", op->user,
+                       "CEO_OP_TIMEOUT", timeout, NULL);
+    else
+        make_env(envp, "LANG", "C", "CEO_CONFIG_DIR", config_dir,
+                       "CEO_OP_WORKER", "persistent", NULL);
+
+    pid = spawn_process(op->path, argv, envp, fds, op->mode == OP_ZYGOTE ? NULL : op->user,
+                        SPAWN_PGRP, worker->cgroup.fd);
+    if (pid < 0) {
+        free_env(envp);
+        close(sv[0]);
+        close(sv[1]);
+        remove_op_cgroup(&worker->cgroup, NULL);
+        free(worker);
+        return NULL;
+    }
+
+    free_env(envp);
+    close(sv[1]);
+
+    debug("started %s %d for %s", op->mode == OP_ZYGOTE ? "zygote" : "op worker", pid, op->name);
+
+    worker->op = op;
+    worker->pid = pid;
+    worker->fd = sv[0];
+    worker->next = NULL;
+
+    return worker;
+}
+
+/* a zygote's usage is all its children's, which we can't tell apart */
+static void remove_worker_cgroup(struct op_worker *worker) {
+    struct cgroup_usage usage;
+
+    if (worker->op->mode == OP_ZYGOTE && worker->cgroup.fd >= 0) {
+        remove_op_cgroup(&worker->cgroup, &usage);
+        log_op_usage(worker->op, NULL, NULL, &usage);
+    } else {
+        remove_op_cgroup(&worker->cgroup, NULL);
+    }
+}
+
+static void stop_op_worker(struct op_worker *worker) {
+    int status;
+
+    /* the worker exits when it reads EOF */
+    close(worker->fd);
+    if (waitpid(worker->pid, &status, 0) < 0)
+        errorpe("waitpid");
+    else if (WIFSIGNALED(status))
+        notice("op worker %s killed by signal %d", worker->op->name, WTERMSIG(status));
+    else if (WEXITSTATUS(status))
+        notice("op worker %s exited with status %d", worker->op->name, WEXITSTATUS(status));
+
+    remove_worker_cgroup(worker);
+    free(worker);
+}
+
+static void kill_op_worker(struct op_worker *worker) {
+    close(worker->fd);
+    kill_process_group(worker->pid);
+    remove_worker_cgroup(worker);
+    free(worker);
+}
+
+static struct op_worker *take_op_worker(struct op *op) {
+    struct op_worker **prev, *worker = NULL;
+    int status;
+
+    pthread_mutex_lock(&workers_lock);
+    for (prev = &idle_workers; *prev; prev = &(*prev)->next) {
+        if ((*prev)->op == op) {
+            worker = *prev;
+            *prev = worker->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+
+    /* don't hand out a worker that died while it was idle */
+    if (worker && waitpid(worker->pid, &status, WNOHANG) == worker->pid) {
+        notice("op worker %s exited while idle", op->name);
+        close(worker->fd);
+        remove_worker_cgroup(worker);
+        free(worker);
+        worker = NULL;
+    }
+
+    return worker ?: spawn_op_worker(op);
+}
+
+static void put_op_worker(struct op_worker *worker) {
+    pthread_mutex_lock(&workers_lock);
+    worker->next = idle_workers;
+    idle_workers = worker;
+    pthread_mutex_unlock(&workers_lock);
+}
+
+/* waits for the op's reply to become readable, until deadline (unless 0) */
+static int wait_for_reply(int fd, struct op *op, int cancel_fd, long long deadline) {
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = cancel_fd, .events = POLLRDHUP },
+    };
+    long long timeout = deadline ? deadline - monotonic_ms() : -1;
+    int ret;
+
+    if (deadline && timeout < 0)
+        timeout = 0;
+
+    do {
+        ret = poll(pfd, cancel_fd >= 0 ? 2 : 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        errorpe("poll");
+        return OP_FAILED;
+    }
+    if (!ret) {
+        notice("op %s timed out after %d seconds", op->name, op->timeout);
+        return OP_TIMEDOUT;
+    }
+    if (pfd[1].revents) {
+        notice("op %s cancelled", op->name);
+        return OP_CANCELLED;
+    }
+
+    return 0;
+}
+
+static int exchange_request(int fd, struct op *op, const char *user, struct strbuf *in, struct strbuf *out, int cancel_fd,
+                            const struct spawn_progress *progress) {
+    struct iovec request[] = {
+        { .iov_base = (char *)user, .iov_len = strlen(user) + 1 },
+        { .iov_base = in->buf, .iov_len = in->len },
+    };
+    long long deadline = op->timeout ? monotonic_ms() + op->timeout * 1000LL : 0;
+    uint32_t msgtype;
+    int ret;
+
+    if (ceo_write_messagev(fd, request, 2, progress ? op->id | MSG_FLAG_PROGRESS : op->id)) {
+        errorpe("write to op %s", op->name);
+        return OP_FAILED;
+    }
+
+    for (;;) {
+        ret = wait_for_reply(fd, op, cancel_fd, deadline);
+        if (ret)
+            return ret;
+
+        if (ceo_read_message(fd, out, &msgtype)) {
+            error("no response from op %s", op->name);
+            return OP_FAILED;
+        }
+
+        if (!progress || msgtype != (op->id | MSG_FLAG_PROGRESS))
+            break;
+
+        progress->report(progress->ctx, out->buf, out->len);
+        strbuf_reset(out);
+    }
+
+    if (msgtype != op->id) {
+        error("op %s sent message type 0x%x", op->name, msgtype);
+        return OP_FAILED;
+    }
+
+    return 0;
+}
+
+static int run_persistent_op(struct op *op, const char *user, struct strbuf *in, struct strbuf *out, int cancel_fd,
+                             const struct spawn_progress *progress) {
+    struct op_worker *worker = take_op_worker(op);
+    struct cgroup_usage before, after;
+    int ret;
+
+    if (!worker)
+        return OP_FAILED;
+
+    read_cgroup_usage(&worker->cgroup, &before);
+
+    ret = exchange_request(worker->fd, op, user, in, out, cancel_fd, progress);
+
+    if (!read_cgroup_usage(&worker->cgroup, &after))
+        log_op_usage(op, user, &before, &after);
+
+    if (ret == OP_TIMEDOUT || ret == OP_CANCELLED)
+        kill_op_worker(worker);
+    else if (ret)
+        stop_op_worker(worker);
+    else
+        put_op_worker(worker);
+
+    return ret;
+}
+
+/* Takes the op's zygote out of the list, so that no other thread uses it
+ * until it is put back, replacing it if it has gone away. Zygotes are
+ * started and reaped outside workers_lock, and a thread that comes along
+ * while they are all in use starts one of its own; it is kept too, so a
+ * process ends up with as many as it has threads passing the op requests. */
+static struct op_worker *take_zygote(struct op *op) {
+    struct op_worker **prev, *zygote = NULL;
+    int status;
+
+    pthread_mutex_lock(&workers_lock);
+    for (prev = &zygotes; *prev; prev = &(*prev)->next) {
+        if ((*prev)->op == op) {
+            zygote = *prev;
+            *prev = zygote->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+
+    if (zygote && waitpid(zygote->pid, &status, WNOHANG) == zygote->pid) {
+        notice("zygote for %s has exited", op->name);
+        close(zygote->fd);
+        remove_worker_cgroup(zygote);
+        free(zygote);
+        zygote = NULL;
+    }
+
+    return zygote ?: spawn_op_worker(op);
+}
+
+static void put_zygote(struct op_worker *zygote) {
+    pthread_mutex_lock(&workers_lock);
+    zygote->next = zygotes;
+    zygotes = zygote;
+    pthread_mutex_unlock(&workers_lock);
+}
+
+/* hands fd to one of the op's zygotes, starting a new one if there is
+ * none or if the old one has gone away */
+static int pass_to_zygote(struct op *op, int fd) {
+    struct op_worker *zygote;
+    int ret = -1;
+
+    for (int attempt = 0; attempt < 2 && ret; attempt++) {
+        zygote = take_zygote(op);
+        if (!zygote)
+            break;
+
+        ret = ceo_send_fd(zygote->fd, fd);
+        if (ret) {
+            errorpe("sendmsg to zygote for %s", op->name);
+            stop_op_worker(zygote);
+        } else {
+            put_zygote(zygote);
+        }
+    }
+
+    return ret;
+}
+
+/* the pid a zygote's child sends before anything else (see opworker.c) */
+static int read_zygote_child(int fd, struct op *op, int cancel_fd, pid_t *pid) {
+    long long deadline = op->timeout ? monotonic_ms() + op->timeout * 1000LL : 0;
+    uint32_t netpid;
+    int ret;
+
+    ret = wait_for_reply(fd, op, cancel_fd, deadline);
+    if (ret)
+        return ret;
+
+    if (recv(fd, &netpid, sizeof(netpid), MSG_WAITALL) != sizeof(netpid)) {
+        error("no pid from zygote for %s", op->name);
+        return OP_FAILED;
+    }
+    *pid = ntohl(netpid);
+
+    return 0;
+}
+
+/* A zygote's child is not ours to wait for, so we see it go by its end of
+ * the socket closing. SIGTERM, then after a grace period SIGKILL, its
+ * process group, as for ops that are exec'd (see kill_process_group()). */
+static void kill_zygote_child(int fd, pid_t pid) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+    long long deadline = monotonic_ms() + SPAWN_KILL_GRACE * 1000LL;
+    long long left;
+
+    kill(-pid, SIGTERM);
+    while ((left = deadline - monotonic_ms()) > 0) {
+        if (poll(&pfd, 1, left) >= 0 || errno != EINTR)
+            break;
+    }
+    /* anything the child left behind */
+    kill(-pid, SIGKILL);
+}
+
+static int run_zygote_op(struct op *op, const char *user, struct strbuf *in, struct strbuf *out, int cancel_fd,
+                         const struct spawn_progress *progress) {
+    pid_t child = 0;
+    int sv[2], ret;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv)) {
+        errorpe("socketpair");
+        return OP_FAILED;
+    }
+
+    ret = pass_to_zygote(op, sv[1]);
+    close(sv[1]);
+
+    /* a child that never got the request exits when the socket closes */
+    if (!ret)
+        ret = read_zygote_child(sv[0], op, cancel_fd, &child);
+    if (!ret)
+        ret = exchange_request(sv[0], op, user, in, out, cancel_fd, progress);
+    if ((ret == OP_TIMEDOUT || ret == OP_CANCELLED) && child > 0)
+        kill_zygote_child(sv[0], child);
+
+    close(sv[0]);
+
+    return ret;
+}
+
+/* Whether run_op() execs op, so that it can be given a feed for its input;
+ * op workers get their requests in a single frame. */
+int op_streams_input(struct op *op) {
+    return op->mode == OP_EXEC || !keep_workers;
+}
+
+/* Runs op for user, giving up after op->timeout seconds (if set) or when
+ * cancel_fd (unless -1) is hung up. If feed is not NULL (see
+ * op_streams_input()), the op's input continues with whatever it gives,
+ * and if progress is not NULL, it gets the op's progress reports as they
+ * come. Returns 0 on success, and otherwise OP_FAILED, OP_TIMEDOUT or
+ * OP_CANCELLED. */
+int run_op(struct op *op, const char *user, struct strbuf *in, struct strbuf *out, int cancel_fd,
+           const struct spawn_feed *feed, const struct spawn_progress *progress) {
+    char *envp[16];
+    char *argv[] = { op->path, NULL, };
+    char progress_fd[16];
+    struct op_cgroup cgroup;
+    struct cgroup_usage usage;
+    int status;
+
+    debug("running op: %s", op->name);
+
+    if (op->mode == OP_PERSISTENT && keep_workers)
+        return run_persistent_op(op, user, in, out, cancel_fd, progress);
+    if (op->mode == OP_ZYGOTE && keep_workers)
+        return run_zygote_op(op, user, in, out, cancel_fd, progress);
+
+    if (make_op_cgroup(op, &cgroup))
+        return OP_FAILED;
+
+    snprintf(progress_fd, sizeof(progress_fd), "%d", SPAWN_PROGRESS_FD);
+
+    if (progress)
+        make_env(envp, "LANG", "C", "CEO_USER", user,
+                       "CEO_CONFIG_DIR", config_dir, "CEO_PROGRESS_FD", progress_fd, NULL);
+    else
+        make_env(envp, "LANG", "C", "CEO_USER", user,
+                       "CEO_CONFIG_DIR", config_dir, NULL);
+
+    status = spawnvemut(op->path, argv, envp, in, out, 0, op->user, op->timeout, cancel_fd, cgroup.fd,
+                        feed, progress);
+
+    free_env(envp);
+
+    if (cgroup.fd >= 0) {
+        remove_op_cgroup(&cgroup, &usage);
+        log_op_usage(op, user, NULL, &usage);
+    }
+
+    if (status == SPAWN_TIMEDOUT || status == SPAWN_CANCELLED)
+        return status;
+
+    if (status) {
+        error("child %s failed", op->path);
+        return OP_FAILED;
+    }
+
+    return 0;
+}
+
+/* called by processes that live long enough for op workers to pay off */
+void start_op_workers(void) {
+    keep_workers = 1;
+}
+
+void stop_op_workers(void) {
+    keep_workers = 0;
+
+    while (idle_workers) {
+        struct op_worker *worker = idle_workers;
+        idle_workers = worker->next;
+        stop_op_worker(worker);
+    }
+
+    while (zygotes) {
+        struct op_worker *zygote = zygotes;
+        zygotes = zygote->next;
+        stop_op_worker(zygote);
+    }
+}
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct op_job *queue_head;
+static struct op_job **queue_tail = &queue_head;
+static pthread_t *runners;
+static int runner_count;
+static int runners_stopping;
+
+/* passes a progress report on to the job's owner, if it fits in a frame */
+static void report_progress(void *ctx, const char *msg, size_t len) {
+    struct op_job *job = ctx;
+
+    if (len > MSG_CHUNKLEN) {
+        notice("dropping %zu byte progress report from op %s", len, job->op->name);
+        return;
+    }
+
+    job->progress(job, msg, len);
+}
+
+/* admits and runs job, leaving the outcome in job->status or job->retry_ms */
+void run_job(struct op_job *job) {
+    struct spawn_progress progress = { .report = report_progress, .ctx = job };
+    struct admit_token held;
+
+    if (!admit_op(job->op, job->user, &job->retry_ms, &held)) {
+        job->status = run_op(job->op, job->user, &job->in, &job->out, job->cancel_fd, job->feed,
+                             job->progress ? &progress : NULL);
+        release_op(&held);
+    }
+}
+
+static void *runner_main(void *arg) {
+    for (;;) {
+        struct op_job *job;
+
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head && !runners_stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        job = queue_head;
+        if (job) {
+            queue_head = job->next;
+            if (!queue_head)
+                queue_tail = &queue_head;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        if (!job)
+            break;
+
+        job->next = NULL;
+
+        run_job(job);
+        job->done(job);
+    }
+
+    return NULL;
+}
+
+void start_runners(int count) {
+    runners = xcalloc(count, sizeof(*runners));
+
+    for (runner_count = 0; runner_count < count; runner_count++) {
+        int err = pthread_create(&runners[runner_count], NULL, runner_main, NULL);
+        if (err)
+            fatal("pthread_create: %s", strerror(err));
+    }
+}
+
+/* lets the runners finish everything already submitted, then joins them */
+void stop_runners(void) {
+    pthread_mutex_lock(&queue_lock);
+    runners_stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < runner_count; i++)
+        pthread_join(runners[i], NULL);
+
+    free(runners);
+    runners = NULL;
+    runner_count = 0;
+}
+
+void submit_job(struct op_job *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_tail = job;
+    queue_tail = &job->next;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+struct op_job *new_job(struct op *op, const char *user) {
+    struct op_job *job = xcalloc(1, sizeof(*job));
+
+    job->op = op;
+    job->user = xstrdup(user);
+    job->cancel_fd = -1;
+    strbuf_init(&job->in, 0);
+    strbuf_init(&job->out, 0);
+
+    return job;
+}
+
+void free_job(struct op_job *job) {
+    if (job->cancel_fd >= 0)
+        close(job->cancel_fd);
+    strbuf_release(&job->in);
+    strbuf_release(&job->out);
+    free(job->user);
+    free(job);
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "net.h"
+#include "config.h"
+#include "gss.h"
+#include "daemon.h"
+
+/* Pre-forked worker pool. Each worker accepts connections on the shared
+ * listening socket (or on its own, with ceod_reuseport) and the local
+ * socket itself and serves them one at a time. Workers publish
+ * their state in a shared scoreboard so that the master can keep the number
+ * of idle workers between ceod_pool_min_spare and ceod_pool_max_spare.
+ * The master retires a worker by setting its retire flag, which the worker
+ * only looks at before it accepts, so a retirement never cuts into a
+ * connection. SIGTERM likewise only ends a worker's wait for one. */
+
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_STARTING,
+    SLOT_IDLE,
+    SLOT_BUSY,
+};
+
+struct worker_slot {
+    pid_t pid;
+    volatile int state;
+    volatile unsigned long served;
+    volatile int retire;        /* set by the master, to stop accepting */
+};
+
+static struct worker_slot *slots;
+static int worker_slot;
+static volatile sig_atomic_t stopping;
+
+static void worker_signal_handler(int sig) {
+    if (sig == SIGTERM || sig == SIGINT)
+        stopping = 1;
+}
+
+/* SIGTERM and SIGINT stay blocked except while the worker waits for a
+ * connection (see accept_client()), which is what waitmask is for */
+static void setup_worker_sigs(sigset_t *waitmask) {
+    struct sigaction sa;
+    sigset_t stopsigs;
+
+    setup_slave_sigs();
+
+    sigemptyset(&stopsigs);
+    sigaddset(&stopsigs, SIGINT);
+    sigaddset(&stopsigs, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &stopsigs, waitmask))
+        fatalpe("sigprocmask");
+    sigdelset(waitmask, SIGINT);
+    sigdelset(waitmask, SIGTERM);
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = worker_signal_handler;
+
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static void serve_one(int client, struct sockaddr_storage *addr) {
+    struct worker_slot *slot = &slots[worker_slot];
+
+    slot->state = SLOT_BUSY;
+    slot->served++;
+
+    serve_client(client, (sa *)addr);
+
+    if (close(client))
+        warnpe("close");
+
+    reset_gss();
+}
+
+/* Connections queued on a listener of our own (see ceod_reuseport) would
+ * be reset when it closes, so a worker that is retired or recycled serves
+ * them first. Only those that arrive between the last accept and the close
+ * are lost. */
+static void drain_listener(int server) {
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        memset(&addr, 0, addrlen);
+        int client = accept4(server, (sa *)&addr, &addrlen, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN)
+                errorpe("accept");
+            break;
+        }
+
+        serve_one(client, &addr);
+    }
+}
+
+static void worker_main(int server) {
+    struct worker_slot *slot = &slots[worker_slot];
+    int own_listener = server < 0;
+    sigset_t waitmask;
+
+    setup_worker_sigs(&waitmask);
+
+    if (own_listener)
+        server = open_listener(1);
+    /* a worker woken for a connection may find another took it */
+    if (fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK))
+        fatalpe("fcntl");
+
+    start_op_workers();
+
+    while (!stopping && !slot->retire) {
+        struct sockaddr_storage addr;
+
+        if (ceod_pool_max_requests && slot->served >= ceod_pool_max_requests) {
+            debug("worker recycled after %lu connections", slot->served);
+            break;
+        }
+
+        slot->state = SLOT_IDLE;
+
+        int client = accept_client(server, &addr, &waitmask);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+            fatalpe("accept");
+        }
+
+        serve_one(client, &addr);
+    }
+
+    /* at shutdown every listener goes, so there is nobody to leave them to */
+    if (own_listener && !stopping)
+        drain_listener(server);
+
+    close(server);
+    stop_runners();
+    stop_op_workers();
+    free_slave();
+    exit(0);
+}
+
+static void spawn_worker(int server, int n) {
+    fflush(stdout);
+    fflush(stderr);
+
+    slots[n].state = SLOT_STARTING;
+    slots[n].served = 0;
+    slots[n].retire = 0;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        errorpe("fork");
+        slots[n].state = SLOT_EMPTY;
+        return;
+    }
+    if (!pid) {
+        sigset_t chld;
+
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+
+        worker_slot = n;
+        worker_main(server);
+    }
+
+    slots[n].pid = pid;
+}
+
+static void reap_workers(void) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < ceod_pool_size; i++) {
+            if (slots[i].state == SLOT_EMPTY || slots[i].pid != pid)
+                continue;
+
+            if (WIFSIGNALED(status))
+                warn("worker %d killed by signal %d", pid, WTERMSIG(status));
+            else if (WIFEXITED(status) && WEXITSTATUS(status))
+                warn("worker %d exited with status %d", pid, WEXITSTATUS(status));
+
+            slots[i].state = SLOT_EMPTY;
+            slots[i].pid = 0;
+        }
+    }
+
+    if (pid < 0 && errno != ECHILD)
+        errorpe("waitpid");
+}
+
+static void maintain_spares(int server) {
+    int idle = 0, total = 0, idle_slot = -1;
+
+    for (int i = 0; i < ceod_pool_size; i++) {
+        /* on its way out, and not to be counted on */
+        if (slots[i].retire && slots[i].state != SLOT_EMPTY) {
+            total++;
+            continue;
+        }
+        switch (slots[i].state) {
+            case SLOT_EMPTY:
+                break;
+            case SLOT_STARTING:
+            case SLOT_IDLE:
+                idle++;
+                idle_slot = i;
+                /* fall through */
+            default:
+                total++;
+        }
+    }
+
+    if (idle > ceod_pool_max_spare && idle_slot >= 0) {
+        debug("retiring idle worker %d", slots[idle_slot].pid);
+        slots[idle_slot].retire = 1;
+        /* only ends its wait, if it is still waiting */
+        kill(slots[idle_slot].pid, SIGTERM);
+        return;
+    }
+
+    for (int i = 0; i < ceod_pool_size; i++) {
+        if (total && idle >= ceod_pool_min_spare)
+            break;
+        if (slots[i].state != SLOT_EMPTY)
+            continue;
+        spawn_worker(server, i);
+        idle++;
+        total++;
+    }
+}
+
+/* workers that are serving someone finish with them first */
+static void stop_workers(void) {
+    for (int i = 0; i < ceod_pool_size; i++)
+        if (slots[i].state != SLOT_EMPTY)
+            kill(slots[i].pid, SIGTERM);
+
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+}
+
+void setup_pool(void) {
+    if (ceod_pool_size < 0)
+        badconf("ceod_pool_size must not be negative");
+    if (!ceod_pool_size)
+        return;
+    if (ceod_pool_min_spare < 0 || ceod_pool_min_spare > ceod_pool_size)
+        badconf("ceod_pool_min_spare must be between 0 and ceod_pool_size");
+    if (ceod_pool_max_spare < ceod_pool_min_spare)
+        badconf("ceod_pool_max_spare must be at least ceod_pool_min_spare");
+    if (ceod_pool_max_requests < 0)
+        badconf("ceod_pool_max_requests must not be negative");
+
+    slots = mmap(NULL, ceod_pool_size * sizeof(*slots), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED)
+        fatalpe("mmap");
+    memset(slots, 0, ceod_pool_size * sizeof(*slots));
+}
+
+void pool_main(int sock) {
+    struct sigaction sa;
+    sigset_t chld;
+
+    /* the master must see its workers die in order to replace them */
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    /* and does so at once, since with ceod_reuseport nobody else may be
+     * listening until it has */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    notice("starting pool of up to %ld workers", ceod_pool_size);
+
+    while (!terminate) {
+        reap_workers();
+        maintain_spares(sock);
+        if (report_stats) {
+            report_stats = 0;
+            log_stats();
+        }
+        sigtimedwait(&chld, NULL, &(struct timespec) { .tv_sec = 1 });
+    }
+
+    stop_workers();
+
+    munmap(slots, ceod_pool_size * sizeof(*slots));
+}
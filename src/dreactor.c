@@ -0,0 +1,901 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "util.h"
+#include "strbuf.h"
+#include "net.h"
+#include "config.h"
+#include "gss.h"
+#include "daemon.h"
+#include "ops.h"
+
+/* Event-driven mode. A few threads each run an epoll loop over their own
+ * share of the connections; every connection is a session that owns its GSS
+ * context, whatever part of a frame has arrived so far, and its ops in
+ * flight: one at a time, or up to ceod_pipeline_depth once the client has
+ * negotiated pipelining. With ceod_reuseport each loop listens on a socket
+ * of its own.
+ * Ops are handed to the runner threads in dop.c so that a slow op never
+ * stalls a loop; they hand back their progress reports and then themselves
+ * when they are done, in that order. Errors on a connection close that connection only.
+ *
+ * A session has a deadline for whatever it is waiting on the client for
+ * (see update_deadline()), and each loop looks for sessions past theirs
+ * about once a second. */
+
+struct reactor;
+
+struct session {
+    int fd;
+    struct reactor *reactor;
+    struct gss_session *gss;
+    struct strbuf in;
+    struct strbuf out;
+    size_t out_pos;
+    struct strbuf chunks;
+    uint32_t chunk_type;
+    uint32_t chunk_reqid;
+    int chunking;
+    uint32_t features;
+    int inflight;
+    int closing;
+    int local;      /* on the local socket */
+    int phase;
+    long long deadline;
+    char addrstr[INET_ADDRSTRLEN];
+    struct session *prev, *next;
+};
+
+/* a progress report from an op, on its way to the client */
+struct report {
+    struct session *sess;
+    uint32_t msgtype;
+    uint32_t reqid;
+    struct strbuf msg;
+    struct report *next;
+};
+
+struct reactor {
+    pthread_t thread;
+    int epfd;
+    int evfd;
+    int listener;
+    int own_listener;
+    pthread_mutex_t lock;
+    struct report *reports, **reports_tail;
+    struct op_job *finished;
+    struct session *sessions;
+    struct session *dead;
+    long long next_sweep;
+};
+
+static struct reactor *reactors;
+static int reactor_count;
+static volatile int reactors_stopping;
+
+/* op frames carry request ids once a client that asked for pipelining has
+ * authenticated */
+static int pipelined(struct session *sess) {
+    return (sess->features & CEO_FEATURE_PIPELINE) && gss_session_username(sess->gss);
+}
+
+static int session_depth(struct session *sess) {
+    return pipelined(sess) ? ceod_pipeline_depth : 1;
+}
+
+static void set_interest(struct session *sess) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = sess;
+    ev.events = EPOLLRDHUP;
+    if (sess->inflight < session_depth(sess))
+        ev.events |= EPOLLIN;
+    if (sess->out_pos < sess->out.len)
+        ev.events |= EPOLLOUT;
+
+    if (epoll_ctl(sess->reactor->epfd, EPOLL_CTL_MOD, sess->fd, &ev))
+        errorpe("epoll_ctl");
+}
+
+static void free_session(struct session *sess) {
+    close(sess->fd);
+    gss_session_free(sess->gss);
+    strbuf_release(&sess->in);
+    strbuf_release(&sess->out);
+    strbuf_release(&sess->chunks);
+    free(sess);
+}
+
+/* sessions are only freed between batches of events, since a later event in
+ * the same batch may still refer to them */
+static void bury_session(struct session *sess) {
+    struct reactor *r = sess->reactor;
+
+    if (sess->prev)
+        sess->prev->next = sess->next;
+    else
+        r->sessions = sess->next;
+    if (sess->next)
+        sess->next->prev = sess->prev;
+
+    sess->prev = NULL;
+    sess->next = r->dead;
+    r->dead = sess;
+}
+
+static void free_dead_sessions(struct reactor *r) {
+    while (r->dead) {
+        struct session *sess = r->dead;
+        r->dead = sess->next;
+        free_session(sess);
+    }
+}
+
+/* stop watching the connection; it goes away once no op refers to it */
+static void close_session(struct session *sess) {
+    if (sess->closing)
+        return;
+
+    sess->closing = 1;
+
+    if (epoll_ctl(sess->reactor->epfd, EPOLL_CTL_DEL, sess->fd, NULL))
+        errorpe("epoll_ctl");
+
+    if (!sess->inflight)
+        bury_session(sess);
+}
+
+/* Restarts the deadline whenever the session starts waiting for something
+ * else. Waiting for our own ops has no deadline. */
+static void update_deadline(struct session *sess) {
+    size_t headerlen = pipelined(sess) ? MSG_IDHEADERLEN : MSG_HEADERLEN;
+    int phase, timeout;
+
+    if (sess->out_pos < sess->out.len)
+        phase = CONN_WRITE;
+    else if (sess->inflight >= session_depth(sess) || (sess->inflight && !sess->in.len))
+        phase = -1;
+    else
+        phase = ceo_conn_phase(sess->in.len, headerlen);
+
+    if (phase == sess->phase)
+        return;
+
+    sess->phase = phase;
+    timeout = phase >= 0 ? conn_timeout(phase) : 0;
+    sess->deadline = timeout ? monotonic_ms() + timeout : 0;
+}
+
+static int flush_session(struct session *sess) {
+    while (sess->out_pos < sess->out.len) {
+        ssize_t bytes = write(sess->fd, sess->out.buf + sess->out_pos,
+                              sess->out.len - sess->out_pos);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            errorpe("write to %s", sess->addrstr);
+            return -1;
+        }
+        sess->out_pos += bytes;
+    }
+
+    if (sess->out_pos == sess->out.len) {
+        strbuf_reset(&sess->out);
+        sess->out_pos = 0;
+    }
+
+    set_interest(sess);
+    update_deadline(sess);
+    return 0;
+}
+
+static void queue_frame(struct session *sess, uint32_t msgtype, void *buf, size_t len) {
+    size_t frame = ceo_frame_start(&sess->out);
+
+    strbuf_add(&sess->out, buf, len);
+    ceo_frame_finish(&sess->out, frame, msgtype);
+}
+
+static size_t start_reply(struct session *sess) {
+    return pipelined(sess) ? ceo_frame_start_id(&sess->out) : ceo_frame_start(&sess->out);
+}
+
+static void finish_reply(struct session *sess, size_t frame, uint32_t msgtype, uint32_t reqid) {
+    if (pipelined(sess))
+        ceo_frame_finish_id(&sess->out, frame, msgtype, reqid);
+    else
+        ceo_frame_finish(&sess->out, frame, msgtype);
+}
+
+static void queue_reply(struct session *sess, uint32_t msgtype, uint32_t reqid, uint32_t value) {
+    size_t frame = start_reply(sess);
+
+    value = htonl(value);
+    strbuf_add(&sess->out, &value, sizeof(value));
+    finish_reply(sess, frame, msgtype, reqid);
+}
+
+/* wraps the op's output straight into the session's output buffer */
+static int queue_response(struct session *sess, struct op_job *job) {
+    return gss_session_encipher_frames(sess->gss, &job->out, &sess->out,
+                                       job->op->id, job->reqid, sess->features);
+}
+
+static int handle_auth_frame(struct session *sess, uint32_t msgtype, struct strbuf *msg) {
+    gss_buffer_desc incoming_tok, outgoing_tok;
+    OM_uint32 min_stat;
+    struct timespec start;
+    uint32_t wanted;
+    int ret;
+
+    /* the kernel has vouched for a local client, which may only ask for
+     * features, before any have been granted */
+    if (sess->local) {
+        if (msgtype != MSG_AUTH_EXT || msg->len != sizeof(wanted) || sess->features) {
+            error("unexpected auth token from %s", sess->addrstr);
+            return -1;
+        }
+        memcpy(&wanted, msg->buf, sizeof(wanted));
+        sess->features = local_features(ntohl(wanted));
+        wanted = htonl(sess->features);
+        queue_frame(sess, MSG_AUTH_EXT, &wanted, sizeof(wanted));
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    incoming_tok.value = msg->buf;
+    incoming_tok.length = msg->len;
+
+    if (msgtype == MSG_AUTH_EXT) {
+        if (msg->len < sizeof(wanted)) {
+            error("short MSG_AUTH_EXT from %s", sess->addrstr);
+            return -1;
+        }
+        memcpy(&wanted, msg->buf, sizeof(wanted));
+        sess->features = server_features(ntohl(wanted));
+        incoming_tok.value = msg->buf + sizeof(wanted);
+        incoming_tok.length = msg->len - sizeof(wanted);
+    }
+
+    ret = gss_session_accept(sess->gss, &incoming_tok, &outgoing_tok);
+    if (ret < 0)
+        return -1;
+    if (ret) {
+        /* krb5 contexts are accepted on the client's first token */
+        if (check_replay(incoming_tok.value, incoming_tok.length))
+            return -1;
+        count_handshake(&start);
+    }
+
+    if (msgtype == MSG_AUTH_EXT) {
+        size_t frame = ceo_frame_start(&sess->out);
+        uint32_t granted = htonl(sess->features);
+
+        strbuf_add(&sess->out, &granted, sizeof(granted));
+        strbuf_add(&sess->out, outgoing_tok.value, outgoing_tok.length);
+        ceo_frame_finish(&sess->out, frame, MSG_AUTH_EXT);
+    } else if (outgoing_tok.length) {
+        queue_frame(sess, MSG_AUTH, outgoing_tok.value, outgoing_tok.length);
+    }
+
+    if (outgoing_tok.length)
+        gss_release_buffer(&min_stat, &outgoing_tok);
+
+    return 0;
+}
+
+/* a ticket in place of the auth tokens */
+static int handle_resume_frame(struct session *sess, struct strbuf *msg) {
+    uint32_t wanted, granted;
+
+    if (msg->len < sizeof(wanted)) {
+        error("short MSG_RESUME from %s", sess->addrstr);
+        return -1;
+    }
+    memcpy(&wanted, msg->buf, sizeof(wanted));
+
+    if (resume_session(sess->gss, msg->buf + sizeof(wanted), msg->len - sizeof(wanted),
+                       ntohl(wanted), &sess->features)) {
+        notice("refused resumption from %s", sess->addrstr);
+        return -1;
+    }
+    notice("client resumed as %s", gss_session_username(sess->gss));
+
+    granted = htonl(sess->features);
+    queue_frame(sess, MSG_RESUME, &granted, sizeof(granted));
+    return 0;
+}
+
+/* the client's next ticket, once every op in flight has been answered */
+static int handle_ticket_frame(struct session *sess, struct strbuf *msg) {
+    uint32_t lifetime = htonl(ceod_resume_lifetime), wanted;
+    size_t frame;
+
+    if (!(sess->features & CEO_FEATURE_RESUME) || !gss_session_username(sess->gss) ||
+            msg->len != sizeof(wanted)) {
+        error("unexpected MSG_TICKET from %s", sess->addrstr);
+        return -1;
+    }
+    memcpy(&wanted, msg->buf, sizeof(wanted));
+
+    frame = start_reply(sess);
+    strbuf_add(&sess->out, &lifetime, sizeof(lifetime));
+    if (issue_ticket(sess->gss, server_features(ntohl(wanted)), &sess->out)) {
+        strbuf_setlen(&sess->out, frame);
+        return -1;
+    }
+    finish_reply(sess, frame, MSG_TICKET, 0);
+
+    return 0;
+}
+
+/* called on a runner thread; the session stays around at least until the
+ * job is done */
+static void job_progress(struct op_job *job, const char *msg, size_t len) {
+    struct session *sess = job->data;
+    struct reactor *r = sess->reactor;
+    struct report *report = xmalloc(sizeof(*report));
+    uint64_t one = 1;
+
+    report->sess = sess;
+    report->msgtype = job->op->id | MSG_FLAG_PROGRESS;
+    report->reqid = job->reqid;
+    report->next = NULL;
+    strbuf_init(&report->msg, len);
+    strbuf_add(&report->msg, msg, len);
+
+    pthread_mutex_lock(&r->lock);
+    *r->reports_tail = report;
+    r->reports_tail = &report->next;
+    pthread_mutex_unlock(&r->lock);
+
+    if (write(r->evfd, &one, sizeof(one)) < 0)
+        errorpe("write: eventfd");
+}
+
+static void job_done(struct op_job *job) {
+    struct session *sess = job->data;
+    struct reactor *r = sess->reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->lock);
+    job->next = r->finished;
+    r->finished = job;
+    pthread_mutex_unlock(&r->lock);
+
+    if (write(r->evfd, &one, sizeof(one)) < 0)
+        errorpe("write: eventfd");
+}
+
+/* Runs the op for a request whose input is in, which is used up. */
+static int start_op(struct session *sess, uint32_t msgtype, uint32_t reqid, struct strbuf *in) {
+    struct op *op = get_local_op(msgtype);
+    const char *user = gss_session_username(sess->gss);
+    struct op_job *job;
+
+    if (!op) {
+        error("operation %x does not exist", msgtype);
+        return -1;
+    }
+
+    if (!user) {
+        error("unauthenticated request for %s from %s", op->name, sess->addrstr);
+        return -1;
+    }
+
+    job = new_job(op, user);
+    job->reqid = reqid;
+    job->done = job_done;
+    if (sess->features & CEO_FEATURE_PROGRESS)
+        job->progress = job_progress;
+    job->data = sess;
+    strbuf_swap(&job->in, in);
+
+    /* our own reference, so that the op can see a hangup even after the
+     * loop has closed the session */
+    job->cancel_fd = dup(sess->fd);
+    if (job->cancel_fd < 0)
+        errorpe("dup");
+
+    sess->inflight++;
+    submit_job(job);
+
+    return 0;
+}
+
+static int handle_op_frame(struct session *sess, uint32_t msgtype, uint32_t reqid, struct strbuf *msg) {
+    struct strbuf in = STRBUF_INIT;
+    int ret;
+
+    if (gss_session_decipher_frame(sess->gss, msg, &in, msgtype))
+        ret = -1;
+    else
+        ret = start_op(sess, msgtype & ~MSG_FLAG_COMPRESSED, reqid, &in);
+
+    strbuf_release(&in);
+    return ret;
+}
+
+/* the client's last auth token, with its first request riding along */
+static int handle_auth_op_frame(struct session *sess, struct strbuf *msg) {
+    struct strbuf auth, request;
+    uint32_t optype;
+
+    if (ceo_split_auth_op(msg, &auth, &request, &optype) || (optype & MSG_FLAG_MORE)) {
+        error("malformed MSG_AUTH_OP from %s", sess->addrstr);
+        return -1;
+    }
+
+    if (handle_auth_frame(sess, MSG_AUTH_EXT, &auth))
+        return -1;
+
+    return handle_op_frame(sess, optype, pipelined(sess) ? 1 : 0, &request);
+}
+
+/* A chunked request is put together in sess->chunks, within
+ * ceod_conn_memory, before its op runs. */
+static int handle_chunk_frame(struct session *sess, uint32_t msgtype, uint32_t reqid, struct strbuf *msg) {
+    uint32_t optype = msgtype & ~MSG_FRAME_FLAGS;
+
+    if (!(sess->features & CEO_FEATURE_CHUNKED) || optype == MSG_AUTH || optype == MSG_AUTH_EXT ||
+            optype == MSG_AUTH_OP) {
+        error("unexpected chunked message from %s", sess->addrstr);
+        return -1;
+    }
+
+    if (sess->chunking && (optype != sess->chunk_type || reqid != sess->chunk_reqid)) {
+        error("unexpected frame in chunked request from %s", sess->addrstr);
+        return -1;
+    }
+
+    sess->chunking = 1;
+    sess->chunk_type = optype;
+    sess->chunk_reqid = reqid;
+
+    if (gss_session_decipher_frame(sess->gss, msg, &sess->chunks, msgtype))
+        return -1;
+
+    if (sess->chunks.len > ceod_conn_memory) {
+        error("request from %s exceeds ceod_conn_memory", sess->addrstr);
+        return -1;
+    }
+
+    if (msgtype & MSG_FLAG_MORE)
+        return 0;
+
+    sess->chunking = 0;
+    return start_op(sess, optype, reqid, &sess->chunks);
+}
+
+/* Handle every complete frame that has arrived, until as many ops are in
+ * flight as the session may have. The handlers get a view of the frame body
+ * inside sess->in rather than a copy, which they may decrypt in place. */
+static int process_frames(struct session *sess) {
+    struct strbuf msg;
+    size_t pos = 0;
+    int ret = 0;
+
+    while (sess->inflight < session_depth(sess)) {
+        size_t headerlen = pipelined(sess) ? MSG_IDHEADERLEN : MSG_HEADERLEN;
+        struct ceo_frame_header hdr;
+        ssize_t size = ceo_parse_frame(sess->in.buf + pos, sess->in.len - pos, headerlen, &hdr);
+
+        if (!size)
+            break;
+        if (size < 0) {
+            error("bad length %u in message header from %s", hdr.len, sess->addrstr);
+            ret = -1;
+            break;
+        }
+        /* a ticket must wait until the ops before it have been answered */
+        if (hdr.type == MSG_TICKET && sess->inflight)
+            break;
+
+        msg.alloc = 0;
+        msg.len = hdr.len;
+        msg.buf = sess->in.buf + pos + headerlen;
+        pos += size;
+
+        if ((hdr.type & MSG_FLAG_MORE) || sess->chunking)
+            ret = handle_chunk_frame(sess, hdr.type, hdr.reqid, &msg);
+        else if (hdr.type == MSG_AUTH || hdr.type == MSG_AUTH_EXT)
+            ret = handle_auth_frame(sess, hdr.type, &msg);
+        else if (hdr.type == MSG_AUTH_OP)
+            ret = handle_auth_op_frame(sess, &msg);
+        else if (hdr.type == MSG_RESUME && !gss_session_username(sess->gss))
+            ret = handle_resume_frame(sess, &msg);
+        else if (hdr.type == MSG_TICKET)
+            ret = handle_ticket_frame(sess, &msg);
+        else
+            ret = handle_op_frame(sess, hdr.type, hdr.reqid, &msg);
+        if (ret)
+            break;
+    }
+
+    strbuf_remove(&sess->in, 0, pos);
+
+    return ret;
+}
+
+static void read_session(struct session *sess) {
+    int eof = 0;
+
+    for (;;) {
+        ssize_t bytes;
+
+        strbuf_grow(&sess->in, 4096);
+        bytes = read(sess->fd, sess->in.buf + sess->in.len, strbuf_avail(&sess->in));
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            errorpe("read from %s", sess->addrstr);
+            close_session(sess);
+            return;
+        }
+        if (!bytes) {
+            notice("connection closed by peer %s", sess->addrstr);
+            eof = 1;
+            break;
+        }
+        strbuf_setlen(&sess->in, sess->in.len + bytes);
+
+        if (sess->in.len > MAX_MSGLEN + MSG_IDHEADERLEN)
+            break;
+    }
+
+    if (process_frames(sess) || flush_session(sess) || eof)
+        close_session(sess);
+}
+
+static void reap_sessions(struct reactor *r) {
+    long long now = monotonic_ms();
+    struct session *sess, *next;
+
+    if (now < r->next_sweep)
+        return;
+    r->next_sweep = now + 1000;
+
+    for (sess = r->sessions; sess; sess = next) {
+        next = sess->next;
+
+        if (sess->closing || !sess->deadline || now < sess->deadline)
+            continue;
+
+        notice("reaping connection from %s after %s timeout", sess->addrstr, conn_phase_names[sess->phase]);
+        count_reaped(sess->phase);
+        /* its ops see the hangup and give up */
+        shutdown(sess->fd, SHUT_RDWR);
+        close_session(sess);
+    }
+}
+
+static void free_report(struct report *report) {
+    strbuf_release(&report->msg);
+    free(report);
+}
+
+/* Passes on the progress reports, then the responses, of ops that have
+ * reported or finished since the last time. Every report of a job that has
+ * finished was queued before it was, so it goes out first. */
+static void finish_jobs(struct reactor *r) {
+    struct report *reports, *report;
+    struct op_job *jobs, *job;
+    uint64_t count;
+
+    if (read(r->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        errorpe("read: eventfd");
+
+    pthread_mutex_lock(&r->lock);
+    reports = r->reports;
+    r->reports = NULL;
+    r->reports_tail = &r->reports;
+    jobs = r->finished;
+    r->finished = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    while ((report = reports)) {
+        struct session *sess = report->sess;
+        reports = report->next;
+
+        if (!sess->closing) {
+            if (gss_session_encipher_frames(sess->gss, &report->msg, &sess->out, report->msgtype,
+                                            report->reqid, sess->features) || flush_session(sess))
+                close_session(sess);
+        }
+
+        free_report(report);
+    }
+
+    while ((job = jobs)) {
+        struct session *sess = job->data;
+        jobs = job->next;
+
+        sess->inflight--;
+
+        if (sess->closing) {
+            if (!sess->inflight)
+                bury_session(sess);
+        } else if (job->retry_ms) {
+            queue_reply(sess, MSG_BUSY, job->reqid, job->retry_ms);
+            if (process_frames(sess) || flush_session(sess))
+                close_session(sess);
+        } else if (job->status == OP_TIMEDOUT) {
+            queue_reply(sess, MSG_TIMEOUT, job->reqid, job->op->timeout);
+            if (process_frames(sess) || flush_session(sess))
+                close_session(sess);
+        } else if (job->status || queue_response(sess, job)) {
+            close_session(sess);
+        } else {
+            if (process_frames(sess) || flush_session(sess))
+                close_session(sess);
+        }
+
+        free_job(job);
+    }
+}
+
+static void accept_sessions(struct reactor *r, int listener) {
+    for (;;) {
+        struct sockaddr_storage addr;
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+        socklen_t addrlen = sizeof(addr);
+        struct epoll_event ev;
+        struct session *sess;
+
+        int client = accept4(listener, (sa *)&addr, &addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN)
+                errorpe("accept");
+            return;
+        }
+
+        sess = xcalloc(1, sizeof(*sess));
+        sess->fd = client;
+        sess->reactor = r;
+        sess->gss = gss_session_new();
+        strbuf_init(&sess->in, 0);
+        strbuf_init(&sess->out, 0);
+        strbuf_init(&sess->chunks, 0);
+        sess->phase = -1;
+        update_deadline(sess);
+
+        if (addr.ss_family == AF_UNIX) {
+            sess->local = 1;
+            if (trust_local_peer(client, sess->gss, sess->addrstr, sizeof(sess->addrstr))) {
+                notice("refused local connection from %s", sess->addrstr);
+                close(client);
+                gss_session_free(sess->gss);
+                free(sess);
+                continue;
+            }
+        } else if (addr.ss_family != AF_INET ||
+                !inet_ntop(AF_INET, &addr_in->sin_addr, sess->addrstr, sizeof(sess->addrstr))) {
+            strcpy(sess->addrstr, "unknown");
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.data.ptr = sess;
+        ev.events = EPOLLIN|EPOLLRDHUP;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client, &ev)) {
+            errorpe("epoll_ctl");
+            close(client);
+            gss_session_free(sess->gss);
+            free(sess);
+            continue;
+        }
+
+        sess->next = r->sessions;
+        if (sess->next)
+            sess->next->prev = sess;
+        r->sessions = sess;
+
+        notice("accepted connection from %s", sess->addrstr);
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[64];
+    int sweep = conn_timeout(CONN_IDLE) || conn_timeout(CONN_HEADER) || conn_timeout(CONN_BODY);
+
+    while (!reactors_stopping) {
+        int n = epoll_wait(r->epfd, events, sizeof(events)/sizeof(*events), sweep ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fatalpe("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct session *sess = events[i].data.ptr;
+
+            if (events[i].data.ptr == &r->listener) {
+                accept_sessions(r, r->listener);
+            } else if (events[i].data.ptr == &local_listener) {
+                accept_sessions(r, local_listener);
+            } else if (events[i].data.ptr == &r->evfd) {
+                finish_jobs(r);
+            } else if (sess->closing) {
+                continue;
+            } else if (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) {
+                if (sess->inflight < session_depth(sess))
+                    read_session(sess);
+                else
+                    close_session(sess);
+            } else if (events[i].events & EPOLLOUT) {
+                if (flush_session(sess))
+                    close_session(sess);
+            }
+        }
+
+        if (sweep)
+            reap_sessions(r);
+
+        free_dead_sessions(r);
+    }
+
+    return NULL;
+}
+
+static void set_nonblocking(int fd) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+        fatalpe("fcntl");
+}
+
+static void start_reactor(struct reactor *r, int sock) {
+    struct epoll_event ev;
+    int err;
+
+    if (sock < 0) {
+        sock = open_listener(1);
+        set_nonblocking(sock);
+        r->own_listener = 1;
+    }
+
+    r->listener = sock;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0)
+        fatalpe("epoll_create1");
+    r->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (r->evfd < 0)
+        fatalpe("eventfd");
+    pthread_mutex_init(&r->lock, NULL);
+    r->reports_tail = &r->reports;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = &r->listener;
+    ev.events = EPOLLIN|EPOLLEXCLUSIVE;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listener, &ev))
+        fatalpe("epoll_ctl");
+
+    if (local_listener >= 0) {
+        ev.data.ptr = &local_listener;
+        ev.events = EPOLLIN|EPOLLEXCLUSIVE;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, local_listener, &ev))
+            fatalpe("epoll_ctl");
+    }
+
+    ev.data.ptr = &r->evfd;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev))
+        fatalpe("epoll_ctl");
+
+    err = pthread_create(&r->thread, NULL, reactor_thread, r);
+    if (err)
+        fatal("pthread_create: %s", strerror(err));
+}
+
+static void free_reactor(struct reactor *r) {
+    while (r->reports) {
+        struct report *report = r->reports;
+        r->reports = report->next;
+        free_report(report);
+    }
+
+    while (r->finished) {
+        struct op_job *job = r->finished;
+        struct session *sess = job->data;
+        r->finished = job->next;
+        sess->inflight--;
+        free_job(job);
+    }
+
+    while (r->sessions)
+        bury_session(r->sessions);
+    free_dead_sessions(r);
+
+    if (r->own_listener)
+        close(r->listener);
+    close(r->epfd);
+    close(r->evfd);
+    pthread_mutex_destroy(&r->lock);
+}
+
+void setup_reactor(void) {
+    if (!ceod_reactor_threads)
+        return;
+    if (ceod_pool_size)
+        badconf("ceod_pool_size and ceod_reactor_threads are mutually exclusive");
+    if (ceod_reactor_threads < -1)
+        badconf("ceod_reactor_threads must be -1, 0 or positive");
+    if (ceod_reactor_op_threads < 1)
+        badconf("ceod_reactor_op_threads must be positive");
+
+    reactor_count = ceod_reactor_threads;
+    if (reactor_count < 0)
+        reactor_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_count < 1)
+        reactor_count = 1;
+}
+
+void reactor_main(int sock) {
+    sigset_t sigs, oldsigs;
+    uint64_t one = 1;
+
+    /* op children are waited for explicitly */
+    signal(SIGCHLD, SIG_DFL);
+
+    if (sock >= 0)
+        set_nonblocking(sock);
+
+    /* only the main thread takes the shutdown and stats signals */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    notice("starting %d event loops and %ld op runners", reactor_count, ceod_reactor_op_threads);
+
+    start_op_workers();
+    start_runners(ceod_reactor_op_threads);
+
+    reactors = xcalloc(reactor_count, sizeof(*reactors));
+    for (int i = 0; i < reactor_count; i++)
+        start_reactor(&reactors[i], sock);
+
+    /* the signals stay blocked except while we wait, so that none slips in
+     * between checking the flags and going to sleep */
+    while (!terminate) {
+        sigsuspend(&oldsigs);
+        if (report_stats) {
+            report_stats = 0;
+            log_stats();
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    reactors_stopping = 1;
+    for (int i = 0; i < reactor_count; i++) {
+        if (write(reactors[i].evfd, &one, sizeof(one)) < 0)
+            errorpe("write: eventfd");
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    stop_runners();
+    stop_op_workers();
+
+    for (int i = 0; i < reactor_count; i++)
+        free_reactor(&reactors[i]);
+    free(reactors);
+}
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <krb5.h>
+#include <com_err.h>
+
+#include "util.h"
+#include "net.h"
+#include "gss.h"
+#include "config.h"
+#include "daemon.h"
+
+/* Our own replay cache for the Kerberos authenticators clients present.
+ * The default one in MIT krb5 is a file that every slave appends to and
+ * syncs for each login, which makes a burst of logins wait on the disk one
+ * at a time. With ceod_replay_cache set, we turn it off and remember a
+ * keyed hash of each authenticator in a table shared by all of ceod's
+ * processes instead, for ceod_replay_window seconds, and refuse any
+ * authenticator seen in that time, as krb5 would. Like krb5 we key on the
+ * encrypted authenticator alone, since the rest of the AP-REQ can be
+ * reencoded without touching it.
+ *
+ * The table and the key for its hashes are mapped from ceod_replay_file,
+ * so they outlive ceod, but nothing waits for them to reach the disk. When
+ * ceod starts without a table it can trust to hold every authenticator of
+ * the last window, it refuses Kerberos logins until a window has gone by:
+ * after startup if there is no table (or it was made for another
+ * ceod_replay_cache), or after the host came up if the table was last used
+ * before a reboot, since its last entries may not have reached the disk.
+ * Sessions resumed with tickets are not affected. */
+
+#define REPLAY_CKSUMTYPE CKSUMTYPE_HMAC_SHA1_96_AES256
+#define REPLAY_ENCTYPE ENCTYPE_AES256_CTS_HMAC_SHA1_96
+#define REPLAY_USAGE 1025
+#define REPLAY_TAGLEN 12
+#define REPLAY_PROBE 8
+#define REPLAY_KEYLEN 32
+#define REPLAY_MAGIC 0x63656f72
+
+struct replay_entry {
+    uint32_t expires; /* on CLOCK_REALTIME */
+    unsigned char tag[REPLAY_TAGLEN];
+};
+
+struct replay_stats {
+    unsigned long stored;
+    unsigned long replays;
+    unsigned long full;
+};
+
+struct replay_cache {
+    uint32_t magic;
+    uint32_t size;          /* ceod_replay_cache when it was made */
+    char boot_id[40];       /* of the boot it was last used in */
+    unsigned char key[REPLAY_KEYLEN];
+    int64_t hold_until;     /* no logins before then */
+    pthread_mutex_t lock;
+    struct replay_stats stats;
+    struct replay_entry entries[]; /* ceod_replay_cache of them */
+};
+
+static struct replay_cache *rc;
+static size_t rc_size;
+static krb5_context kctx;
+static krb5_keyblock key;
+
+/* a krb5 context must not be used by two threads at once */
+static pthread_mutex_t kctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_replay(void) {
+    int err = pthread_mutex_lock(&rc->lock);
+
+    if (err == EOWNERDEAD)
+        pthread_mutex_consistent(&rc->lock);
+    else if (err)
+        fatal("pthread_mutex_lock: %s", strerror(err));
+}
+
+static void unlock_replay(void) {
+    pthread_mutex_unlock(&rc->lock);
+}
+
+/* Steps over the DER item at *p, which must have the given tag, and points
+ * body at its contents. */
+static int der_item(const unsigned char **p, const unsigned char *end, int tag,
+                    const unsigned char **body, size_t *len) {
+    const unsigned char *q = *p;
+    size_t n;
+
+    if (end - q < 2 || *q++ != tag)
+        return -1;
+
+    n = *q++;
+    if (n & 0x80) {
+        int bytes = n & 0x7f;
+
+        if (bytes < 1 || bytes > 4 || end - q < bytes)
+            return -1;
+        for (n = 0; bytes--; )
+            n = n << 8 | *q++;
+    }
+    if (n > (size_t)(end - q))
+        return -1;
+
+    *body = q;
+    *len = n;
+    *p = q + n;
+    return 0;
+}
+
+/* Finds the encrypted authenticator in a krb5 initial context token
+ * (RFC 4121): the mech OID and token id, then an AP-REQ (RFC 4120) whose
+ * fifth field is the authenticator, an EncryptedData. */
+static int find_authenticator(const void *token, size_t len, const unsigned char **cipher, size_t *cipherlen) {
+    const unsigned char *p = token, *end = p + len, *body;
+    size_t n;
+
+    if (der_item(&p, end, 0x60, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+
+    if (der_item(&p, end, 0x06, &body, &n) || n != gss_mech_krb5->length ||
+        memcmp(body, gss_mech_krb5->elements, n))
+        return -1;
+    if (end - p < 2 || p[0] != 0x01 || p[1] != 0x00)
+        return -1;
+    p += 2;
+
+    if (der_item(&p, end, 0x6e, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+    if (der_item(&p, end, 0x30, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+
+    /* pvno, msg-type, ap-options and ticket come first */
+    for (int field = 0; field < 4; field++)
+        if (der_item(&p, end, 0xa0 | field, &body, &n))
+            return -1;
+
+    if (der_item(&p, end, 0xa4, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+    if (der_item(&p, end, 0x30, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+
+    /* etype, and maybe kvno, before the cipher text */
+    if (der_item(&p, end, 0xa0, &body, &n))
+        return -1;
+    if (p < end && *p == 0xa1 && der_item(&p, end, 0xa1, &body, &n))
+        return -1;
+    if (der_item(&p, end, 0xa2, &body, &n))
+        return -1;
+    p = body;
+    end = body + n;
+
+    return der_item(&p, end, 0x04, cipher, cipherlen);
+}
+
+/* Remembers the authenticator in token, the first a client sent on a
+ * context that we accepted. Returns -1 if we have seen it before, or if it
+ * cannot be checked, so the client must not be let in. */
+int check_replay(const void *token, size_t len) {
+    const unsigned char *cipher;
+    struct replay_entry *slot = NULL;
+    krb5_checksum cksum;
+    krb5_data data;
+    krb5_error_code retval;
+    struct timespec ts;
+    uint32_t hash;
+    int replayed = 0;
+    int ret = -1;
+
+    if (!rc)
+        return 0;
+
+    if (find_authenticator(token, len, &cipher, &len)) {
+        error("no authenticator in initial token");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec < rc->hold_until) {
+        error("refusing Kerberos logins for another %lld seconds, until the replay cache is complete",
+              (long long)(rc->hold_until - ts.tv_sec));
+        return -1;
+    }
+
+    data.data = (char *)cipher;
+    data.length = len;
+    pthread_mutex_lock(&kctx_lock);
+    retval = krb5_c_make_checksum(kctx, REPLAY_CKSUMTYPE, &key, REPLAY_USAGE, &data, &cksum);
+    pthread_mutex_unlock(&kctx_lock);
+    if (retval) {
+        error("krb5_c_make_checksum: %s", error_message(retval));
+        return -1;
+    }
+    if (cksum.length < REPLAY_TAGLEN) {
+        error("short authenticator hash");
+        goto out;
+    }
+    memcpy(&hash, cksum.contents, sizeof(hash));
+
+    /* look at every slot in reach before taking a free one, since ours may
+     * be past one that has expired since it was stored */
+    lock_replay();
+    for (int i = 0; i < REPLAY_PROBE; i++) {
+        struct replay_entry *e = &rc->entries[(hash + i) % ceod_replay_cache];
+
+        if (e->expires <= ts.tv_sec) {
+            if (!slot)
+                slot = e;
+        } else if (!memcmp(e->tag, cksum.contents, REPLAY_TAGLEN)) {
+            replayed = 1;
+            break;
+        }
+    }
+    if (replayed) {
+        rc->stats.replays++;
+    } else if (slot) {
+        slot->expires = ts.tv_sec + ceod_replay_window;
+        memcpy(slot->tag, cksum.contents, REPLAY_TAGLEN);
+        rc->stats.stored++;
+        ret = 0;
+    } else {
+        rc->stats.full++;
+    }
+    unlock_replay();
+
+    if (replayed)
+        error("authenticator has been presented before");
+    else if (ret)
+        error("replay cache is full");
+
+out:
+    pthread_mutex_lock(&kctx_lock);
+    krb5_free_checksum_contents(kctx, &cksum);
+    pthread_mutex_unlock(&kctx_lock);
+    return ret;
+}
+
+void log_replay_stats(void) {
+    struct replay_stats stats;
+
+    if (!rc)
+        return;
+
+    lock_replay();
+    stats = rc->stats;
+    unlock_replay();
+
+    notice("replay cache: %lu authenticators stored, %lu replays refused, %lu refused when full",
+           stats.stored, stats.replays, stats.full);
+}
+
+/* the id of this boot, to tell whether the host has rebooted since */
+static void read_boot_id(char *buf, size_t len) {
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    memset(buf, 0, len);
+    if (!fp || !fgets(buf, len, fp))
+        warnpe("cannot read boot id");
+    if (fp)
+        fclose(fp);
+}
+
+/* Maps the table in ceod_replay_file, keeping what is there if it is ours,
+ * and decides how long to refuse logins for (see above). */
+static void map_replay_file(void) {
+    char boot_id[sizeof(rc->boot_id)];
+    struct timespec now, uptime;
+    struct stat st;
+    int fd, kept;
+
+    fd = open(ceod_replay_file, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0)
+        fatalpe("open: %s", ceod_replay_file);
+    if (fstat(fd, &st))
+        fatalpe("fstat: %s", ceod_replay_file);
+    kept = st.st_size == rc_size;
+    if (!kept && (ftruncate(fd, 0) || ftruncate(fd, rc_size)))
+        fatalpe("ftruncate: %s", ceod_replay_file);
+
+    rc = mmap(NULL, rc_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (rc == MAP_FAILED)
+        fatalpe("mmap: %s", ceod_replay_file);
+    close(fd);
+
+    kept = kept && rc->magic == REPLAY_MAGIC && rc->size == ceod_replay_cache;
+
+    read_boot_id(boot_id, sizeof(boot_id));
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_BOOTTIME, &uptime);
+
+    if (!kept) {
+        memset(rc, 0, rc_size);
+        rc->magic = REPLAY_MAGIC;
+        rc->size = ceod_replay_cache;
+        rc->hold_until = now.tv_sec + ceod_replay_window;
+    } else if (!*boot_id || strcmp(boot_id, rc->boot_id)) {
+        rc->hold_until = now.tv_sec - uptime.tv_sec + ceod_replay_window;
+    }
+    memcpy(rc->boot_id, boot_id, sizeof(rc->boot_id));
+    memset(&rc->stats, 0, sizeof(rc->stats));
+
+    if (rc->hold_until > now.tv_sec)
+        warn("%s does not cover the last %ld seconds, refusing Kerberos logins for %lld seconds",
+             ceod_replay_file, ceod_replay_window, (long long)(rc->hold_until - now.tv_sec));
+}
+
+void setup_replay(void) {
+    static const unsigned char nokey[REPLAY_KEYLEN];
+    pthread_mutexattr_t mattr;
+    krb5_keyblock fresh;
+    krb5_error_code retval;
+
+    if (ceod_replay_cache < 0)
+        badconf("ceod_replay_cache must not be negative");
+    if (ceod_replay_cache && ceod_replay_cache < REPLAY_PROBE)
+        badconf("ceod_replay_cache must be at least %d", REPLAY_PROBE);
+    if (ceod_replay_cache && ceod_replay_window < 1)
+        badconf("ceod_replay_window must be positive");
+    if (ceod_replay_cache && !*ceod_replay_file)
+        badconf("ceod_replay_cache needs ceod_replay_file");
+
+    if (!ceod_replay_cache)
+        return;
+
+    /* must be in place before the acceptor credentials open the default */
+    if (setenv("KRB5RCACHETYPE", "none", 1))
+        fatalpe("setenv");
+
+    rc_size = sizeof(*rc) + ceod_replay_cache * sizeof(*rc->entries);
+    map_replay_file();
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&rc->lock, &mattr))
+        fatal("pthread_mutex_init failed");
+    pthread_mutexattr_destroy(&mattr);
+
+    retval = krb5_init_context(&kctx);
+    if (retval)
+        fatal("krb5_init_context: %s", error_message(retval));
+
+    if (!memcmp(rc->key, nokey, sizeof(nokey))) {
+        retval = krb5_c_make_random_key(kctx, REPLAY_ENCTYPE, &fresh);
+        if (retval)
+            fatal("krb5_c_make_random_key: %s", error_message(retval));
+        if (fresh.length != REPLAY_KEYLEN)
+            fatal("unexpected replay key length %u", fresh.length);
+        memcpy(rc->key, fresh.contents, REPLAY_KEYLEN);
+        krb5_free_keyblock_contents(kctx, &fresh);
+    }
+
+    /* the key stays in the table, so that its hashes still match */
+    memset(&key, 0, sizeof(key));
+    key.enctype = REPLAY_ENCTYPE;
+    key.length = REPLAY_KEYLEN;
+    key.contents = rc->key;
+}
+
+void free_replay(void) {
+    if (kctx) {
+        krb5_free_context(kctx);
+        kctx = NULL;
+    }
+
+    if (rc) {
+        munmap(rc, rc_size);
+        rc = NULL;
+    }
+}
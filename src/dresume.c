@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <krb5.h>
+#include <com_err.h>
+
+#include "util.h"
+#include "net.h"
+#include "gss.h"
+#include "config.h"
+#include "daemon.h"
+
+/* Session resumption (CEO_FEATURE_RESUME). A client that has authenticated
+ * may ask for a ticket holding our end of its GSS context, exported and
+ * sealed with a key that lives only as long as this ceod does, and present
+ * it on a later connection in place of the Kerberos exchange. A ticket is
+ * good for one connection within ceod_resume_lifetime seconds: the ids of
+ * those presented are kept in a table shared by all of ceod's processes
+ * until they expire. Since clients ask for their next ticket on their way
+ * out, once every message of the connection is behind both ends, the
+ * context in it has moved past anything that could be recorded and played
+ * back on the resumed connection. */
+
+#define TICKET_ENCTYPE ENCTYPE_AES256_CTS_HMAC_SHA1_96
+#define TICKET_USAGE 1024
+#define TICKET_PROBE 8
+
+/* what a ticket holds, ahead of the exported context; the high 32 bits of
+ * the id are the second it expires at, on CLOCK_MONOTONIC */
+struct ticket_header {
+    uint64_t id;
+    uint32_t features;
+} __attribute__((packed));
+
+struct resume_stats {
+    unsigned long issued;
+    unsigned long resumed;
+    unsigned long refused;
+    unsigned long handshakes;
+    unsigned long long handshake_us;
+    unsigned long long resume_us;
+};
+
+struct resumption {
+    pthread_mutex_t lock;
+    uint32_t next_id;
+    struct resume_stats stats;
+    uint64_t used[]; /* ceod_resume_cache ids of tickets presented */
+};
+
+static struct resumption *res;
+static size_t res_size;
+static krb5_context kctx;
+static krb5_keyblock key;
+
+static void lock_resumption(void) {
+    int err = pthread_mutex_lock(&res->lock);
+
+    if (err == EOWNERDEAD)
+        pthread_mutex_consistent(&res->lock);
+    else if (err)
+        fatal("pthread_mutex_lock: %s", strerror(err));
+}
+
+static void unlock_resumption(void) {
+    pthread_mutex_unlock(&res->lock);
+}
+
+static uint32_t now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned long long elapsed_us(const struct timespec *from) {
+    struct timespec to;
+
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    return (to.tv_sec - from->tv_sec) * 1000000ULL + (to.tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Remembers that the ticket with this id has been presented, in a slot
+ * that is free or whose ticket has expired. Returns -1 if it was presented
+ * before, or if there is no room to remember it. */
+static int claim_ticket(uint64_t id) {
+    uint32_t now = now_sec();
+    uint64_t *free_slot = NULL;
+    int ret = -1;
+
+    /* look at every slot in reach before taking a free one, since the id
+     * may be past one that has expired since it was stored */
+    lock_resumption();
+    for (int i = 0; i < TICKET_PROBE; i++) {
+        uint64_t *slot = &res->used[(id + i) % ceod_resume_cache];
+
+        if (*slot == id) {
+            free_slot = NULL;
+            break;
+        }
+        if ((*slot >> 32) <= now && !free_slot)
+            free_slot = slot;
+    }
+    if (free_slot) {
+        *free_slot = id;
+        ret = 0;
+    }
+    unlock_resumption();
+
+    return ret;
+}
+
+/* Appends a ticket for the authenticated session sess to out, which may
+ * be presented for any of features. */
+int issue_ticket(struct gss_session *sess, uint32_t features, struct strbuf *out) {
+    struct ticket_header hdr;
+    struct strbuf plain = STRBUF_INIT;
+    krb5_data data;
+    krb5_enc_data sealed;
+    krb5_error_code retval;
+    size_t len;
+    int ret = -1;
+
+    if (!res || !ceod_resume_lifetime) {
+        error("resumption tickets are not enabled");
+        return -1;
+    }
+
+    lock_resumption();
+    hdr.id = htobe64((uint64_t)(now_sec() + ceod_resume_lifetime) << 32 | res->next_id++);
+    unlock_resumption();
+    hdr.features = htonl(features);
+
+    strbuf_add(&plain, &hdr, sizeof(hdr));
+    if (gss_session_export(sess, &plain))
+        goto out;
+
+    retval = krb5_c_encrypt_length(kctx, TICKET_ENCTYPE, plain.len, &len);
+    if (retval) {
+        error("krb5_c_encrypt_length: %s", error_message(retval));
+        goto out;
+    }
+
+    strbuf_grow(out, len);
+    data.data = plain.buf;
+    data.length = plain.len;
+    memset(&sealed, 0, sizeof(sealed));
+    sealed.ciphertext.data = out->buf + out->len;
+    sealed.ciphertext.length = len;
+
+    retval = krb5_c_encrypt(kctx, &key, TICKET_USAGE, NULL, &data, &sealed);
+    if (retval) {
+        error("krb5_c_encrypt: %s", error_message(retval));
+        goto out;
+    }
+    strbuf_setlen(out, out->len + sealed.ciphertext.length);
+
+    lock_resumption();
+    res->stats.issued++;
+    unlock_resumption();
+    ret = 0;
+
+out:
+    /* it has our keys in it */
+    memset(plain.buf, 0, plain.len);
+    strbuf_release(&plain);
+    return ret;
+}
+
+/* Takes up the context in a ticket presented by a client on an idle
+ * session and stores the features we grant it out of those it wants.
+ * Returns -1 if the ticket is no good, and the session must not be used
+ * after that. */
+int resume_session(struct gss_session *sess, const void *ticket, size_t len, uint32_t wanted,
+                   uint32_t *features) {
+    struct ticket_header hdr;
+    struct strbuf plain = STRBUF_INIT;
+    struct timespec start;
+    krb5_data data;
+    krb5_enc_data sealed;
+    krb5_error_code retval;
+    int ret = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!res || !ceod_resume_lifetime) {
+        error("resumption tickets are not enabled");
+        return -1;
+    }
+
+    strbuf_grow(&plain, len);
+    memset(&sealed, 0, sizeof(sealed));
+    sealed.enctype = TICKET_ENCTYPE;
+    sealed.ciphertext.data = (char *)ticket;
+    sealed.ciphertext.length = len;
+    data.data = plain.buf;
+    data.length = len;
+
+    retval = krb5_c_decrypt(kctx, &key, TICKET_USAGE, NULL, &sealed, &data);
+    if (retval) {
+        debug("krb5_c_decrypt: %s", error_message(retval));
+        error("bad resumption ticket");
+        goto out;
+    }
+    strbuf_setlen(&plain, data.length);
+
+    if (plain.len < sizeof(hdr)) {
+        error("short resumption ticket");
+        goto out;
+    }
+    memcpy(&hdr, plain.buf, sizeof(hdr));
+    hdr.id = be64toh(hdr.id);
+
+    if ((hdr.id >> 32) <= now_sec()) {
+        error("resumption ticket has expired");
+        goto out;
+    }
+    if (claim_ticket(hdr.id)) {
+        error("resumption ticket has been presented before");
+        goto out;
+    }
+    if (gss_session_import(sess, plain.buf + sizeof(hdr), plain.len - sizeof(hdr)))
+        goto out;
+
+    *features = server_features(wanted & ntohl(hdr.features));
+    ret = 0;
+
+out:
+    memset(plain.buf, 0, plain.len);
+    strbuf_release(&plain);
+
+    lock_resumption();
+    if (ret) {
+        res->stats.refused++;
+    } else {
+        res->stats.resumed++;
+        res->stats.resume_us += elapsed_us(&start);
+    }
+    unlock_resumption();
+
+    return ret;
+}
+
+/* called once a Kerberos exchange started at start is complete */
+void count_handshake(const struct timespec *start) {
+    unsigned long long us = elapsed_us(start);
+
+    lock_resumption();
+    res->stats.handshakes++;
+    res->stats.handshake_us += us;
+    unlock_resumption();
+}
+
+void log_resume_stats(void) {
+    struct resume_stats stats;
+    unsigned long long handshake_us, resume_us;
+
+    lock_resumption();
+    stats = res->stats;
+    unlock_resumption();
+
+    handshake_us = stats.handshakes ? stats.handshake_us / stats.handshakes : 0;
+    resume_us = stats.resumed ? stats.resume_us / stats.resumed : 0;
+
+    notice("sessions: %lu authenticated (%llu us each), %lu resumed (%llu us each), "
+           "%lu resumptions refused, %lu tickets issued, about %llu ms saved",
+           stats.handshakes, handshake_us, stats.resumed, resume_us, stats.refused, stats.issued,
+           handshake_us > resume_us ? stats.resumed * (handshake_us - resume_us) / 1000 : 0);
+}
+
+void setup_resume(void) {
+    pthread_mutexattr_t mattr;
+    krb5_error_code retval;
+
+    if (ceod_resume_lifetime < 0)
+        badconf("ceod_resume_lifetime must not be negative");
+    if (ceod_resume_lifetime && ceod_resume_cache < TICKET_PROBE)
+        badconf("ceod_resume_cache must be at least %d", TICKET_PROBE);
+
+    res_size = sizeof(*res);
+    if (ceod_resume_lifetime)
+        res_size += ceod_resume_cache * sizeof(*res->used);
+
+    res = mmap(NULL, res_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED)
+        fatalpe("mmap");
+    memset(res, 0, res_size);
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&res->lock, &mattr))
+        fatal("pthread_mutex_init failed");
+    pthread_mutexattr_destroy(&mattr);
+
+    if (!ceod_resume_lifetime)
+        return;
+
+    retval = krb5_init_context(&kctx);
+    if (retval)
+        fatal("krb5_init_context: %s", error_message(retval));
+
+    retval = krb5_c_make_random_key(kctx, TICKET_ENCTYPE, &key);
+    if (retval)
+        fatal("krb5_c_make_random_key: %s", error_message(retval));
+}
+
+void free_resume(void) {
+    if (kctx) {
+        krb5_free_keyblock_contents(kctx, &key);
+        krb5_free_context(kctx);
+        kctx = NULL;
+    }
+
+    if (res) {
+        munmap(res, res_size);
+        res = NULL;
+    }
+}
@@ -9,6 +9,9 @@
 #include <errno.h>
 #include <netdb.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "util.h"
 #include "strbuf.h"
@@ -31,7 +34,7 @@ static void signal_handler(int sig) {
     }
 }
 
-static void setup_slave_sigs(void) {
+void setup_slave_sigs(void) {
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sigemptyset(&sa.sa_mask);
@@ -48,14 +51,82 @@ static void setup_slave_sigs(void) {
         raise(fatal_signal);
 }
 
-static void handle_auth_message(struct strbuf *in, struct strbuf *out) {
+/* the features we grant a client that asks for them in MSG_AUTH_EXT */
+uint32_t server_features(uint32_t wanted) {
+    uint32_t features = 0;
+
+    if (ceod_pipeline_depth > 1)
+        features |= CEO_FEATURE_PIPELINE;
+    features |= CEO_FEATURE_CHUNKED | CEO_FEATURE_PROGRESS;
+    if (ceod_compress_threshold)
+        features |= CEO_FEATURE_COMPRESS;
+    if (ceod_resume_lifetime)
+        features |= CEO_FEATURE_RESUME;
+
+    return wanted & features;
+}
+
+/* the same for a client on the local socket, which has nothing to gain
+ * from tickets or compression */
+uint32_t local_features(uint32_t wanted) {
+    return server_features(wanted & ~(CEO_FEATURE_RESUME | CEO_FEATURE_COMPRESS));
+}
+
+/* State of the current connection. Once pipelining is on, ops run on the
+ * runner threads from dop.c, and conn_lock serializes our use of the GSS
+ * context along with the writes, so that responses are wrapped in the same
+ * order as they go out. */
+static struct ceo_conn conn;
+static char addrstr[INET_ADDRSTRLEN];
+static int local_client;
+static uint32_t features;
+static int inflight;
+static int conn_reaped;
+static int runners_started;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;
+
+static void handle_auth_message(struct strbuf *in, struct strbuf *out, uint32_t msgtype) {
     gss_buffer_desc incoming_tok, outgoing_tok;
     OM_uint32 maj_stat, min_stat;
+    struct timespec start;
+    uint32_t wanted;
+
+    /* the kernel has vouched for a local client, which may only ask for
+     * features, before any have been granted */
+    if (local_client) {
+        if (msgtype != MSG_AUTH_EXT || in->len != sizeof(wanted) || features)
+            fatal("unexpected auth token from %s", addrstr);
+        memcpy(&wanted, in->buf, sizeof(wanted));
+        features = local_features(ntohl(wanted));
+        wanted = htonl(features);
+        strbuf_add(out, &wanted, sizeof(wanted));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     incoming_tok.value = in->buf;
     incoming_tok.length = in->len;
 
-    process_server_token(&incoming_tok, &outgoing_tok);
+    if (msgtype == MSG_AUTH_EXT) {
+        if (in->len < sizeof(wanted))
+            fatal("short MSG_AUTH_EXT");
+        memcpy(&wanted, in->buf, sizeof(wanted));
+        incoming_tok.value = in->buf + sizeof(wanted);
+        incoming_tok.length = in->len - sizeof(wanted);
+
+        features = server_features(ntohl(wanted));
+        wanted = htonl(features);
+        strbuf_add(out, &wanted, sizeof(wanted));
+    }
+
+    if (process_server_token(&incoming_tok, &outgoing_tok)) {
+        /* krb5 contexts are accepted on the client's first token */
+        if (check_replay(incoming_tok.value, incoming_tok.length))
+            fatal("authentication failed");
+        count_handshake(&start);
+    }
 
     strbuf_add(out, outgoing_tok.value, outgoing_tok.length);
 
@@ -66,79 +137,429 @@ static void handle_auth_message(struct strbuf *in, struct strbuf *out) {
     }
 }
 
-static void handle_op_message(uint32_t in_type, struct strbuf *in, struct strbuf *out) {
-    struct op *op = get_local_op(in_type);
-    struct strbuf in_plain = STRBUF_INIT, out_plain = STRBUF_INIT;
-    char *envp[16];
+/* drops a connection that has been stuck for too long; its ops still
+ * running see the hangup and give up */
+static void reap_connection(void) {
+    notice("reaping connection from %s after %s timeout", addrstr, conn_phase_names[conn.expired]);
+    count_reaped(conn.expired);
+    shutdown(conn.fd, SHUT_RDWR);
+    conn_reaped = 1;
+}
+
+static void send_frame(struct strbuf *out) {
+    if (!ceo_conn_write(&conn, out->buf, out->len))
+        return;
+    if (conn.expired != CONN_WRITE)
+        fatalpe("write");
+    reap_connection();
+}
+
+/* called on whichever thread runs the op, as soon as it reports progress */
+static void send_progress(struct op_job *job, const char *msg, size_t len) {
+    struct strbuf report = STRBUF_INIT, out = STRBUF_INIT;
+
+    strbuf_add(&report, msg, len);
+
+    pthread_mutex_lock(&conn_lock);
+    if (!conn_reaped) {
+        gss_encipher_frames(&report, &out, job->op->id | MSG_FLAG_PROGRESS, job->reqid, features);
+        send_frame(&out);
+    }
+    pthread_mutex_unlock(&conn_lock);
+
+    strbuf_release(&report);
+    strbuf_release(&out);
+}
+
+/* msgtype is that of the request's first frame, flags and all */
+static struct op_job *make_job(uint32_t msgtype, struct strbuf *in) {
+    struct op *op = get_local_op(msgtype & ~MSG_FRAME_FLAGS);
+    struct op_job *job;
 
     if (!op)
-        fatal("operation %x does not exist", in_type);
-
-    debug("running op: %s", op->name);
+        fatal("operation %x does not exist", msgtype & ~MSG_FRAME_FLAGS);
 
     /* TEMPORARY */
     if (!client_username())
         fatal("unathenticated");
 
-    gss_decipher(in, &in_plain);
+    job = new_job(op, client_username());
+    if (features & CEO_FEATURE_PROGRESS)
+        job->progress = send_progress;
+    job->cancel_fd = dup(conn.fd);
+    if (job->cancel_fd < 0)
+        fatalpe("dup");
 
-    make_env(envp, "LANG", "C", "CEO_USER", client_username(),
-                   "CEO_CONFIG_DIR", config_dir, NULL);
-    char *argv[] = { op->path, NULL, };
+    gss_decipher_frame(in, &job->in, msgtype);
 
-    if (spawnvemu(op->path, argv, envp, &in_plain, &out_plain, 0, op->user))
-        fatal("child %s failed", op->path);
+    return job;
+}
 
-    gss_encipher(&out_plain, out);
+/* Appends the frames answering a finished job to out, or nothing if the
+ * client hung up and there is nobody left to answer. */
+static void add_response(struct op_job *job, struct strbuf *out) {
+    int ids = features & CEO_FEATURE_PIPELINE;
+    uint32_t msgtype, value;
+    size_t frame;
+
+    if (job->retry_ms || job->status == OP_TIMEDOUT) {
+        msgtype = job->retry_ms ? MSG_BUSY : MSG_TIMEOUT;
+        value = htonl(job->retry_ms ?: job->op->timeout);
+
+        frame = ids ? ceo_frame_start_id(out) : ceo_frame_start(out);
+        strbuf_add(out, &value, sizeof(value));
+        if (ids)
+            ceo_frame_finish_id(out, frame, msgtype, job->reqid);
+        else
+            ceo_frame_finish(out, frame, msgtype);
+        return;
+    }
+
+    if (job->status == OP_CANCELLED)
+        return;
 
-    if (!out->len)
-        fatal("no response from op");
+    if (job->status)
+        fatal("op %s failed", job->op->name);
 
-    free_env(envp);
-    strbuf_release(&in_plain);
-    strbuf_release(&out_plain);
+    gss_encipher_frames(&job->out, out, job->op->id, job->reqid, features);
 }
 
-static void handle_one_message(int sock, struct strbuf *in, uint32_t msgtype) {
+static void handle_one_message(struct strbuf *in, uint32_t msgtype) {
     struct strbuf out = STRBUF_INIT;
+    struct op_job *job;
+
+    if (msgtype == MSG_AUTH || msgtype == MSG_AUTH_EXT) {
+        size_t frame = ceo_frame_start(&out);
+
+        handle_auth_message(in, &out, msgtype);
+        ceo_frame_finish(&out, frame, msgtype);
+        if (out.len == MSG_HEADERLEN)
+            strbuf_reset(&out);
+    } else {
+        job = make_job(msgtype, in);
+        run_job(job);
+        add_response(job, &out);
+        free_job(job);
+    }
+
+    if (out.len)
+        send_frame(&out);
+
+    strbuf_release(&out);
+}
 
-    if (msgtype == MSG_AUTH)
-        handle_auth_message(in, &out);
+/* called on a runner thread when a pipelined op is done */
+static void pipelined_job_done(struct op_job *job) {
+    struct strbuf out = STRBUF_INIT;
+
+    pthread_mutex_lock(&conn_lock);
+
+    add_response(job, &out);
+    if (out.len && !conn_reaped)
+        send_frame(&out);
+
+    inflight--;
+    pthread_cond_broadcast(&conn_cond);
+    pthread_mutex_unlock(&conn_lock);
+
+    strbuf_release(&out);
+    free_job(job);
+}
+
+static void submit_pipelined(struct strbuf *in, uint32_t msgtype, uint32_t reqid) {
+    struct op_job *job;
+
+    if (!runners_started) {
+        start_runners(ceod_pipeline_depth);
+        runners_started = 1;
+    }
+
+    pthread_mutex_lock(&conn_lock);
+    job = make_job(msgtype, in);
+    inflight++;
+    pthread_mutex_unlock(&conn_lock);
+
+    job->reqid = reqid;
+    job->done = pipelined_job_done;
+    submit_job(job);
+}
+
+/* the client's last auth token, with its first request riding along */
+static void handle_auth_op(struct strbuf *in) {
+    struct strbuf auth, request;
+    uint32_t optype;
+
+    if (ceo_split_auth_op(in, &auth, &request, &optype))
+        fatal("malformed MSG_AUTH_OP from %s", addrstr);
+    if (optype & MSG_FLAG_MORE)
+        fatal("chunked request in MSG_AUTH_OP from %s", addrstr);
+
+    handle_one_message(&auth, MSG_AUTH_EXT);
+    if (!client_authenticated())
+        fatal("MSG_AUTH_OP from %s before its last token", addrstr);
+
+    if (features & CEO_FEATURE_PIPELINE)
+        submit_pipelined(&request, optype, 1);
     else
-        handle_op_message(msgtype, in, &out);
+        handle_one_message(&request, optype);
+}
 
-    if (out.len && ceo_send_message(sock, out.buf, out.len, msgtype))
-        fatalpe("write");
+static int ops_inflight(void) {
+    int n;
+
+    pthread_mutex_lock(&conn_lock);
+    n = inflight;
+    pthread_mutex_unlock(&conn_lock);
+
+    return n;
+}
 
+/* waits until fewer than max ops of this connection are in flight */
+static void wait_for_inflight(int max) {
+    pthread_mutex_lock(&conn_lock);
+    while (inflight >= max)
+        pthread_cond_wait(&conn_cond, &conn_lock);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+/* a ticket in place of the auth tokens; returns -1 if it is no good */
+static int handle_resume(struct strbuf *in) {
+    struct strbuf out = STRBUF_INIT;
+    uint32_t wanted, granted;
+    size_t frame;
+
+    if (client_authenticated() || in->len < sizeof(wanted))
+        fatal("unexpected MSG_RESUME from %s", addrstr);
+    memcpy(&wanted, in->buf, sizeof(wanted));
+
+    if (resume_session(gss_default_session(), in->buf + sizeof(wanted), in->len - sizeof(wanted),
+                       ntohl(wanted), &features)) {
+        notice("refused resumption from %s", addrstr);
+        return -1;
+    }
+    notice("client resumed as %s", client_principal());
+
+    granted = htonl(features);
+    frame = ceo_frame_start(&out);
+    strbuf_add(&out, &granted, sizeof(granted));
+    ceo_frame_finish(&out, frame, MSG_RESUME);
+    send_frame(&out);
     strbuf_release(&out);
+
+    return 0;
 }
 
-void slave_main(int sock, struct sockaddr *addr) {
-    char addrstr[INET_ADDRSTRLEN];
-    struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+/* The client's next ticket. Our end of the context must have seen every
+ * message of the connection by the time it is exported, so it waits for
+ * the ops in flight. */
+static void handle_ticket(struct strbuf *in, int pipelined) {
+    struct strbuf out = STRBUF_INIT;
+    size_t frame;
+    uint32_t lifetime = htonl(ceod_resume_lifetime), wanted;
+
+    if (!(features & CEO_FEATURE_RESUME) || !client_authenticated() || in->len != sizeof(wanted))
+        fatal("unexpected MSG_TICKET from %s", addrstr);
+    memcpy(&wanted, in->buf, sizeof(wanted));
+
+    wait_for_inflight(1);
+
+    pthread_mutex_lock(&conn_lock);
+    frame = pipelined ? ceo_frame_start_id(&out) : ceo_frame_start(&out);
+    strbuf_add(&out, &lifetime, sizeof(lifetime));
+    if (issue_ticket(gss_default_session(), server_features(ntohl(wanted)), &out))
+        fatal("failed to issue a ticket to %s", addrstr);
+    if (pipelined)
+        ceo_frame_finish_id(&out, frame, MSG_TICKET, 0);
+    else
+        ceo_frame_finish(&out, frame, MSG_TICKET);
+    if (!conn_reaped)
+        send_frame(&out);
+    pthread_mutex_unlock(&conn_lock);
+
+    strbuf_release(&out);
+}
+
+/* The rest of a chunked request, after its first frame. */
+struct chunk_reader {
     uint32_t msgtype;
+    uint32_t reqid;
+    int done;
+    int failed;
+    struct strbuf frame;
+};
+
+/* Appends the next chunk of the request to buf (see struct spawn_feed). A
+ * deadline is the op's, so the client is not to blame for missing it: the
+ * rest of the request is still read, once the op is gone. */
+static int read_chunk(void *ctx, struct strbuf *buf, long long deadline) {
+    struct chunk_reader *cr = ctx;
+    int ids = features & CEO_FEATURE_PIPELINE;
+    uint32_t msgtype, reqid = cr->reqid;
+    int saved[CONN_PHASES];
+    int ret;
+
+    if (cr->done)
+        return 1;
+    if (cr->failed)
+        return -1;
+
+    memcpy(saved, conn.timeouts, sizeof(saved));
+    if (deadline) {
+        long long left = deadline - monotonic_ms();
+
+        if (left <= 0)
+            return -1;
+        for (int phase = 0; phase < CONN_PHASES; phase++) {
+            if (!conn.timeouts[phase] || conn.timeouts[phase] > left)
+                conn.timeouts[phase] = left;
+        }
+    }
+
+    ret = ceo_conn_read_frame(&conn, &cr->frame, &msgtype, ids ? &reqid : NULL);
+    memcpy(conn.timeouts, saved, sizeof(saved));
+    if (ret < 0 && conn.expired >= 0 && deadline && monotonic_ms() >= deadline)
+        return -1;
+    if (ret < 0 && conn.expired >= 0)
+        reap_connection();
+    else if (ret < 0)
+        fatal("failed to receive message");
+    if (ret) {
+        cr->failed = 1;
+        return -1;
+    }
+
+    if ((msgtype & ~MSG_FRAME_FLAGS) != cr->msgtype || reqid != cr->reqid)
+        fatal("unexpected frame in chunked request from %s", addrstr);
+
+    cr->done = !(msgtype & MSG_FLAG_MORE);
+    gss_decipher_frame(&cr->frame, buf, msgtype);
+
+    return 0;
+}
+
+/* A chunked request has the connection to itself: ops that are exec'd read
+ * it from their stdin as it arrives, and for others it is put together
+ * first, as long as it fits in ceod_conn_memory. */
+static void handle_chunked(struct strbuf *in, uint32_t msgtype, uint32_t reqid) {
+    struct chunk_reader cr = { .msgtype = msgtype & ~MSG_FRAME_FLAGS, .reqid = reqid };
+    struct spawn_feed feed = { .more = read_chunk, .ctx = &cr };
+    struct strbuf out = STRBUF_INIT, rest = STRBUF_INIT;
+    struct op_job *job;
+
+    if (!(features & CEO_FEATURE_CHUNKED) || cr.msgtype == MSG_AUTH || cr.msgtype == MSG_AUTH_EXT ||
+            cr.msgtype == MSG_AUTH_OP)
+        fatal("unexpected chunked message from %s", addrstr);
+
+    wait_for_inflight(1);
+
+    strbuf_init(&cr.frame, 0);
+    job = make_job(msgtype, in);
+    job->reqid = reqid;
+
+    if (op_streams_input(job->op)) {
+        job->feed = &feed;
+    } else {
+        while (!read_chunk(&cr, &job->in, 0)) {
+            if (job->in.len > ceod_conn_memory)
+                fatal("request from %s for op %s exceeds ceod_conn_memory", addrstr, job->op->name);
+        }
+    }
+
+    if (!cr.failed)
+        run_job(job);
+    else
+        job->status = OP_CANCELLED;
+
+    /* whatever the op did not read */
+    while (!read_chunk(&cr, &rest, 0))
+        strbuf_reset(&rest);
+
+    pthread_mutex_lock(&conn_lock);
+    add_response(job, &out);
+    if (out.len && !conn_reaped)
+        send_frame(&out);
+    pthread_mutex_unlock(&conn_lock);
+
+    strbuf_release(&out);
+    strbuf_release(&rest);
+    strbuf_release(&cr.frame);
+    free_job(job);
+}
+
+void serve_client(int sock, struct sockaddr *addr) {
+    struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+    uint32_t msgtype, reqid;
     struct strbuf msg = STRBUF_INIT;
 
-    if (addr->sa_family != AF_INET)
-        fatal("unsupported address family %d", addr->sa_family);
+    local_client = addr->sa_family == AF_UNIX;
 
-    if (!inet_ntop(AF_INET, &addr_in->sin_addr, addrstr, sizeof(addrstr)))
+    if (local_client) {
+        if (trust_local_peer(sock, gss_default_session(), addrstr, sizeof(addrstr)))
+            fatal("refused local connection from %s", addrstr);
+    } else if (addr->sa_family != AF_INET) {
+        fatal("unsupported address family %d", addr->sa_family);
+    } else if (!inet_ntop(AF_INET, &addr_in->sin_addr, addrstr, sizeof(addrstr))) {
         fatalpe("inet_ntop");
+    }
 
     notice("accepted connection from %s", addrstr);
 
-    setup_slave_sigs();
-
-    while (!terminate) {
-        if (ceo_receive_message(sock, &msg, &msgtype))
+    /* so that reads and writes can time out */
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK))
+        fatalpe("fcntl");
+
+    features = 0;
+    conn_reaped = 0;
+    ceo_conn_init(&conn, sock);
+    set_conn_timeouts(&conn);
+
+    while (!terminate && !conn_reaped) {
+        /* frames carry request ids once the client is authenticated */
+        int pipelined = (features & CEO_FEATURE_PIPELINE) && client_authenticated();
+        int ret;
+
+        if (pipelined)
+            wait_for_inflight(ceod_pipeline_depth);
+
+        ret = ceo_conn_read_frame(&conn, &msg, &msgtype, pipelined ? &reqid : NULL);
+        /* a client waiting for its ops is not idle */
+        if (ret < 0 && conn.expired == CONN_IDLE && ops_inflight())
+            continue;
+        if (ret < 0 && conn.expired >= 0) {
+            reap_connection();
+            break;
+        }
+        if (ret < 0)
+            fatal("failed to receive message");
+        if (ret)
             break;
-        handle_one_message(sock, &msg, msgtype);
+
+        if (msgtype & MSG_FLAG_MORE)
+            handle_chunked(&msg, msgtype, pipelined ? reqid : 0);
+        else if (msgtype == MSG_AUTH_OP && !pipelined)
+            handle_auth_op(&msg);
+        else if (msgtype == MSG_RESUME && !client_authenticated()) {
+            if (handle_resume(&msg))
+                break;
+        } else if (msgtype == MSG_TICKET)
+            handle_ticket(&msg, pipelined);
+        else if (pipelined && msgtype != MSG_AUTH && msgtype != MSG_AUTH_EXT)
+            submit_pipelined(&msg, msgtype, reqid);
+        else
+            handle_one_message(&msg, msgtype);
     }
 
-    notice("connection closed by peer %s", addrstr);
+    /* the ops still running see the hangup and give up */
+    wait_for_inflight(1);
+
+    if (!conn_reaped)
+        notice("connection closed by peer %s", addrstr);
 
+    ceo_conn_release(&conn);
     strbuf_release(&msg);
+}
 
+void free_slave(void) {
     /* stuff allocated by dmaster */
     free_gss();
     free_config();
@@ -147,3 +568,9 @@ void slave_main(int sock, struct sockaddr *addr) {
     free(prog);
 }
 
+void slave_main(int sock, struct sockaddr *addr) {
+    setup_slave_sigs();
+    serve_client(sock, addr);
+    stop_runners();
+    free_slave();
+}
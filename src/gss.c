@@ -2,41 +2,80 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <grp.h>
+#include <gssapi/gssapi_ext.h>
 
 #include "util.h"
 #include "gss.h"
 #include "net.h"
 #include "strbuf.h"
+#include "config.h"
+
+/* Everything about one peer lives in a gss_session, so that a process can
+ * authenticate many connections at once. The non-session functions below
+ * operate on the current session, normally the default one, and exit on
+ * any error. */
+struct gss_session {
+    gss_ctx_id_t context_handle;
+    gss_name_t peer_name;
+    char *peer_principal;
+    char *peer_username;
+    OM_uint32 ret_flags;
+    int complete;
+    int no_iov;     /* the mechanism cannot wrap in place */
+    int trusted;    /* a local peer, whose messages are not wrapped */
+};
 
 static gss_cred_id_t my_creds = GSS_C_NO_CREDENTIAL;
-static gss_ctx_id_t context_handle = GSS_C_NO_CONTEXT;
-static gss_name_t peer_name = GSS_C_NO_NAME;
 static gss_name_t imported_service = GSS_C_NO_NAME;
-static char *peer_principal;
-static char *peer_username;
-static OM_uint32 ret_flags;
-static int complete;
+static struct gss_session default_session, *current = &default_session;
 char service_name[128];
 
-void free_gss(void) {
+static void release_session(struct gss_session *sess) {
     OM_uint32 maj_stat, min_stat;
 
-    if (peer_name) {
-        maj_stat = gss_release_name(&min_stat, &peer_name);
+    if (sess->peer_name) {
+        maj_stat = gss_release_name(&min_stat, &sess->peer_name);
         if (maj_stat != GSS_S_COMPLETE)
-            gss_fatal("gss_release_name", maj_stat, min_stat);
+            gss_error("gss_release_name", maj_stat, min_stat);
     }
 
-    if (imported_service) {
-        maj_stat = gss_release_name(&min_stat, &imported_service);
+    if (sess->context_handle) {
+        maj_stat = gss_delete_sec_context(&min_stat, &sess->context_handle, GSS_C_NO_BUFFER);
         if (maj_stat != GSS_S_COMPLETE)
-            gss_fatal("gss_release_name", maj_stat, min_stat);
+            gss_error("gss_delete_sec_context", maj_stat, min_stat);
     }
 
-    if (context_handle) {
-        maj_stat = gss_delete_sec_context(&min_stat, &context_handle, GSS_C_NO_BUFFER);
+    free(sess->peer_principal);
+    free(sess->peer_username);
+    memset(sess, 0, sizeof(*sess));
+}
+
+struct gss_session *gss_session_new(void) {
+    return xcalloc(1, sizeof(struct gss_session));
+}
+
+void gss_session_free(struct gss_session *sess) {
+    if (!sess)
+        return;
+    release_session(sess);
+    free(sess);
+}
+
+/* forget the peer but keep our credentials, so that the next connection can
+ * be authenticated by the same process */
+void reset_gss(void) {
+    release_session(current);
+}
+
+void free_gss(void) {
+    OM_uint32 maj_stat, min_stat;
+
+    release_session(current);
+
+    if (imported_service) {
+        maj_stat = gss_release_name(&min_stat, &imported_service);
         if (maj_stat != GSS_S_COMPLETE)
-            gss_fatal("gss_delete_sec_context", maj_stat, min_stat);
+            gss_fatal("gss_release_name", maj_stat, min_stat);
     }
 
     if (my_creds) {
@@ -44,9 +83,6 @@ void free_gss(void) {
         if (maj_stat != GSS_S_COMPLETE)
             gss_fatal("gss_release_creds", maj_stat, min_stat);
     }
-
-    free(peer_principal);
-    free(peer_username);
 }
 
 static char *gssbuf2str(gss_buffer_t buf) {
@@ -80,6 +116,12 @@ static void display_status(char *prefix, OM_uint32 code, int type) {
     }
 }
 
+void gss_error(char *msg, OM_uint32 maj_stat, OM_uint32 min_stat) {
+    logmsg(LOG_ERR, "error: %s", msg);
+    display_status("major", maj_stat, GSS_C_GSS_CODE);
+    display_status("minor", min_stat, GSS_C_MECH_CODE);
+}
+
 void gss_fatal(char *msg, OM_uint32 maj_stat, OM_uint32 min_stat) {
     logmsg(LOG_ERR, "fatal: %s", msg);
     display_status("major", maj_stat, GSS_C_GSS_CODE);
@@ -91,6 +133,13 @@ static void import_service(const char *service, const char *hostname) {
     OM_uint32 maj_stat, min_stat;
     gss_buffer_desc buf_desc;
 
+    /* clients that fail over import the next host's in its place */
+    if (imported_service) {
+        maj_stat = gss_release_name(&min_stat, &imported_service);
+        if (maj_stat != GSS_S_COMPLETE)
+            gss_fatal("gss_release_name", maj_stat, min_stat);
+    }
+
     if (snprintf(service_name, sizeof(service_name),
                  "%s@%s", service, hostname) >= sizeof(service_name))
         fatal("service name too long");
@@ -104,19 +153,26 @@ static void import_service(const char *service, const char *hostname) {
         gss_fatal("gss_import_name", maj_stat, min_stat);
 }
 
-static void check_services(OM_uint32 flags) {
+static int check_services(OM_uint32 flags) {
     debug("gss services: %sconf %sinteg %smutual %sreplay %ssequence",
             flags & GSS_C_CONF_FLAG     ? "+" : "-",
             flags & GSS_C_INTEG_FLAG    ? "+" : "-",
             flags & GSS_C_MUTUAL_FLAG   ? "+" : "-",
             flags & GSS_C_REPLAY_FLAG   ? "+" : "-",
             flags & GSS_C_SEQUENCE_FLAG ? "+" : "-");
-    if (~flags & GSS_C_CONF_FLAG)
-        fatal("confidentiality service required");
-    if (~flags & GSS_C_INTEG_FLAG)
-        fatal("integrity service required");
-    if (~flags & GSS_C_MUTUAL_FLAG)
-        fatal("mutual authentication required");
+    if (~flags & GSS_C_CONF_FLAG) {
+        error("confidentiality service required");
+        return -1;
+    }
+    if (~flags & GSS_C_INTEG_FLAG) {
+        error("integrity service required");
+        return -1;
+    }
+    if (~flags & GSS_C_MUTUAL_FLAG) {
+        error("mutual authentication required");
+        return -1;
+    }
+    return 0;
 }
 
 void server_acquire_creds(const char *service) {
@@ -174,42 +230,153 @@ static char *princ_to_username(char *princ) {
     return ret;
 }
 
-int process_server_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok) {
+/* fills in who sess->peer_name is */
+static int name_peer(struct gss_session *sess) {
     OM_uint32 maj_stat, min_stat;
-    OM_uint32 time_rec;
     gss_OID name_type;
     gss_buffer_desc peer_princ;
 
-    if (complete)
-        fatal("unexpected %zd-byte token from peer", incoming_tok->length);
+    maj_stat = gss_display_name(&min_stat, sess->peer_name, &peer_princ, &name_type);
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_display_name", maj_stat, min_stat);
+        return -1;
+    }
+
+    sess->peer_principal = xstrdup((char *)peer_princ.value);
+    sess->peer_username = princ_to_username((char *)peer_princ.value);
 
-    maj_stat = gss_accept_sec_context(&min_stat, &context_handle, my_creds,
-            incoming_tok, GSS_C_NO_CHANNEL_BINDINGS, &peer_name, NULL,
-            outgoing_tok, &ret_flags, &time_rec, NULL);
-    if (maj_stat == GSS_S_COMPLETE) {
-        check_services(ret_flags);
+    maj_stat = gss_release_buffer(&min_stat, &peer_princ);
+    if (maj_stat != GSS_S_COMPLETE)
+        gss_error("gss_release_buffer", maj_stat, min_stat);
 
-        complete = 1;
+    return 0;
+}
 
-        maj_stat = gss_display_name(&min_stat, peer_name, &peer_princ, &name_type);
-        if (maj_stat != GSS_S_COMPLETE)
-            gss_fatal("gss_display_name", maj_stat, min_stat);
+int gss_session_accept(struct gss_session *sess, gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok) {
+    OM_uint32 maj_stat, min_stat;
+    OM_uint32 time_rec;
 
-        peer_principal = xstrdup((char *)peer_princ.value);
-        peer_username = princ_to_username((char *)peer_princ.value);
+    outgoing_tok->length = 0;
+    outgoing_tok->value = NULL;
 
-        notice("client authenticated as %s", peer_principal);
-        debug("context expires in %d seconds", time_rec);
+    if (sess->complete) {
+        error("unexpected %zd-byte token from peer", incoming_tok->length);
+        return -1;
+    }
 
-        maj_stat = gss_release_buffer(&min_stat, &peer_princ);
-        if (maj_stat != GSS_S_COMPLETE)
-            gss_fatal("gss_release_buffer", maj_stat, min_stat);
+    maj_stat = gss_accept_sec_context(&min_stat, &sess->context_handle, my_creds,
+            incoming_tok, GSS_C_NO_CHANNEL_BINDINGS, &sess->peer_name, NULL,
+            outgoing_tok, &sess->ret_flags, &time_rec, NULL);
+    if (maj_stat == GSS_S_COMPLETE) {
+        if (check_services(sess->ret_flags) || name_peer(sess))
+            goto fail;
+        sess->complete = 1;
+
+        notice("client authenticated as %s", sess->peer_principal);
+        debug("context expires in %d seconds", time_rec);
 
     } else if (maj_stat != GSS_S_CONTINUE_NEEDED) {
-        gss_fatal("gss_accept_sec_context", maj_stat, min_stat);
+        gss_error("gss_accept_sec_context", maj_stat, min_stat);
+        goto fail;
+    }
+
+    return sess->complete;
+
+fail:
+    if (outgoing_tok->length)
+        gss_release_buffer(&min_stat, outgoing_tok);
+    return -1;
+}
+
+/* Takes the word of a peer on the other end of a UNIX socket, which the
+ * kernel has vouched for, that it is the user name: sess is authenticated
+ * as name without any Kerberos, and its messages go unwrapped. */
+void gss_session_trust(struct gss_session *sess, const char *name) {
+    release_session(sess);
+    sess->peer_principal = xstrdup(name);
+    sess->peer_username = xstrdup(name);
+    sess->trusted = 1;
+    sess->complete = 1;
+}
+
+/* Appends the context of an authenticated session to out in a form that
+ * gss_session_import() can take up again, in this process or another.
+ * Exporting a context takes it away from us, so it is imported right back. */
+int gss_session_export(struct gss_session *sess, struct strbuf *out) {
+    OM_uint32 maj_stat, min_stat;
+    gss_buffer_desc token;
+
+    if (!sess->complete || sess->trusted) {
+        error("cannot export a context before authentication");
+        return -1;
     }
 
-    return complete;
+    maj_stat = gss_export_sec_context(&min_stat, &sess->context_handle, &token);
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_export_sec_context", maj_stat, min_stat);
+        return -1;
+    }
+
+    maj_stat = gss_import_sec_context(&min_stat, &token, &sess->context_handle);
+    if (maj_stat == GSS_S_COMPLETE)
+        strbuf_add(out, token.value, token.length);
+    else
+        gss_error("gss_import_sec_context", maj_stat, min_stat);
+
+    gss_release_buffer(&min_stat, &token);
+
+    return maj_stat == GSS_S_COMPLETE ? 0 : -1;
+}
+
+/* Takes up a context exported by gss_session_export(), which leaves sess
+ * authenticated just as it was when the context was exported. */
+int gss_session_import(struct gss_session *sess, const void *buf, size_t len) {
+    OM_uint32 maj_stat, min_stat;
+    OM_uint32 lifetime;
+    gss_buffer_desc token = { .length = len, .value = (void *)buf };
+    gss_name_t source, target;
+    int local, open;
+
+    if (sess->context_handle || sess->complete) {
+        error("cannot import a context into a session in use");
+        return -1;
+    }
+
+    maj_stat = gss_import_sec_context(&min_stat, &token, &sess->context_handle);
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_import_sec_context", maj_stat, min_stat);
+        return -1;
+    }
+
+    maj_stat = gss_inquire_context(&min_stat, sess->context_handle, &source, &target, &lifetime,
+                                   NULL, &sess->ret_flags, &local, &open);
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_inquire_context", maj_stat, min_stat);
+        return -1;
+    }
+
+    /* the peer is whichever end we are not */
+    sess->peer_name = local ? target : source;
+    gss_release_name(&min_stat, local ? &source : &target);
+
+    if (!open || !lifetime) {
+        error("imported context has expired");
+        return -1;
+    }
+    if (check_services(sess->ret_flags) || name_peer(sess))
+        return -1;
+    sess->complete = 1;
+
+    debug("resumed context with %s, which expires in %d seconds", sess->peer_principal, lifetime);
+
+    return 0;
+}
+
+int process_server_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok) {
+    int ret = gss_session_accept(current, incoming_tok, outgoing_tok);
+    if (ret < 0)
+        fatal("authentication failed");
+    return ret;
 }
 
 int process_client_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok) {
@@ -217,70 +384,203 @@ int process_client_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok) {
     OM_uint32 time_rec;
     gss_OID_desc krb5 = *gss_mech_krb5;
 
-    if (complete)
+    if (current->complete)
         fatal("unexpected token from peer");
 
-    maj_stat = gss_init_sec_context(&min_stat, GSS_C_NO_CREDENTIAL, &context_handle,
+    maj_stat = gss_init_sec_context(&min_stat, GSS_C_NO_CREDENTIAL, &current->context_handle,
                                     imported_service, &krb5, GSS_C_MUTUAL_FLAG |
                                     GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG,
                                     GSS_C_INDEFINITE, GSS_C_NO_CHANNEL_BINDINGS,
-                                    incoming_tok, NULL, outgoing_tok, &ret_flags,
+                                    incoming_tok, NULL, outgoing_tok, &current->ret_flags,
                                     &time_rec);
     if (maj_stat == GSS_S_COMPLETE) {
         notice("server authenticated as %s", service_name);
         notice("context expires in %d seconds", time_rec);
 
-        check_services(ret_flags);
+        if (check_services(current->ret_flags))
+            fatal("authentication failed");
 
-        complete = 1;
+        current->complete = 1;
 
     } else if (maj_stat != GSS_S_CONTINUE_NEEDED) {
         gss_fatal("gss_init_sec_context", maj_stat, min_stat);
     }
 
-    return complete;
+    return current->complete;
 }
 
 int initial_client_token(gss_buffer_t outgoing_tok) {
     return process_client_token(GSS_C_NO_BUFFER, outgoing_tok);
 }
 
+const char *gss_session_username(struct gss_session *sess) {
+    return sess->complete ? sess->peer_username : NULL;
+}
+
 char *client_principal(void) {
-    if (!complete)
+    if (!current->complete)
         fatal("authentication checked before finishing");
-    return peer_principal;
+    return current->peer_principal;
+}
+
+int client_authenticated(void) {
+    return current->complete;
+}
+
+/* Whether requests may be wrapped for the server already: krb5 can protect
+ * them as soon as our first token is out, though the server has not proven
+ * who it is until its answer comes back. */
+int client_prot_ready(void) {
+    OM_uint32 wanted = GSS_C_PROT_READY_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG;
+
+    return current->complete || (current->ret_flags & wanted) == wanted;
 }
 
 char *client_username(void) {
-    if (!complete)
+    if (!current->complete)
         fatal("authentication checked before finishing");
-    return peer_username;
+    return current->peer_username;
 }
 
-void gss_encipher(struct strbuf *plain, struct strbuf *cipher) {
+/* Wrapping in place: the token is laid out at the end of cipher as header,
+ * message, padding and trailer, which together read just like what gss_wrap
+ * would have made, and the message is then encrypted where it lies. This
+ * saves gss_wrap's buffer and a copy out of it. Returns 1 if the mechanism
+ * cannot do that, and every later message goes through gss_wrap instead. */
+static int wrap_in_place(struct gss_session *sess, struct strbuf *plain, struct strbuf *cipher) {
     OM_uint32 maj_stat, min_stat;
-    gss_buffer_desc plain_tok, cipher_tok;
+    gss_iov_buffer_desc iov[4];
+    size_t len = 0;
+    char *pos;
     int conf_state;
 
+    if (sess->trusted) {
+        strbuf_addbuf(cipher, plain);
+        return 0;
+    }
+    if (sess->no_iov)
+        return 1;
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.length = plain->len;
+    iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+
+    maj_stat = gss_wrap_iov_length(&min_stat, sess->context_handle, 1, GSS_C_QOP_DEFAULT,
+                                   &conf_state, iov, 4);
+    if (maj_stat == GSS_S_UNAVAILABLE) {
+        debug("gss_wrap_iov is not available, falling back to gss_wrap");
+        sess->no_iov = 1;
+        return 1;
+    }
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_wrap_iov_length", maj_stat, min_stat);
+        return -1;
+    }
+
+    for (int i = 0; i < 4; i++)
+        len += iov[i].buffer.length;
+    strbuf_grow(cipher, len);
+
+    pos = cipher->buf + cipher->len;
+    for (int i = 0; i < 4; i++) {
+        iov[i].buffer.value = pos;
+        pos += iov[i].buffer.length;
+    }
+    memcpy(iov[1].buffer.value, plain->buf, plain->len);
+
+    maj_stat = gss_wrap_iov(&min_stat, sess->context_handle, 1, GSS_C_QOP_DEFAULT,
+                            &conf_state, iov, 4);
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_wrap_iov", maj_stat, min_stat);
+        return -1;
+    }
+    if (!conf_state) {
+        error("gss_encipher: confidentiality service required");
+        return -1;
+    }
+
+    strbuf_setlen(cipher, cipher->len + len);
+    return 0;
+}
+
+/* Unwraps cipher where it lies and points plain at the message inside it.
+ * Returns 1 if the mechanism cannot do that, as wrap_in_place() does. */
+static int unwrap_in_place(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain) {
+    OM_uint32 maj_stat, min_stat;
+    gss_iov_buffer_desc iov[2];
+    gss_qop_t qop_state;
+    int conf_state;
+
+    if (sess->trusted) {
+        *plain = *cipher;
+        plain->alloc = 0;
+        return 0;
+    }
+    if (sess->no_iov)
+        return 1;
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].type = GSS_IOV_BUFFER_TYPE_STREAM;
+    iov[0].buffer.value = cipher->buf;
+    iov[0].buffer.length = cipher->len;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+
+    maj_stat = gss_unwrap_iov(&min_stat, sess->context_handle, &conf_state, &qop_state, iov, 2);
+    if (maj_stat == GSS_S_UNAVAILABLE) {
+        debug("gss_unwrap_iov is not available, falling back to gss_unwrap");
+        sess->no_iov = 1;
+        return 1;
+    }
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_unwrap_iov", maj_stat, min_stat);
+        return -1;
+    }
+    if (!conf_state) {
+        error("gss_decipher: confidentiality service required");
+        return -1;
+    }
+
+    plain->alloc = 0;
+    plain->buf = iov[1].buffer.value;
+    plain->len = iov[1].buffer.length;
+    return 0;
+}
+
+int gss_session_encipher(struct gss_session *sess, struct strbuf *plain, struct strbuf *cipher) {
+    OM_uint32 maj_stat, min_stat;
+    gss_buffer_desc plain_tok, cipher_tok;
+    int conf_state, ret;
+
+    ret = wrap_in_place(sess, plain, cipher);
+    if (ret <= 0)
+        return ret;
+
     plain_tok.value = plain->buf;
     plain_tok.length = plain->len;
 
-    maj_stat = gss_wrap(&min_stat, context_handle, 1, GSS_C_QOP_DEFAULT,
+    maj_stat = gss_wrap(&min_stat, sess->context_handle, 1, GSS_C_QOP_DEFAULT,
                         &plain_tok, &conf_state, &cipher_tok);
-    if (maj_stat != GSS_S_COMPLETE)
-        gss_fatal("gss_wrap", maj_stat, min_stat);
-
-    if (!conf_state)
-        fatal("gss_encipher: confidentiality service required");
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_wrap", maj_stat, min_stat);
+        return -1;
+    }
 
-    strbuf_add(cipher, cipher_tok.value, cipher_tok.length);
+    if (conf_state)
+        strbuf_add(cipher, cipher_tok.value, cipher_tok.length);
+    else
+        error("gss_encipher: confidentiality service required");
 
     maj_stat = gss_release_buffer(&min_stat, &cipher_tok);
     if (maj_stat != GSS_S_COMPLETE)
-        gss_fatal("gss_release_buffer", maj_stat, min_stat);
+        gss_error("gss_release_buffer", maj_stat, min_stat);
+
+    return conf_state ? 0 : -1;
 }
 
-void gss_decipher(struct strbuf *cipher, struct strbuf *plain) {
+static int unwrap_copy(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain) {
     OM_uint32 maj_stat, min_stat;
     gss_buffer_desc plain_tok, cipher_tok;
     int conf_state;
@@ -289,19 +589,167 @@ void gss_decipher(struct strbuf *cipher, struct strbuf *plain) {
     cipher_tok.value = cipher->buf;
     cipher_tok.length = cipher->len;
 
-    maj_stat = gss_unwrap(&min_stat, context_handle, &cipher_tok,
+    maj_stat = gss_unwrap(&min_stat, sess->context_handle, &cipher_tok,
                           &plain_tok, &conf_state, &qop_state);
-    if (maj_stat != GSS_S_COMPLETE)
-        gss_fatal("gss_unwrap", maj_stat, min_stat);
-
-    if (!conf_state)
-        fatal("gss_encipher: confidentiality service required");
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_unwrap", maj_stat, min_stat);
+        return -1;
+    }
 
-    strbuf_add(plain, plain_tok.value, plain_tok.length);
+    if (conf_state)
+        strbuf_add(plain, plain_tok.value, plain_tok.length);
+    else
+        error("gss_decipher: confidentiality service required");
 
     maj_stat = gss_release_buffer(&min_stat, &plain_tok);
     if (maj_stat != GSS_S_COMPLETE)
-        gss_fatal("gss_release_buffer", maj_stat, min_stat);
+        gss_error("gss_release_buffer", maj_stat, min_stat);
+
+    return conf_state ? 0 : -1;
+}
+
+/* Unwraps cipher onto the end of plain. cipher is decrypted where it lies,
+ * so its contents are lost. */
+int gss_session_decipher(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain) {
+    struct strbuf msg;
+    int ret;
+
+    ret = unwrap_in_place(sess, cipher, &msg);
+    if (ret > 0)
+        return unwrap_copy(sess, cipher, plain);
+    if (!ret)
+        strbuf_add(plain, msg.buf, msg.len);
+
+    return ret;
 }
 
+/* Unwraps the body of a frame of type msgtype onto the end of plain,
+ * inflating it if it is compressed. */
+int gss_session_decipher_frame(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain, uint32_t msgtype) {
+    struct strbuf packed = STRBUF_INIT, msg;
+    int ret;
+
+    if (!(msgtype & MSG_FLAG_COMPRESSED))
+        return gss_session_decipher(sess, cipher, plain);
+
+    ret = unwrap_in_place(sess, cipher, &msg);
+    if (ret > 0) {
+        ret = unwrap_copy(sess, cipher, &packed);
+        msg = packed;
+    }
+    if (!ret && ceo_decompress(msg.buf, msg.len, plain)) {
+        error("bad compressed frame");
+        ret = -1;
+    }
+
+    strbuf_release(&packed);
+    return ret;
+}
 
+/* Appends plain to out as a frame of type msgtype, or as a chunked message
+ * if it is too big for one and features has CEO_FEATURE_CHUNKED. Frame
+ * headers carry reqid if features has CEO_FEATURE_PIPELINE, and frame
+ * bodies are compressed if features has CEO_FEATURE_COMPRESS (see
+ * MSG_FLAG_COMPRESSED). */
+int gss_session_encipher_frames(struct gss_session *sess, struct strbuf *plain, struct strbuf *out,
+                                uint32_t msgtype, uint32_t reqid, uint32_t features) {
+    size_t start = out->len, pos = 0;
+    int ids = features & CEO_FEATURE_PIPELINE;
+    size_t headerlen = ids ? MSG_IDHEADERLEN : MSG_HEADERLEN;
+    struct strbuf packed = STRBUF_INIT;
+
+    do {
+        struct strbuf piece = { .alloc = 0, .len = plain->len - pos, .buf = plain->buf + pos };
+        struct strbuf *body = &piece;
+        size_t frame = ids ? ceo_frame_start_id(out) : ceo_frame_start(out);
+        uint32_t type = msgtype;
+
+        if ((features & CEO_FEATURE_CHUNKED) && piece.len > MSG_CHUNKLEN) {
+            piece.len = MSG_CHUNKLEN;
+            type |= MSG_FLAG_MORE;
+        }
+
+        if ((features & CEO_FEATURE_COMPRESS) && ceod_compress_threshold &&
+                piece.len >= ceod_compress_threshold) {
+            strbuf_reset(&packed);
+            if (!ceo_compress(piece.buf, piece.len, &packed, ceod_compress_level)) {
+                body = &packed;
+                type |= MSG_FLAG_COMPRESSED;
+            }
+        }
+
+        if (gss_session_encipher(sess, body, out))
+            goto fail;
+        if (out->len - frame - headerlen > MAX_MSGLEN) {
+            error("message of %zu bytes is too big for a frame", plain->len);
+            goto fail;
+        }
+
+        if (ids)
+            ceo_frame_finish_id(out, frame, type, reqid);
+        else
+            ceo_frame_finish(out, frame, type);
+        pos += piece.len;
+    } while (pos < plain->len);
+
+    strbuf_release(&packed);
+    return 0;
+
+fail:
+    strbuf_release(&packed);
+    strbuf_setlen(out, start);
+    return -1;
+}
+
+void gss_encipher_frames(struct strbuf *plain, struct strbuf *out, uint32_t msgtype, uint32_t reqid, uint32_t features) {
+    if (gss_session_encipher_frames(current, plain, out, msgtype, reqid, features))
+        fatal("gss_encipher failed");
+}
+
+/* seconds until the context of sess expires, 0 if it has */
+OM_uint32 gss_session_time_left(struct gss_session *sess) {
+    OM_uint32 maj_stat, min_stat, time_rec;
+
+    if (sess->trusted)
+        return GSS_C_INDEFINITE;
+    if (!sess->context_handle)
+        return 0;
+
+    maj_stat = gss_context_time(&min_stat, sess->context_handle, &time_rec);
+    if (maj_stat == GSS_S_CONTEXT_EXPIRED)
+        return 0;
+    if (maj_stat != GSS_S_COMPLETE) {
+        gss_error("gss_context_time", maj_stat, min_stat);
+        return 0;
+    }
+
+    return time_rec;
+}
+
+/* the session the functions above work on */
+struct gss_session *gss_default_session(void) {
+    return current;
+}
+
+/* Points the functions above at sess, or back at the default session if
+ * it is NULL, so that a client can keep a context with each of several
+ * servers. Call client_acquire_creds() for the server before starting a
+ * context on sess. */
+void gss_switch_session(struct gss_session *sess) {
+    current = sess ? sess : &default_session;
+}
+
+void gss_encipher(struct strbuf *plain, struct strbuf *cipher) {
+    if (gss_session_encipher(current, plain, cipher))
+        fatal("gss_encipher failed");
+}
+
+void gss_decipher(struct strbuf *cipher, struct strbuf *plain) {
+    if (gss_session_decipher(current, cipher, plain))
+        fatal("gss_decipher failed");
+}
+
+void gss_decipher_frame(struct strbuf *cipher, struct strbuf *plain, uint32_t msgtype) {
+    if (gss_session_decipher_frame(current, cipher, plain, msgtype))
+        fatal("gss_decipher failed");
+}
@@ -4,12 +4,35 @@
 void server_acquire_creds(const char *service);
 void client_acquire_creds(const char *service, const char *hostname);
 void gss_fatal(char *msg, OM_uint32 maj_stat, OM_uint32 min_stat);
+void gss_error(char *msg, OM_uint32 maj_stat, OM_uint32 min_stat);
 int process_server_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok);
 int process_client_token(gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok);
 int initial_client_token(gss_buffer_t outgoing_tok);
 char *client_principal(void);
 char *client_username(void);
+int client_authenticated(void);
+int client_prot_ready(void);
+void reset_gss(void);
 void free_gss(void);
 
 void gss_encipher(struct strbuf *plain, struct strbuf *cipher);
 void gss_decipher(struct strbuf *cipher, struct strbuf *plain);
+void gss_decipher_frame(struct strbuf *cipher, struct strbuf *plain, uint32_t msgtype);
+void gss_encipher_frames(struct strbuf *plain, struct strbuf *out, uint32_t msgtype, uint32_t reqid, uint32_t features);
+
+struct gss_session;
+struct gss_session *gss_session_new(void);
+void gss_session_free(struct gss_session *sess);
+int gss_session_accept(struct gss_session *sess, gss_buffer_t incoming_tok, gss_buffer_t outgoing_tok);
+const char *gss_session_username(struct gss_session *sess);
+int gss_session_encipher(struct gss_session *sess, struct strbuf *plain, struct strbuf *cipher);
+int gss_session_decipher(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain);
+int gss_session_decipher_frame(struct gss_session *sess, struct strbuf *cipher, struct strbuf *plain, uint32_t msgtype);
+int gss_session_encipher_frames(struct gss_session *sess, struct strbuf *plain, struct strbuf *out,
+                                uint32_t msgtype, uint32_t reqid, uint32_t features);
+void gss_session_trust(struct gss_session *sess, const char *name);
+int gss_session_export(struct gss_session *sess, struct strbuf *out);
+int gss_session_import(struct gss_session *sess, const void *buf, size_t len);
+OM_uint32 gss_session_time_left(struct gss_session *sess);
+struct gss_session *gss_default_session(void);
+void gss_switch_session(struct gss_session *sess);
@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
 #include <sys/utsname.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
 
 #include "util.h"
 #include "net.h"
@@ -14,6 +20,11 @@ struct strbuf fqdn = STRBUF_INIT;
 const size_t MAX_MSGLEN = 65536;
 const size_t MSG_BUFINC = 4096;
 
+/* how much a connection asks for per read */
+#define CONN_READ_SIZE 16384
+
+const char *const conn_phase_names[] = { "idle", "header", "body", "write" };
+
 void setup_fqdn(void) {
     struct utsname uts;
     struct hostent *lo;
@@ -31,50 +42,208 @@ void free_fqdn(void) {
     strbuf_release(&fqdn);
 }
 
-int ceo_send_message(int sock, void *buf, size_t len, uint32_t msgtype) {
+static int full_writev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt) {
+        ssize_t wcount = writev(fd, iov, iovcnt);
+        if (wcount < 0 && errno == EINTR)
+            continue;
+        if (wcount < 0)
+            return -1;
+
+        while (iovcnt && wcount >= iov->iov_len) {
+            wcount -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + wcount;
+            iov->iov_len -= wcount;
+        }
+    }
+
+    return 0;
+}
+
+/* sends the next len bytes of body, from *pos on, as one frame */
+static int write_chunk(int sock, const struct iovec *body, size_t *pos, size_t len, uint32_t msgtype) {
+    struct iovec iov[8];
     uint32_t msgheader[2];
+    size_t skip = *pos, left = len;
+    int iovcnt = 1;
+
     msgheader[0] = htonl(len);
     msgheader[1] = htonl(msgtype);
+    iov[0].iov_base = msgheader;
+    iov[0].iov_len = sizeof(msgheader);
 
-    if (full_write(sock, msgheader, sizeof(msgheader)) < 0)
-        fatalpe("write");
+    for (; left; body++) {
+        size_t n = body->iov_len;
+
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        n -= skip;
+        if (n > left)
+            n = left;
+        iov[iovcnt++] = (struct iovec) { .iov_base = (char *)body->iov_base + skip, .iov_len = n };
+        left -= n;
+        skip = 0;
+    }
+
+    *pos += len;
+    return full_writev(sock, iov, iovcnt);
+}
+
+/* Sends body[0..iovcnt-1] as a single message with one system call, or as
+ * a chunked message with one per frame if it is too big for one. */
+int ceo_write_messagev(int sock, const struct iovec *body, int iovcnt, uint32_t msgtype) {
+    size_t len = 0, pos = 0;
+
+    if (iovcnt >= 8) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+        len += body[i].iov_len;
+
+    if (len <= MAX_MSGLEN)
+        return write_chunk(sock, body, &pos, len, msgtype);
+
+    while (len - pos > MSG_CHUNKLEN) {
+        if (write_chunk(sock, body, &pos, MSG_CHUNKLEN, msgtype | MSG_FLAG_MORE))
+            return -1;
+    }
+
+    return write_chunk(sock, body, &pos, len - pos, msgtype);
+}
+
+int ceo_write_message(int sock, void *buf, size_t len, uint32_t msgtype) {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return ceo_write_messagev(sock, &iov, 1, msgtype);
+}
+
+/* Frames built in place: ceo_frame_start() reserves room for the header at
+ * the end of sb, the caller appends the body right behind it (gss_encipher
+ * can wrap straight into it), and ceo_frame_finish() fills in the header so
+ * that the whole frame can go out with a single write. */
+size_t ceo_frame_start(struct strbuf *sb) {
+    size_t start = sb->len;
+
+    strbuf_grow(sb, MSG_HEADERLEN);
+    strbuf_setlen(sb, start + MSG_HEADERLEN);
+
+    return start;
+}
+
+/* the same for frames with a request id, which ceo_frame_finish_id() fills in */
+size_t ceo_frame_start_id(struct strbuf *sb) {
+    size_t start = sb->len;
+
+    strbuf_grow(sb, MSG_IDHEADERLEN);
+    strbuf_setlen(sb, start + MSG_IDHEADERLEN);
+
+    return start;
+}
+
+void ceo_frame_finish(struct strbuf *sb, size_t start, uint32_t msgtype) {
+    uint32_t msgheader[2];
+
+    msgheader[0] = htonl(sb->len - start - MSG_HEADERLEN);
+    msgheader[1] = htonl(msgtype);
+    memcpy(sb->buf + start, msgheader, sizeof(msgheader));
+}
+
+void ceo_frame_finish_id(struct strbuf *sb, size_t start, uint32_t msgtype, uint32_t reqid) {
+    uint32_t msgheader[3];
+
+    msgheader[0] = htonl(sb->len - start - MSG_IDHEADERLEN);
+    msgheader[1] = htonl(msgtype);
+    msgheader[2] = htonl(reqid);
+    memcpy(sb->buf + start, msgheader, sizeof(msgheader));
+}
 
-    if (full_write(sock, buf, len) < 0)
+int ceo_send_message(int sock, void *buf, size_t len, uint32_t msgtype) {
+    if (ceo_write_message(sock, buf, len, msgtype))
         fatalpe("write");
 
     return 0;
 }
 
-int ceo_receive_message(int sock, struct strbuf *msg, uint32_t *msgtype) {
+/* Waits for sock, if it is non-blocking, until deadline (a monotonic_ms()
+ * time, or 0 for none). Fails with ETIMEDOUT when the deadline passes. */
+static int wait_socket(int sock, short events, long long deadline) {
+    struct pollfd pfd = { .fd = sock, .events = events };
+    int ret, wait = -1;
+
+    for (;;) {
+        if (deadline) {
+            long long left = deadline - monotonic_ms();
+            wait = left > 0 ? left : 0;
+        }
+
+        ret = poll(&pfd, 1, wait);
+        if (ret > 0)
+            return 0;
+        if (!ret) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+static int wait_readable(int sock) {
+    return wait_socket(sock, POLLIN, 0);
+}
+
+/* Reads a frame with a request id in its header if reqid is not NULL,
+ * without reading past its end. Returns 1 if the peer closed the connection
+ * between messages, and -1 after logging an error if anything else went
+ * wrong. */
+int ceo_read_frame(int sock, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid) {
     uint32_t msglen, received = 0;
-    uint32_t msgheader[2];
+    uint32_t msgheader[3];
+    size_t headerlen = reqid ? MSG_IDHEADERLEN : MSG_HEADERLEN;
     ssize_t bytes;
 
     strbuf_reset(msg);
 
-    while (received < sizeof(msgheader)) {
-        bytes = read(sock, msgheader, sizeof(msgheader) - received);
+    while (received < headerlen) {
+        bytes = read(sock, (char *)msgheader + received, headerlen - received);
         if (bytes < 0) {
-            if (errno == EAGAIN)
+            if (errno == EINTR || (errno == EAGAIN && !wait_readable(sock)))
                 continue;
-            fatalpe("read");
+            errorpe("read");
+            return -1;
         }
         if (!bytes && !received)
+            return 1;
+        if (!bytes) {
+            error("short header received");
             return -1;
-        if (!bytes)
-            fatalpe("short header received");
+        }
         received += bytes;
     }
 
     msglen = ntohl(msgheader[0]);
     *msgtype = ntohl(msgheader[1]);
+    if (reqid)
+        *reqid = ntohl(msgheader[2]);
     received = 0;
 
-    if (!msglen)
-        fatal("length is zero in message header");
+    if (!msglen) {
+        error("length is zero in message header");
+        return -1;
+    }
 
-    if (msglen > MAX_MSGLEN)
-        fatal("length is huge in message header");
+    if (msglen > MAX_MSGLEN) {
+        error("length is huge in message header");
+        return -1;
+    }
 
     strbuf_grow(msg, msglen);
     strbuf_setlen(msg, msglen);
@@ -82,14 +251,367 @@ int ceo_receive_message(int sock, struct strbuf *msg, uint32_t *msgtype) {
     while (received < msglen) {
         bytes = read(sock, msg->buf + received, msglen - received);
         if (bytes < 0) {
-            if (errno == EAGAIN)
+            if (errno == EINTR || (errno == EAGAIN && !wait_readable(sock)))
                 continue;
-            fatalpe("read");
+            errorpe("read");
+            return -1;
+        }
+        if (!bytes) {
+            error("short message received");
+            return -1;
         }
-        if (!bytes)
-            fatal("short message received");
         received += bytes;
     }
 
     return 0;
 }
+
+/* Reads a message without request ids, putting a chunked one together. */
+int ceo_read_message(int sock, struct strbuf *msg, uint32_t *msgtype) {
+    struct strbuf chunk = STRBUF_INIT;
+    uint32_t first;
+    int ret = ceo_read_frame(sock, msg, msgtype, NULL);
+
+    first = *msgtype & ~MSG_FLAG_MORE;
+
+    while (!ret && (*msgtype & MSG_FLAG_MORE)) {
+        ret = ceo_read_frame(sock, &chunk, msgtype, NULL);
+        if (ret > 0) {
+            error("short message received");
+            ret = -1;
+        } else if (!ret && (*msgtype & ~MSG_FLAG_MORE) != first) {
+            error("unexpected frame in chunked message");
+            ret = -1;
+        }
+        if (!ret)
+            strbuf_addbuf(msg, &chunk);
+    }
+
+    strbuf_release(&chunk);
+    return ret;
+}
+
+int ceo_receive_message(int sock, struct strbuf *msg, uint32_t *msgtype) {
+    int ret = ceo_read_message(sock, msg, msgtype);
+
+    if (ret < 0)
+        fatal("failed to receive message");
+
+    return ret ? -1 : 0;
+}
+
+/* Parses the header of the frame at the start of buf[0..len-1]. Returns the
+ * size of the whole frame if all of it is there, 0 if more is needed, and
+ * -1 if the header is bad (with hdr filled in, for the error message). */
+ssize_t ceo_parse_frame(const char *buf, size_t len, size_t headerlen, struct ceo_frame_header *hdr) {
+    uint32_t msgheader[3];
+
+    if (len < headerlen)
+        return 0;
+
+    memcpy(msgheader, buf, headerlen);
+    hdr->len = ntohl(msgheader[0]);
+    hdr->type = ntohl(msgheader[1]);
+    hdr->reqid = headerlen == MSG_IDHEADERLEN ? ntohl(msgheader[2]) : 0;
+
+    if (!hdr->len || hdr->len > MAX_MSGLEN)
+        return -1;
+    if (len - headerlen < hdr->len)
+        return 0;
+
+    return headerlen + hdr->len;
+}
+
+/* starts a connection without timeouts */
+void ceo_conn_init(struct ceo_conn *conn, int fd) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    strbuf_init(&conn->rbuf, 0);
+    conn->expired = -1;
+}
+
+/* releases the buffer; closing fd is up to the caller */
+void ceo_conn_release(struct ceo_conn *conn) {
+    strbuf_release(&conn->rbuf);
+    conn->rpos = 0;
+}
+
+/* Reads whatever is available into the buffer, making room for at least
+ * need more bytes. Returns 1 at end of file. */
+static int conn_fill(struct ceo_conn *conn, size_t need, long long deadline) {
+    ssize_t bytes;
+
+    if (conn->rpos) {
+        strbuf_remove(&conn->rbuf, 0, conn->rpos);
+        conn->rpos = 0;
+    }
+
+    strbuf_grow(&conn->rbuf, need > CONN_READ_SIZE ? need : CONN_READ_SIZE);
+
+    for (;;) {
+        bytes = read(conn->fd, conn->rbuf.buf + conn->rbuf.len, strbuf_avail(&conn->rbuf));
+        if (bytes >= 0)
+            break;
+        if (errno == EINTR || (errno == EAGAIN && !wait_socket(conn->fd, POLLIN, deadline)))
+            continue;
+        return -1;
+    }
+
+    strbuf_setlen(&conn->rbuf, conn->rbuf.len + bytes);
+
+    return !bytes;
+}
+
+/* what a connection with buffered bytes of the next frame waits for */
+int ceo_conn_phase(size_t buffered, size_t headerlen) {
+    if (!buffered)
+        return CONN_IDLE;
+    if (buffered < headerlen)
+        return CONN_HEADER;
+    return CONN_BODY;
+}
+
+static long long phase_deadline(struct ceo_conn *conn, int phase) {
+    return conn->timeouts[phase] ? monotonic_ms() + conn->timeouts[phase] : 0;
+}
+
+/* The same as ceo_read_frame(), except that frames already read from the
+ * connection are returned without another read, and that each phase of
+ * reading the frame has its own deadline. */
+int ceo_conn_read_frame(struct ceo_conn *conn, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid) {
+    size_t headerlen = reqid ? MSG_IDHEADERLEN : MSG_HEADERLEN;
+    struct ceo_frame_header hdr;
+    long long deadline = 0;
+    int phase = -1;
+    ssize_t size;
+    int ret;
+
+    conn->expired = -1;
+
+    while (!(size = ceo_parse_frame(conn->rbuf.buf + conn->rpos, conn->rbuf.len - conn->rpos, headerlen, &hdr))) {
+        size_t avail = conn->rbuf.len - conn->rpos;
+
+        if (phase != ceo_conn_phase(avail, headerlen)) {
+            phase = ceo_conn_phase(avail, headerlen);
+            deadline = phase_deadline(conn, phase);
+        }
+
+        ret = conn_fill(conn, avail < headerlen ? headerlen - avail : headerlen + hdr.len - avail, deadline);
+        if (ret < 0 && errno == ETIMEDOUT) {
+            conn->expired = phase;
+            return -1;
+        }
+        if (ret < 0) {
+            errorpe("read");
+            return -1;
+        }
+        if (ret && conn->rpos == conn->rbuf.len)
+            return 1;
+        if (ret) {
+            error(conn->rbuf.len - conn->rpos < headerlen ? "short header received" : "short message received");
+            return -1;
+        }
+    }
+
+    if (size < 0) {
+        error("length is %s in message header", hdr.len ? "huge" : "zero");
+        return -1;
+    }
+
+    strbuf_reset(msg);
+    strbuf_add(msg, conn->rbuf.buf + conn->rpos + headerlen, hdr.len);
+    *msgtype = hdr.type;
+    if (reqid)
+        *reqid = hdr.reqid;
+
+    conn->rpos += size;
+    if (conn->rpos == conn->rbuf.len) {
+        strbuf_reset(&conn->rbuf);
+        conn->rpos = 0;
+    }
+
+    return 0;
+}
+
+/* Writes all of buf, giving the peer the write timeout to take it. On a
+ * timeout, returns -1 with errno ETIMEDOUT and expired set. */
+int ceo_conn_write(struct ceo_conn *conn, const void *buf, size_t len) {
+    long long deadline = phase_deadline(conn, CONN_WRITE);
+    const char *p = buf;
+
+    while (len) {
+        ssize_t bytes = write(conn->fd, p, len);
+        if (bytes < 0) {
+            if (errno == EINTR || (errno == EAGAIN && !wait_socket(conn->fd, POLLOUT, deadline)))
+                continue;
+            if (errno == ETIMEDOUT)
+                conn->expired = CONN_WRITE;
+            return -1;
+        }
+        p += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/* Appends buf[0..len-1] to out compressed at the given zlib level. Returns
+ * -1 and leaves out alone if that would not make it any smaller. */
+int ceo_compress(const void *buf, size_t len, struct strbuf *out, int level) {
+    uLongf packed = compressBound(len);
+
+    strbuf_grow(out, packed);
+    if (compress2((Bytef *)out->buf + out->len, &packed, buf, len, level) != Z_OK || packed >= len)
+        return -1;
+
+    strbuf_setlen(out, out->len + packed);
+    return 0;
+}
+
+/* Appends what buf[0..len-1] inflates to to out. Returns -1 if it is
+ * corrupt or would not fit in a frame. */
+int ceo_decompress(const void *buf, size_t len, struct strbuf *out) {
+    uLongf plain = MAX_MSGLEN;
+
+    strbuf_grow(out, plain);
+    if (uncompress((Bytef *)out->buf + out->len, &plain, buf, len) != Z_OK)
+        return -1;
+
+    strbuf_setlen(out, out->len + plain);
+    return 0;
+}
+
+/* Points auth and request into the body of the MSG_AUTH_OP frame in msg,
+ * which must outlive them. Returns -1 if it is malformed. */
+int ceo_split_auth_op(struct strbuf *msg, struct strbuf *auth, struct strbuf *request, uint32_t *optype) {
+    uint32_t authlen;
+
+    if (msg->len < sizeof(authlen))
+        return -1;
+    memcpy(&authlen, msg->buf, sizeof(authlen));
+    authlen = ntohl(authlen);
+    if (authlen > msg->len - sizeof(authlen) || msg->len - sizeof(authlen) - authlen < sizeof(*optype))
+        return -1;
+
+    auth->alloc = 0;
+    auth->len = authlen;
+    auth->buf = msg->buf + sizeof(authlen);
+
+    memcpy(optype, auth->buf + authlen, sizeof(*optype));
+    *optype = ntohl(*optype);
+
+    request->alloc = 0;
+    request->buf = auth->buf + authlen + sizeof(*optype);
+    request->len = msg->len - sizeof(authlen) - authlen - sizeof(*optype);
+
+    return 0;
+}
+
+/* Frames go out with one write each, so Nagle's algorithm can only hold
+ * them back. Accepted sockets inherit this from the listener. */
+int ceo_set_nodelay(int sock) {
+    int opt = 1;
+
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+/* Lets up to qlen clients at a time send data along with their SYN. */
+int ceo_set_fastopen(int sock, int qlen) {
+#ifdef TCP_FASTOPEN
+    return setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#else
+    return 0;
+#endif
+}
+
+/* Makes connect() return at once and the first write go out with the SYN,
+ * if the kernel has a cookie for the server; otherwise it falls back to a
+ * normal handshake on its own. */
+int ceo_set_fastopen_connect(int sock) {
+#ifdef TCP_FASTOPEN_CONNECT
+    int opt = 1;
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) && errno != ENOPROTOOPT)
+        return -1;
+#endif
+    return 0;
+}
+
+/* Probes a connection that has been quiet for idle seconds, so that one
+ * whose peer has gone away without a word fails within about twice that. */
+int ceo_set_keepalive(int sock, int idle) {
+    int on = 1, interval = idle / 3 ?: 1, count = 3;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)))
+        return -1;
+
+    return 0;
+}
+
+int ceo_send_fd(int sock, int fd) {
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* returns the received descriptor, or -1 with errno set (0 on EOF) */
+int ceo_receive_fd(int sock) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    ssize_t bytes;
+    int fd;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    while ((bytes = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    if (!bytes) {
+        errno = 0;
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
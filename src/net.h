@@ -4,15 +4,122 @@
 #include <arpa/inet.h>
 #include <gssapi/gssapi.h>
 
+#include "strbuf.h"
+
 typedef struct sockaddr sa;
 
+struct iovec;
+
+#define MSG_HEADERLEN 8
+/* once pipelining is negotiated, frames carry a request id as well */
+#define MSG_IDHEADERLEN 12
+
 extern struct strbuf fqdn;
+extern const size_t MAX_MSGLEN;
 extern void setup_fqdn(void);
 extern void free_fqdn(void);
 
 enum {
     MSG_AUTH    = 0x8000000,
     MSG_EXPLODE = 0x8000001,
+    MSG_BUSY    = 0x8000002,
+    MSG_TIMEOUT = 0x8000003,
+    MSG_AUTH_EXT = 0x8000004,
+    MSG_AUTH_OP = 0x8000005,
+    MSG_RESUME  = 0x8000006,
+    MSG_TICKET  = 0x8000007,
+};
+
+/* A client that knows about protocol extensions sends its first auth token
+ * as MSG_AUTH_EXT, with a be32 mask of the features it wants in front of the
+ * token. A server that knows about them answers the same way with the
+ * features it grants, which take effect once authentication is complete;
+ * older servers just hang up. */
+enum {
+    CEO_FEATURE_PIPELINE = 0x1,
+    CEO_FEATURE_CHUNKED = 0x2,
+    CEO_FEATURE_PROGRESS = 0x4,
+    CEO_FEATURE_COMPRESS = 0x8,
+    CEO_FEATURE_RESUME = 0x10,
+};
+
+/* A client whose context can protect messages as soon as its first token is
+ * out (GSS_C_PROT_READY_FLAG) may send its first request along with that
+ * token, saving a round trip: a MSG_AUTH_OP frame holds a be32 length and
+ * the body of a MSG_AUTH_EXT frame, followed by the op's be32 type and its
+ * wrapped request. The server answers the token as it would MSG_AUTH_EXT
+ * and then runs the op, answering it as request 1 if pipelining was
+ * granted. Servers that predate it hang up without answering. */
+
+/* With CEO_FEATURE_RESUME, an authenticated client may send a MSG_TICKET
+ * frame holding a be32 mask of the features it may want when it resumes,
+ * which the server answers once every request before it has been answered,
+ * with a MSG_TICKET frame that holds a be32 lifetime in seconds and an
+ * opaque ticket. Within that time, the client may open a new connection by
+ * sending a MSG_RESUME frame in place of any auth tokens, with the features
+ * it wants in front of the ticket as in MSG_AUTH_EXT, and its requests right
+ * after, wrapped with the context it had when it got the ticket. If the
+ * server takes the ticket it answers with a MSG_RESUME frame holding the
+ * features it grants; otherwise it hangs up. A ticket is good for one
+ * connection only. */
+
+/* Clients on the server's own host may connect to its local socket
+ * (ceod_local_socket) instead, where the kernel tells the server who they
+ * are: there are no auth tokens, and messages go unwrapped. Such a client
+ * may still send a MSG_AUTH_EXT frame holding nothing but its features mask
+ * before any requests, which the server answers the same way; it does not
+ * grant CEO_FEATURE_RESUME or CEO_FEATURE_COMPRESS there. */
+
+/* With CEO_FEATURE_CHUNKED, a message too big for one frame goes out as a
+ * chunked message instead: back-to-back frames that each carry up to
+ * MSG_CHUNKLEN bytes, wrapped on their own, and have MSG_FLAG_MORE set in
+ * their type, except for the last. */
+#define MSG_FLAG_MORE 0x40000000
+#define MSG_CHUNKLEN 32768
+
+/* With CEO_FEATURE_PROGRESS, an op may report on its progress before it is
+ * done: each report is a single frame of up to MSG_CHUNKLEN bytes, of the
+ * op's type with MSG_FLAG_PROGRESS set, and the op's response follows as
+ * usual once it is done. Ops see the same flag on requests whose client
+ * wants reports (see op_progress()). */
+#define MSG_FLAG_PROGRESS 0x20000000
+
+/* With CEO_FEATURE_COMPRESS, the body of a frame at least
+ * ceod_compress_threshold bytes long is compressed with zlib before it is
+ * wrapped, if that makes it any smaller, and MSG_FLAG_COMPRESSED is set in
+ * its type. Each frame of a chunked message is compressed on its own. */
+#define MSG_FLAG_COMPRESSED 0x10000000
+
+/* the flags that may differ between the frames of one message */
+#define MSG_FRAME_FLAGS (MSG_FLAG_MORE | MSG_FLAG_COMPRESSED)
+
+/* what a connection is waiting for, each with a timeout of its own */
+enum {
+    CONN_IDLE,      /* the first byte of the next frame */
+    CONN_HEADER,    /* the rest of a frame header */
+    CONN_BODY,      /* the rest of a frame body */
+    CONN_WRITE,     /* the peer to take what we are sending */
+    CONN_PHASES,
+};
+
+extern const char *const conn_phase_names[];
+
+/* The receiving end of a connection: whatever has been read from fd but
+ * not yet returned as a frame is kept in rbuf from rpos on, so a single
+ * read can pick up several frames. A phase that takes longer than its
+ * timeout (in ms, 0 for none) fails with ETIMEDOUT and sets expired. */
+struct ceo_conn {
+    int fd;
+    struct strbuf rbuf;
+    size_t rpos;
+    int timeouts[CONN_PHASES];
+    int expired;
+};
+
+struct ceo_frame_header {
+    uint32_t len;
+    uint32_t type;
+    uint32_t reqid;
 };
 
 #define EKERB -2
@@ -22,3 +129,26 @@ enum {
 
 int ceo_receive_message(int sock, struct strbuf *msg, uint32_t *msgtype);
 int ceo_send_message(int sock, void *msg, size_t len, uint32_t msgtype);
+int ceo_read_message(int sock, struct strbuf *msg, uint32_t *msgtype);
+int ceo_read_frame(int sock, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid);
+int ceo_write_message(int sock, void *msg, size_t len, uint32_t msgtype);
+int ceo_write_messagev(int sock, const struct iovec *iov, int iovcnt, uint32_t msgtype);
+size_t ceo_frame_start(struct strbuf *sb);
+size_t ceo_frame_start_id(struct strbuf *sb);
+void ceo_frame_finish(struct strbuf *sb, size_t start, uint32_t msgtype);
+void ceo_frame_finish_id(struct strbuf *sb, size_t start, uint32_t msgtype, uint32_t reqid);
+void ceo_conn_init(struct ceo_conn *conn, int fd);
+void ceo_conn_release(struct ceo_conn *conn);
+int ceo_conn_read_frame(struct ceo_conn *conn, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid);
+int ceo_conn_write(struct ceo_conn *conn, const void *buf, size_t len);
+int ceo_conn_phase(size_t buffered, size_t headerlen);
+ssize_t ceo_parse_frame(const char *buf, size_t len, size_t headerlen, struct ceo_frame_header *hdr);
+int ceo_compress(const void *buf, size_t len, struct strbuf *out, int level);
+int ceo_decompress(const void *buf, size_t len, struct strbuf *out);
+int ceo_split_auth_op(struct strbuf *msg, struct strbuf *auth, struct strbuf *request, uint32_t *optype);
+int ceo_set_nodelay(int sock);
+int ceo_set_fastopen(int sock, int qlen);
+int ceo_set_fastopen_connect(int sock);
+int ceo_set_keepalive(int sock, int idle);
+int ceo_send_fd(int sock, int fd);
+int ceo_receive_fd(int sock);
@@ -23,6 +23,7 @@
 #include "kadm.h"
 #include "daemon.h"
 #include "strbuf.h"
+#include "opworker.h"
 
 char *prog;
 
@@ -43,6 +44,16 @@ Ceo__AddUserResponse *response_create(void) {
     return r;
 }
 
+/* lets the client see each message as soon as it happens */
+static void report_message(Ceo__StatusMessage *statusmsg) {
+    size_t len = ceo__status_message__get_packed_size(statusmsg);
+    uint8_t *buf = xmalloc(len);
+
+    ceo__status_message__pack(statusmsg, buf);
+    op_progress(buf, len);
+    free(buf);
+}
+
 PRINTF_LIKE(2)
 int32_t response_message(Ceo__AddUserResponse *r, int32_t status, char *fmt, ...) {
     va_list args;
@@ -61,6 +72,8 @@ int32_t response_message(Ceo__AddUserResponse *r, int32_t status, char *fmt, ...
         fatal("too many messages");
     r->messages[r->n_messages++] = statusmsg;
 
+    report_message(statusmsg);
+
     if (status)
         error("%s", message);
     else
@@ -269,17 +282,14 @@ static int32_t adduser(Ceo__AddUser *in, Ceo__AddUserResponse *out, char *client
     return status;
 }
 
-void cmd_adduser(void) {
+/* returns non-zero if the kerberos or ldap connection seems to be broken */
+static int handle_adduser(struct strbuf *in, struct strbuf *out) {
     Ceo__AddUser *in_proto;
     Ceo__AddUserResponse *out_proto = response_create();
-    struct strbuf in = STRBUF_INIT;
-    struct strbuf out = STRBUF_INIT;
-
-    if (strbuf_read(&in, STDIN_FILENO, 0) < 0)
-        fatalpe("read");
+    int32_t status;
 
     in_proto = ceo__add_user__unpack(&protobuf_c_default_allocator,
-            in.len, (uint8_t *)in.buf);
+            in->len, (uint8_t *)in->buf);
     if (!in_proto)
         fatal("malformed add user message");
 
@@ -287,21 +297,51 @@ void cmd_adduser(void) {
     if (!client)
         fatal("environment variable CEO_USER is not set");
 
-    adduser(in_proto, out_proto, client);
+    status = adduser(in_proto, out_proto, client);
 
-    strbuf_grow(&out, ceo__add_user_response__get_packed_size(out_proto));
-    strbuf_setlen(&out, ceo__add_user_response__pack(out_proto, (uint8_t *)out.buf));
-
-    if (full_write(STDOUT_FILENO, out.buf, out.len))
-        fatalpe("write: stdout");
+    strbuf_grow(out, ceo__add_user_response__get_packed_size(out_proto));
+    strbuf_setlen(out, ceo__add_user_response__pack(out_proto, (uint8_t *)out->buf));
 
     ceo__add_user__free_unpacked(in_proto, &protobuf_c_default_allocator);
     response_delete(out_proto);
 
+    return status == EKERB || status == ELDAP;
+}
+
+void cmd_adduser(void) {
+    struct strbuf in = STRBUF_INIT;
+    struct strbuf out = STRBUF_INIT;
+
+    if (strbuf_read(&in, STDIN_FILENO, 0) < 0)
+        fatalpe("read");
+
+    handle_adduser(&in, &out);
+
+    if (full_write(STDOUT_FILENO, out.buf, out.len))
+        fatalpe("write: stdout");
+
     strbuf_release(&in);
     strbuf_release(&out);
 }
 
+static void connect_backends(void) {
+    ceo_krb5_auth(ldap_admin_principal);
+    ceo_ldap_init();
+    ceo_kadm_init();
+}
+
+static void disconnect_backends(void) {
+    ceo_kadm_cleanup();
+    ceo_ldap_cleanup();
+    ceo_krb5_deauth();
+}
+
+static const struct op_handler adduser_handler = {
+    .handle = handle_adduser,
+    .connect = connect_backends,
+    .disconnect = disconnect_backends,
+};
+
 int main(int argc, char *argv[]) {
     prog = xstrdup(basename(argv[0]));
     init_log(prog, LOG_PID, LOG_AUTHPRIV, 0);
@@ -312,15 +352,15 @@ int main(int argc, char *argv[]) {
         fatalpe("setenv");
 
     ceo_krb5_init();
-    ceo_krb5_auth(ldap_admin_principal);
-    ceo_ldap_init();
-    ceo_kadm_init();
 
-    cmd_adduser();
+    if (op_worker_mode()) {
+        op_worker_main(&adduser_handler);
+    } else {
+        connect_backends();
+        cmd_adduser();
+        disconnect_backends();
+    }
 
-    ceo_kadm_cleanup();
-    ceo_ldap_cleanup();
-    ceo_krb5_deauth();
     ceo_krb5_cleanup();
 
     free_config();
@@ -13,10 +13,13 @@
 
 static struct op *ops;
 
+const char *const op_class_names[OP_CLASSES] = { "interactive", "normal", "bulk" };
+
 static const char *default_op_dir = "/usr/lib/ceod";
 static const char *op_dir;
 
-static void add_op(char *host, char *name, char *user, uint32_t id) {
+/* Adds op name, which runs on each of the comma-separated hosts. */
+static struct op *add_op(char *hosts, char *name, char *user, uint32_t id) {
     struct op *new = xmalloc(sizeof(struct op));
     errno = 0;
     new->next = ops;
@@ -24,13 +27,40 @@ static void add_op(char *host, char *name, char *user, uint32_t id) {
     new->id = id;
     new->path = NULL;
     new->user = xstrdup(user);
-
-    struct hostent *hostent = gethostbyname(host);
-    if (!hostent)
-        badconf("cannot add op %s: %s: %s", name, host, hstrerror(h_errno));
-    new->hostname = strdup(hostent->h_name);
-    new->local = !strcmp(fqdn.buf, hostent->h_name);
-    new->addr = *(struct in_addr *)hostent->h_addr_list[0];
+    new->mode = OP_EXEC;
+    new->class = OP_CLASS_NORMAL;
+    new->timeout = 0;
+    new->cpu_weight = 0;
+    new->memory_max = NULL;
+    new->io_max = NULL;
+    new->local = 0;
+    new->hosts = NULL;
+    new->nhosts = 0;
+
+    /* requests go to the first host, or to this one if it is listed */
+    int route = 0;
+
+    for (char *host = strtok(hosts, ","); host; host = strtok(NULL, ",")) {
+        struct hostent *hostent = gethostbyname(host);
+        struct op_host *h;
+
+        if (!hostent)
+            badconf("cannot add op %s: %s: %s", name, host, hstrerror(h_errno));
+
+        new->hosts = xrealloc(new->hosts, (new->nhosts + 1) * sizeof(*new->hosts));
+        h = &new->hosts[new->nhosts++];
+        h->name = xstrdup(hostent->h_name);
+        h->addr = *(struct in_addr *)hostent->h_addr_list[0];
+
+        if (!strcmp(fqdn.buf, h->name)) {
+            new->local = 1;
+            route = new->nhosts - 1;
+        }
+    }
+    if (!new->nhosts)
+        badconf("cannot add op %s: no hosts", name);
+    new->hostname = new->hosts[route].name;
+    new->addr = new->hosts[route].addr;
 
     if (new->local) {
         new->path = xmalloc(strlen(op_dir) + strlen("/op-") + strlen(name) + 1);
@@ -44,8 +74,60 @@ static void add_op(char *host, char *name, char *user, uint32_t id) {
     }
 
     ops = new;
-    debug("added op %s (%s%s) [%s]", new->name, new->local ? "" : "on ",
-            new->local ? "local" : host, new->user);
+    debug("added op %s (%s%s%s) [%s]", new->name, new->local ? "" : "on ",
+            new->local ? "local" : new->hostname, new->nhosts > 1 ? " and elsewhere" : "", new->user);
+
+    return new;
+}
+
+static void set_op_option(struct op *op, char *option, const char *file, unsigned lineno) {
+    char *value = strchr(option, '=');
+
+    if (!value)
+        badconf("%s: expected key=value instead of '%s' on line %d", file, option, lineno);
+    *value++ = '\0';
+
+    if (!strcmp(option, "mode")) {
+        if (!strcmp(value, "exec"))
+            op->mode = OP_EXEC;
+        else if (!strcmp(value, "persistent"))
+            op->mode = OP_PERSISTENT;
+        else if (!strcmp(value, "zygote"))
+            op->mode = OP_ZYGOTE;
+        else
+            badconf("%s: unknown mode '%s' on line %d", file, value, lineno);
+    } else if (!strcmp(option, "class")) {
+        int class;
+        for (class = 0; class < OP_CLASSES; class++)
+            if (!strcmp(value, op_class_names[class]))
+                break;
+        if (class == OP_CLASSES)
+            badconf("%s: unknown class '%s' on line %d", file, value, lineno);
+        op->class = class;
+    } else if (!strcmp(option, "timeout")) {
+        char *end;
+        errno = 0;
+        op->timeout = strtol(value, &end, 10);
+        if (errno || *end || op->timeout < 0)
+            badconf("%s: invalid timeout '%s' on line %d", file, value, lineno);
+    } else if (!strcmp(option, "cpu_weight")) {
+        char *end;
+        errno = 0;
+        op->cpu_weight = strtol(value, &end, 10);
+        if (errno || *end || op->cpu_weight < 1 || op->cpu_weight > 10000)
+            badconf("%s: invalid cpu_weight '%s' on line %d", file, value, lineno);
+    } else if (!strcmp(option, "memory_max")) {
+        free(op->memory_max);
+        op->memory_max = xstrdup(value);
+    } else if (!strcmp(option, "io_max")) {
+        /* io.max takes "major:minor key=value...", which we can't split on */
+        free(op->io_max);
+        op->io_max = xstrdup(value);
+        for (char *p = op->io_max; (p = strchr(p, ',')); p++)
+            *p = ' ';
+    } else {
+        badconf("%s: unknown option '%s' on line %d", file, option, lineno);
+    }
 }
 
 struct op *get_local_op(uint32_t id) {
@@ -56,6 +138,18 @@ struct op *get_local_op(uint32_t id) {
     return NULL;
 }
 
+struct op *find_op_id(uint32_t id) {
+    for (struct op *op = ops; op; op = op->next) {
+        if (op->id == id)
+            return op;
+    }
+    return NULL;
+}
+
+struct op *list_ops(void) {
+    return ops;
+}
+
 struct op *find_op(const char *name) {
     for (struct op *op = ops; op; op = op->next) {
         if (!strcmp(name, op->name))
@@ -66,6 +160,7 @@ struct op *find_op(const char *name) {
 
 void setup_ops(void) {
     char op_config_dir[1024];
+    char op_file[2048];
     DIR *dp;
     struct dirent *de;
     struct strbuf line = STRBUF_INIT;
@@ -94,8 +189,8 @@ void setup_ops(void) {
 
             struct strbuf **words = strbuf_splitws(&line);
 
-            if (strbuf_list_len(words) != 4)
-                badconf("%s/%s: expected four words on line %d", op_config_dir, de->d_name, lineno);
+            if (strbuf_list_len(words) < 4)
+                badconf("%s/%s: expected at least four words on line %d", op_config_dir, de->d_name, lineno);
 
             errno = 0;
             char *end;
@@ -103,9 +198,13 @@ void setup_ops(void) {
             if (errno || *end)
                 badconf("%s/%s: invalid id '%s' on line %d", op_config_dir, de->d_name, words[2]->buf, lineno);
 
-            add_op(words[0]->buf, words[1]->buf, words[2]->buf, id);
+            struct op *op = add_op(words[0]->buf, words[1]->buf, words[2]->buf, id);
             op_count++;
 
+            snprintf(op_file, sizeof(op_file), "%s/%s", op_config_dir, de->d_name);
+            for (int i = 4; words[i]; i++)
+                set_op_option(op, words[i]->buf, op_file, lineno);
+
             strbuf_list_free(words);
         }
         fclose(fp);
@@ -119,9 +218,13 @@ void free_ops(void) {
     while (ops) {
         struct op *next = ops->next;
         free(ops->name);
-        free(ops->hostname);
+        for (int i = 0; i < ops->nhosts; i++)
+            free(ops->hosts[i].name);
+        free(ops->hosts);
         free(ops->path);
         free(ops->user);
+        free(ops->memory_max);
+        free(ops->io_max);
         free(ops);
         ops = next;
     }
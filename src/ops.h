@@ -1,15 +1,46 @@
+enum op_mode {
+    OP_EXEC,
+    OP_PERSISTENT,
+    OP_ZYGOTE,
+};
+
+/* scheduling classes, most urgent first */
+enum op_class {
+    OP_CLASS_INTERACTIVE,
+    OP_CLASS_NORMAL,
+    OP_CLASS_BULK,
+    OP_CLASSES,
+};
+
+extern const char *const op_class_names[OP_CLASSES];
+
+struct op_host {
+    char *name;
+    struct in_addr addr;
+};
+
 struct op {
     char *name;
     uint32_t id;
-    int local;
-    char *hostname;
+    int local;              /* one of its hosts is this one */
+    char *hostname;         /* the host requests go to, see route.c */
     char *path;
     struct in_addr addr;
+    struct op_host *hosts;  /* every host it runs on */
+    int nhosts;
     struct op *next;
     char *user;
+    enum op_mode mode;
+    enum op_class class;
+    int timeout;
+    int cpu_weight;
+    char *memory_max;
+    char *io_max;
 };
 
 void setup_ops(void);
 void free_ops(void);
 struct op *find_op(const char *name);
+struct op *find_op_id(uint32_t id);
 struct op *get_local_op(uint32_t id);
+struct op *list_ops(void);
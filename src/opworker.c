@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "strbuf.h"
+#include "net.h"
+#include "config.h"
+#include "opworker.h"
+
+/* The op side of the persistent and zygote modes (see dop.c). ceod starts
+ * the op with CEO_OP_WORKER set to the mode and a socket on stdin and
+ * stdout. The handler sees each request the way it would in exec mode: the
+ * input in a buffer and the client in CEO_USER.
+ *
+ * A persistent worker connects to its backends once and then reads one
+ * request after another from the socket. A handler returns non-zero if its
+ * backends look broken, which makes the worker reconnect them before the
+ * next request. They are also reconnected every ceod_op_worker_lifetime
+ * seconds so that tickets never expire.
+ *
+ * A zygote instead receives a fresh socket for every request and forks a
+ * child for it, which drops to CEO_OP_USER, connects, serves that single
+ * request and exits. The child first sends its pid (4 bytes, network
+ * order) over the socket, and ceod kills its process group if the request
+ * times out or the client hangs up; should ceod be gone, SIGALRM still
+ * ends it after CEO_OP_TIMEOUT seconds. */
+
+/* where op_progress() sends reports for the request being served */
+static int progress_fd = -1;
+static uint32_t progress_type;
+
+int op_worker_mode(void) {
+    return getenv("CEO_OP_WORKER") != NULL;
+}
+
+/* Tells the client about progress while the request is still being served,
+ * if it wants to know: over the request's socket in front of the response
+ * for op workers, and to CEO_PROGRESS_FD for ops that are exec'd. Reports
+ * that do not fit in a frame are dropped. */
+void op_progress(const void *msg, size_t len) {
+    const char *fd = getenv("CEO_PROGRESS_FD");
+
+    if (!len || len > MSG_CHUNKLEN)
+        return;
+
+    if (progress_fd >= 0) {
+        if (ceo_write_message(progress_fd, (void *)msg, len, progress_type))
+            fatalpe("write");
+    } else if (fd && !op_worker_mode()) {
+        if (send(atoi(fd), msg, len, MSG_NOSIGNAL) < 0)
+            warnpe("send: progress");
+    }
+}
+
+/* returns what ceo_read_message() returned, or -1 if the handler asked for
+ * its backends to be reconnected */
+static int serve_request(int fd, const struct op_handler *handler) {
+    struct strbuf msg = STRBUF_INIT, in = STRBUF_INIT, out = STRBUF_INIT;
+    uint32_t msgtype;
+    size_t userlen;
+    int ret;
+
+    ret = ceo_read_message(fd, &msg, &msgtype);
+    if (ret) {
+        strbuf_release(&msg);
+        return ret;
+    }
+
+    userlen = strnlen(msg.buf, msg.len);
+    if (userlen == msg.len)
+        fatal("malformed request from ceod");
+
+    if (setenv("CEO_USER", msg.buf, 1))
+        fatalpe("setenv");
+
+    if (msgtype & MSG_FLAG_PROGRESS) {
+        progress_fd = fd;
+        progress_type = msgtype;
+        msgtype &= ~MSG_FLAG_PROGRESS;
+    }
+
+    strbuf_add(&in, msg.buf + userlen + 1, msg.len - userlen - 1);
+
+    if (handler->handle(&in, &out))
+        ret = -1;
+
+    if (!out.len)
+        fatal("no response from op");
+
+    progress_fd = -1;
+
+    if (ceo_write_message(fd, out.buf, out.len, msgtype))
+        fatalpe("write");
+
+    strbuf_release(&msg);
+    strbuf_release(&in);
+    strbuf_release(&out);
+
+    return ret;
+}
+
+static void persistent_main(const struct op_handler *handler) {
+    time_t connected = time(NULL);
+    int stale = 0, ret;
+
+    handler->connect();
+
+    for (;;) {
+        if (ceod_op_worker_lifetime && time(NULL) - connected >= ceod_op_worker_lifetime)
+            stale = 1;
+
+        if (stale) {
+            debug("reconnecting backends");
+            handler->disconnect();
+            handler->connect();
+            connected = time(NULL);
+            stale = 0;
+        }
+
+        ret = serve_request(STDIN_FILENO, handler);
+        if (ret > 0)
+            break;
+        if (ret < 0)
+            stale = 1;
+    }
+
+    handler->disconnect();
+}
+
+static void zygote_child(int fd, const struct op_handler *handler) {
+    const char *user = getenv("CEO_OP_USER");
+    const char *timeout = getenv("CEO_OP_TIMEOUT");
+    uint32_t pid;
+
+    /* a group of our own takes whatever we run along when ceod kills us */
+    if (setpgid(0, 0))
+        fatalpe("setpgid");
+    pid = htonl(getpid());
+    if (write(fd, &pid, sizeof(pid)) != sizeof(pid))
+        fatalpe("write");
+
+    if (timeout && atoi(timeout) > 0)
+        alarm(atoi(timeout));
+
+    signal(SIGCHLD, SIG_DFL);
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+
+    if (user)
+        become_user(user);
+
+    handler->connect();
+    serve_request(fd, handler);
+    handler->disconnect();
+
+    exit(0);
+}
+
+static void zygote_main(const struct op_handler *handler) {
+    /* nobody waits for the children */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int fd = ceo_receive_fd(STDIN_FILENO);
+        if (fd < 0) {
+            if (errno)
+                fatalpe("recvmsg");
+            break;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid < 0)
+            errorpe("fork");
+        else if (!pid)
+            zygote_child(fd, handler);
+
+        close(fd);
+    }
+}
+
+void op_worker_main(const struct op_handler *handler) {
+    const char *mode = getenv("CEO_OP_WORKER");
+
+    if (!strcmp(mode, "persistent"))
+        persistent_main(handler);
+    else if (!strcmp(mode, "zygote"))
+        zygote_main(handler);
+    else
+        fatal("unknown op worker mode %s", mode);
+}
@@ -0,0 +1,9 @@
+struct op_handler {
+    int (*handle)(struct strbuf *in, struct strbuf *out);
+    void (*connect)(void);
+    void (*disconnect)(void);
+};
+
+int op_worker_mode(void);
+void op_progress(const void *msg, size_t len);
+void op_worker_main(const struct op_handler *handler);
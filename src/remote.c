@@ -0,0 +1,546 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "net.h"
+#include "gss.h"
+#include "ops.h"
+#include "config.h"
+#include "remote.h"
+
+/* Connecting to ceod and authenticating with it, for ceoc and ceoc-agent.
+ * Everything here uses the current GSS session, so a process talks to one
+ * server at a time unless it switches sessions between them (see
+ * gss_switch_session()), and exits on errors other than those that older
+ * servers are expected to cause, or a host that cannot be reached at all
+ * or stops answering, which leaves it to the caller to try another (see
+ * route.c). */
+
+/* seconds of context lifetime a connection must have left to be reused */
+#define REMOTE_EXPIRY_SLACK 60
+
+/* Starts conn on sock, giving each frame from the server as long to arrive
+ * as ceod gives ours, and the first byte of one as long again on top of
+ * the time it may keep us queued. */
+static void start_conn(struct ceo_conn *conn, int sock) {
+    ceo_conn_init(conn, sock);
+    conn->timeouts[CONN_HEADER] = ceod_header_timeout * 1000;
+    conn->timeouts[CONN_BODY] = ceod_body_timeout * 1000;
+    if (ceod_header_timeout)
+        conn->timeouts[CONN_IDLE] = ceod_header_timeout * 1000 + ceod_queue_timeout;
+}
+
+/* ms a host may go quiet for while answering a request for op (0 for no
+ * limit), to be set as the idle timeout of its connection */
+int response_timeout(struct op *op) {
+    return ceod_response_timeout ? (op->timeout + ceod_response_timeout) * 1000 : 0;
+}
+
+/* ceo_conn_read_frame(), but giving up with conn->expired set once one of
+ * conn's timeouts runs out, which takes a non-blocking socket. It is only
+ * non-blocking in here, since our writes expect to block. */
+int remote_read_frame(struct ceo_conn *conn, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid) {
+    int flags = fcntl(conn->fd, F_GETFL), ret;
+
+    if (flags < 0 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK))
+        fatalpe("fcntl");
+    ret = ceo_conn_read_frame(conn, msg, msgtype, reqid);
+    if (fcntl(conn->fd, F_SETFL, flags))
+        fatalpe("fcntl");
+
+    if (ret && conn->expired >= 0)
+        error("timed out reading from server");
+
+    return ret;
+}
+
+/* The first token goes out as MSG_AUTH_EXT if we want any features, or as
+ * MSG_AUTH_OP along with the wrapped request for op if we have one. */
+static void send_gss_token(int sock, gss_buffer_t token, const uint32_t *wanted,
+                           struct op *op, struct strbuf *request) {
+    OM_uint32 maj_stat, min_stat;
+    struct iovec iov[5];
+    uint32_t authlen, features, optype;
+    int iovcnt = 0;
+
+    if (request) {
+        authlen = htonl(sizeof(features) + token->length);
+        iov[iovcnt++] = (struct iovec) { .iov_base = &authlen, .iov_len = sizeof(authlen) };
+    }
+    if (wanted) {
+        features = htonl(*wanted);
+        iov[iovcnt++] = (struct iovec) { .iov_base = &features, .iov_len = sizeof(features) };
+    }
+    iov[iovcnt++] = (struct iovec) { .iov_base = token->value, .iov_len = token->length };
+    if (request) {
+        optype = htonl(op->id);
+        iov[iovcnt++] = (struct iovec) { .iov_base = &optype, .iov_len = sizeof(optype) };
+        iov[iovcnt++] = (struct iovec) { .iov_base = request->buf, .iov_len = request->len };
+    }
+
+    if (ceo_write_messagev(sock, iov, iovcnt, request ? MSG_AUTH_OP : wanted ? MSG_AUTH_EXT : MSG_AUTH))
+        fatalpe("write");
+
+    maj_stat = gss_release_buffer(&min_stat, token);
+    if (maj_stat != GSS_S_COMPLETE)
+        gss_fatal("gss_release_buffer", maj_stat, min_stat);
+}
+
+/* Wraps in for op ahead of authentication, if our context already allows it
+ * and the result leaves room for token in a single frame. */
+static int wrap_early(struct op *op, struct strbuf *in, gss_buffer_t token, struct strbuf *out) {
+    if (!op || !client_prot_ready() || in->len > MSG_CHUNKLEN)
+        return -1;
+
+    gss_encipher(in, out);
+    if (3 * sizeof(uint32_t) + token->length + out->len > MAX_MSGLEN) {
+        strbuf_reset(out);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Authenticates, asking for the features in wanted, and stores the ones
+ * the server granted. If op is given, its request in goes out as request 1
+ * along with our first token when possible (see MSG_AUTH_OP), and *sent is
+ * set if it did. Returns -1 if the server hung up on our request for
+ * features, as servers that predate them do, or if it stopped answering,
+ * in which case conn->expired is set. */
+static int client_gss_auth(struct ceo_conn *conn, uint32_t wanted, uint32_t *granted,
+                           struct op *op, struct strbuf *in, int *sent) {
+    gss_buffer_desc incoming_tok, outgoing_tok;
+    struct strbuf msg = STRBUF_INIT, early = STRBUF_INIT;
+    uint32_t msgtype;
+    int complete, asking = !!wanted;
+
+    *granted = 0;
+    *sent = 0;
+    complete = initial_client_token(&outgoing_tok);
+
+    if (asking && outgoing_tok.length && !wrap_early(op, in, &outgoing_tok, &early))
+        *sent = 1;
+
+    for (;;) {
+        if (outgoing_tok.length)
+            send_gss_token(conn->fd, &outgoing_tok, asking ? &wanted : NULL,
+                           op, *sent && asking ? &early : NULL);
+        else if (!complete)
+            fatal("no token to send during auth");
+
+        /* the server answers MSG_AUTH_EXT even if it has no token for us */
+        if (complete && !asking)
+            break;
+
+        if (remote_read_frame(conn, &msg, &msgtype, NULL)) {
+            if (asking || conn->expired >= 0) {
+                strbuf_release(&msg);
+                strbuf_release(&early);
+                return -1;
+            }
+            fatal("connection closed during auth");
+        }
+
+        if (asking && msgtype == MSG_AUTH_EXT && msg.len >= sizeof(*granted)) {
+            memcpy(granted, msg.buf, sizeof(*granted));
+            *granted = ntohl(*granted) & wanted;
+            strbuf_remove(&msg, 0, sizeof(*granted));
+        } else if (msgtype != MSG_AUTH) {
+            fatal("unexpected message type 0x%x", msgtype);
+        }
+        asking = 0;
+
+        if (complete)
+            break;
+
+        incoming_tok.value = msg.buf;
+        incoming_tok.length = msg.len;
+
+        complete = process_client_token(&incoming_tok, &outgoing_tok);
+    }
+
+    strbuf_release(&msg);
+    strbuf_release(&early);
+
+    return 0;
+}
+
+/* Resumption tickets (CEO_FEATURE_RESUME) are kept in $XDG_RUNTIME_DIR/ceoc,
+ * one per server, along with our end of the context they resume: be32
+ * features, be32 expiry, be32 ticket length, the ticket and the exported
+ * context. A ticket is renamed out of the way before it is read, so that
+ * it is only ever presented once. */
+#define TICKET_SLACK 5
+
+/* where ceoc keeps its tickets and ceoc-agent its socket */
+int runtime_dir(struct strbuf *dir) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (!runtime || !*runtime)
+        return -1;
+    strbuf_addf(dir, "%s/ceoc", runtime);
+    return 0;
+}
+
+int ticket_dir(struct strbuf *dir) {
+    if (!ceod_resume_lifetime)
+        return -1;
+    return runtime_dir(dir);
+}
+
+/* Takes the ticket kept for hostname, if any, and the context that goes
+ * with it, which becomes the one we use. */
+static int take_ticket(const char *hostname, struct strbuf *ticket, uint32_t *features) {
+    struct strbuf path = STRBUF_INIT, taken = STRBUF_INIT, file = STRBUF_INIT;
+    uint32_t fields[3];
+    size_t len;
+    int fd, ret = -1;
+
+    if (ticket_dir(&path))
+        goto out;
+    strbuf_addf(&path, "/%s", hostname);
+    strbuf_addf(&taken, "%s.%d", path.buf, getpid());
+    if (rename(path.buf, taken.buf))
+        goto out;
+
+    fd = open(taken.buf, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    unlink(taken.buf);
+    if (fd < 0)
+        goto out;
+    if (strbuf_read(&file, fd, 0) < 0)
+        errorpe("read: %s", taken.buf);
+    close(fd);
+
+    if (file.len < sizeof(fields))
+        goto out;
+    memcpy(fields, file.buf, sizeof(fields));
+    len = ntohl(fields[2]);
+    if (ntohl(fields[1]) <= time(NULL) || len > file.len - sizeof(fields))
+        goto out;
+
+    if (gss_session_import(gss_default_session(), file.buf + sizeof(fields) + len,
+                           file.len - sizeof(fields) - len)) {
+        reset_gss();
+        goto out;
+    }
+    strbuf_add(ticket, file.buf + sizeof(fields), len);
+    *features = ntohl(fields[0]);
+    ret = 0;
+
+out:
+    /* it has our keys in it */
+    memset(file.buf, 0, file.len);
+    strbuf_release(&file);
+    strbuf_release(&path);
+    strbuf_release(&taken);
+    return ret;
+}
+
+/* Keeps the ticket in msg, the body of a MSG_TICKET frame, for the next
+ * connection to hostname. Our context must have seen every message from
+ * the server by now. */
+void save_ticket(const char *hostname, struct strbuf *msg, uint32_t features) {
+    struct strbuf path = STRBUF_INIT, tmp = STRBUF_INIT, file = STRBUF_INIT;
+    uint32_t fields[3], lifetime;
+    int fd;
+
+    if (msg->len < sizeof(lifetime) || ticket_dir(&path))
+        goto out;
+    if (mkdir(path.buf, 0700) && errno != EEXIST) {
+        errorpe("mkdir: %s", path.buf);
+        goto out;
+    }
+    strbuf_addf(&path, "/%s", hostname);
+    strbuf_addf(&tmp, "%s.%d", path.buf, getpid());
+
+    memcpy(&lifetime, msg->buf, sizeof(lifetime));
+    fields[0] = htonl(features);
+    fields[1] = htonl(time(NULL) + ntohl(lifetime) - TICKET_SLACK);
+    fields[2] = htonl(msg->len - sizeof(lifetime));
+    strbuf_add(&file, fields, sizeof(fields));
+    strbuf_add(&file, msg->buf + sizeof(lifetime), msg->len - sizeof(lifetime));
+    if (gss_session_export(gss_default_session(), &file))
+        goto out;
+
+    fd = open(tmp.buf, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        errorpe("open: %s", tmp.buf);
+        goto out;
+    }
+    if (full_write(fd, file.buf, file.len) || close(fd) || rename(tmp.buf, path.buf)) {
+        errorpe("failed to save ticket in %s", path.buf);
+        unlink(tmp.buf);
+    }
+
+out:
+    memset(file.buf, 0, file.len);
+    strbuf_release(&file);
+    strbuf_release(&path);
+    strbuf_release(&tmp);
+}
+
+/* Presents ticket in place of authenticating, asking for the features in
+ * wanted, along with the request in for op if it fits in a frame. The
+ * features the ticket was issued on tell how to frame it, and are replaced
+ * by those the server grants. Returns -1 if the server does not take the
+ * ticket, in which case it has not seen the request either; otherwise
+ * *sent is set if the request is on its way. */
+static int present_ticket(struct ceo_conn *conn, struct op *op, struct strbuf *in, struct strbuf *ticket,
+                          uint32_t wanted, uint32_t *features, int *sent) {
+    struct strbuf out = STRBUF_INIT, msg = STRBUF_INIT;
+    size_t frame = ceo_frame_start(&out);
+    uint32_t msgtype, mask = htonl(wanted);
+    int ret = -1;
+
+    strbuf_add(&out, &mask, sizeof(mask));
+    strbuf_addbuf(&out, ticket);
+    ceo_frame_finish(&out, frame, MSG_RESUME);
+
+    *sent = in && in->len <= MSG_CHUNKLEN;
+    if (*sent)
+        gss_encipher_frames(in, &out, op->id, 1, *features & wanted);
+
+    if (full_write(conn->fd, out.buf, out.len))
+        goto out;
+
+    if (!remote_read_frame(conn, &msg, &msgtype, NULL) && msgtype == MSG_RESUME &&
+            msg.len == sizeof(*features)) {
+        memcpy(features, msg.buf, sizeof(*features));
+        *features = ntohl(*features);
+        ret = 0;
+    }
+
+out:
+    strbuf_release(&out);
+    strbuf_release(&msg);
+    return ret;
+}
+
+/* connect(), but giving up after ceod_connect_timeout seconds */
+static int timed_connect(int sock, const struct sockaddr *addr, socklen_t len) {
+    struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+    socklen_t errlen = sizeof(int);
+    int flags, err, ret;
+
+    if (ceod_connect_timeout <= 0)
+        return connect(sock, addr, len);
+
+    flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK))
+        fatalpe("fcntl");
+
+    ret = connect(sock, addr, len);
+    if (ret && errno == EINPROGRESS) {
+        do
+            ret = poll(&pfd, 1, ceod_connect_timeout * 1000);
+        while (ret < 0 && errno == EINTR);
+
+        if (!ret) {
+            errno = ETIMEDOUT;
+            ret = -1;
+        } else if (ret > 0) {
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen))
+                fatalpe("getsockopt");
+            errno = err;
+            ret = err ? -1 : 0;
+        }
+    }
+
+    err = errno;
+    if (fcntl(sock, F_SETFL, flags))
+        fatalpe("fcntl");
+    errno = err;
+
+    return ret;
+}
+
+/* Connects to the host op points at. Returns -1 if it cannot be reached. */
+int connect_server(struct op *op) {
+    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+
+    if (sock < 0)
+        fatalpe("socket");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ceod_port);
+    addr.sin_addr = op->addr;
+
+    if (ceo_set_nodelay(sock))
+        fatalpe("setsockopt");
+
+    /* our first token then goes out with the SYN; but we would only find
+     * out that the host is down once we write to it, too late to try
+     * another, so ops on several hosts do without */
+    if (ceod_fastopen && op->nhosts == 1 && ceo_set_fastopen_connect(sock))
+        fatalpe("setsockopt");
+
+    if (timed_connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        errorpe("connect: %s", op->hostname);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Connects to the local socket of the ceod on this host, if op points
+ * here and there is one. Returns -1 otherwise. */
+static int connect_local(struct op *op) {
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strcmp(op->hostname, fqdn.buf) || !*ceod_local_socket || strlen(ceod_local_socket) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, ceod_local_socket);
+
+    sock = socket(PF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fatalpe("socket");
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        debug("connect: %s: %s", ceod_local_socket, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* On the local socket ceod knows who we are from the kernel, so messages
+ * go unwrapped and all there is to do is agree on features. Returns -1 if
+ * the server will not. */
+static int local_auth(struct ceo_conn *conn, uint32_t wanted, uint32_t *features) {
+    struct strbuf msg = STRBUF_INIT;
+    uint32_t msgtype, mask = htonl(wanted);
+    int ret = -1;
+
+    gss_session_trust(gss_default_session(), "ceod");
+
+    *features = 0;
+    if (!wanted)
+        return 0;
+
+    if (ceo_send_message(conn->fd, &mask, sizeof(mask), MSG_AUTH_EXT))
+        fatalpe("write");
+
+    if (!remote_read_frame(conn, &msg, &msgtype, NULL) && msgtype == MSG_AUTH_EXT &&
+            msg.len == sizeof(mask)) {
+        memcpy(&mask, msg.buf, sizeof(mask));
+        *features = ntohl(mask) & wanted;
+        ret = 0;
+    }
+
+    strbuf_release(&msg);
+    return ret;
+}
+
+/* hangs up and forgets the context, so that another connection can be
+ * authenticated */
+void close_remote(struct ceo_conn *conn) {
+    close(conn->fd);
+    ceo_conn_release(conn);
+    reset_gss();
+}
+
+static void reconnect_server(struct ceo_conn *conn, struct op *op) {
+    int sock;
+
+    close_remote(conn);
+    sock = connect_server(op);
+    if (sock < 0)
+        fatal("lost %s while authenticating", op->hostname);
+    start_conn(conn, sock);
+}
+
+/* Whether a connection last used at last_used (see monotonic_ms()) should
+ * be replaced before it is used again: ceod may be about to drop it for
+ * idling, or its context may be about to expire. */
+int remote_stale(long long last_used) {
+    long long idle_ms = monotonic_ms() - last_used;
+
+    return gss_session_time_left(gss_default_session()) < REMOTE_EXPIRY_SLACK ||
+           (ceod_idle_timeout && idle_ms >= ceod_idle_timeout * 1000LL / 2);
+}
+
+/* Connects to the host of op and authenticates, over the local socket if
+ * it is this host, otherwise with a ticket if wanted has CEO_FEATURE_RESUME
+ * and we have one, falling back to what older servers understand, and
+ * stores the features granted. If in is given, it
+ * goes out as request 1 for op along the way when possible, and *sent is
+ * set if it did. Returns -1 if the host cannot be reached or stops
+ * answering, in which case another may be tried, unless *sent is set and
+ * the request may have run. */
+int open_remote(struct ceo_conn *conn, struct op *op, uint32_t wanted, struct strbuf *in,
+                 uint32_t *features, int *sent) {
+    const char *hostname = op->hostname;
+    struct strbuf ticket = STRBUF_INIT;
+    int sock, ret, resumed = 0;
+
+    *sent = 0;
+
+    sock = connect_local(op);
+    if (sock >= 0) {
+        start_conn(conn, sock);
+        if (!local_auth(conn, wanted, features))
+            return 0;
+        debug("local ceod refused us, trying %s over TCP", hostname);
+        close_remote(conn);
+    }
+
+    sock = connect_server(op);
+    if (sock < 0)
+        return -1;
+    start_conn(conn, sock);
+
+    if ((wanted & CEO_FEATURE_RESUME) && !take_ticket(hostname, &ticket, features)) {
+        resumed = !present_ticket(conn, op, in, &ticket, wanted, features, sent);
+        if (!resumed && conn->expired >= 0)
+            goto stalled;
+        if (!resumed) {
+            debug("%s did not take our ticket", hostname);
+            reconnect_server(conn, op);
+        }
+    }
+
+    if (!resumed) {
+        ret = client_gss_auth(conn, wanted, features, in ? op : NULL, in, sent);
+        if (ret && conn->expired >= 0)
+            goto stalled;
+        if (ret && *sent) {
+            debug("%s does not take requests along with auth", hostname);
+            reconnect_server(conn, op);
+            ret = client_gss_auth(conn, wanted, features, NULL, NULL, sent);
+            if (ret && conn->expired >= 0)
+                goto stalled;
+        }
+        if (ret) {
+            debug("%s does not support protocol extensions", hostname);
+            reconnect_server(conn, op);
+            if (client_gss_auth(conn, 0, features, NULL, NULL, sent))
+                goto stalled;
+        }
+    }
+
+    strbuf_release(&ticket);
+    return 0;
+
+stalled:
+    error("%s stopped answering while we authenticated", hostname);
+    close_remote(conn);
+    strbuf_release(&ticket);
+    return -1;
+}
@@ -0,0 +1,14 @@
+/* remote.c */
+struct op;
+struct ceo_conn;
+
+int runtime_dir(struct strbuf *dir);
+int ticket_dir(struct strbuf *dir);
+void save_ticket(const char *hostname, struct strbuf *msg, uint32_t features);
+int connect_server(struct op *op);
+int response_timeout(struct op *op);
+int remote_read_frame(struct ceo_conn *conn, struct strbuf *msg, uint32_t *msgtype, uint32_t *reqid);
+int open_remote(struct ceo_conn *conn, struct op *op, uint32_t wanted, struct strbuf *in,
+                uint32_t *features, int *sent);
+void close_remote(struct ceo_conn *conn);
+int remote_stale(long long last_used);
@@ -0,0 +1,251 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "net.h"
+#include "ops.h"
+#include "config.h"
+#include "remote.h"
+#include "route.h"
+
+/* An op listed on several hosts in etc/ops may have its requests sent to
+ * any of them, and ceoc tries them in turn until one takes the request:
+ * this host first, then the hosts that have not failed us lately, and last
+ * the ones that have, soonest back first. Of the hosts in good standing,
+ * the faster of two picked at random goes ahead of the rest, which spreads
+ * clients over the replicas of an op while steering them away from slow
+ * ones. A host fails us if it cannot be reached within
+ * ceod_connect_timeout seconds or stops answering (see response_timeout()),
+ * which keeps it back for ceod_host_holdoff seconds, or if it is busy, for
+ * as long as it asks us to wait. Only a host that has not been sent the
+ * request yet is passed over for the next; otherwise it may have run.
+ *
+ * How each host has done is kept in $XDG_RUNTIME_DIR/ceoc/hosts so that
+ * every ceoc of ours knows, one host per line: its name, a moving average
+ * of how long its requests took in milliseconds (0 if we have not timed
+ * any yet) and the time until which it is held back. Ops on a single host
+ * have nothing to choose from and leave it alone. */
+
+struct host_record {
+    char *name;
+    long long latency_ms;
+    long long held_until;
+};
+
+static struct host_record *records;
+static int nrecords;
+
+static int hosts_file(struct strbuf *path) {
+    if (runtime_dir(path))
+        return -1;
+    strbuf_addstr(path, "/hosts");
+    return 0;
+}
+
+static void free_records(void) {
+    for (int i = 0; i < nrecords; i++)
+        free(records[i].name);
+    free(records);
+    records = NULL;
+    nrecords = 0;
+}
+
+static struct host_record *find_record(const char *name) {
+    for (int i = 0; i < nrecords; i++) {
+        if (!strcmp(records[i].name, name))
+            return &records[i];
+    }
+
+    records = xrealloc(records, (nrecords + 1) * sizeof(*records));
+    records[nrecords] = (struct host_record) { .name = xstrdup(name) };
+    return &records[nrecords++];
+}
+
+/* picks up what other ceocs have seen since, if they share it with us */
+static void load_records(void) {
+    struct strbuf path = STRBUF_INIT, line = STRBUF_INIT;
+    char name[256];
+    long long latency_ms, held_until;
+    FILE *fp;
+
+    if (hosts_file(&path))
+        goto out;
+    fp = fopen(path.buf, "r");
+    if (!fp)
+        goto out;
+
+    free_records();
+    while (strbuf_getline(&line, fp, '\n') != EOF) {
+        if (sscanf(line.buf, "%255s %lld %lld", name, &latency_ms, &held_until) != 3)
+            continue;
+        struct host_record *rec = find_record(name);
+        rec->latency_ms = latency_ms;
+        rec->held_until = held_until;
+    }
+    fclose(fp);
+
+out:
+    strbuf_release(&path);
+    strbuf_release(&line);
+}
+
+static void save_records(void) {
+    struct strbuf path = STRBUF_INIT, tmp = STRBUF_INIT;
+    FILE *fp;
+
+    if (runtime_dir(&path))
+        goto out;
+    if (mkdir(path.buf, 0700) && errno != EEXIST) {
+        errorpe("mkdir: %s", path.buf);
+        goto out;
+    }
+    strbuf_addstr(&path, "/hosts");
+    strbuf_addf(&tmp, "%s.%d", path.buf, getpid());
+
+    fp = fopen(tmp.buf, "w");
+    if (!fp) {
+        errorpe("open: %s", tmp.buf);
+        goto out;
+    }
+    for (int i = 0; i < nrecords; i++)
+        fprintf(fp, "%s %lld %lld\n", records[i].name, records[i].latency_ms, records[i].held_until);
+    if (fclose(fp) || rename(tmp.buf, path.buf)) {
+        errorpe("failed to save host records in %s", path.buf);
+        unlink(tmp.buf);
+    }
+
+out:
+    strbuf_release(&path);
+    strbuf_release(&tmp);
+}
+
+static void use_host(struct op *op, int i) {
+    op->hostname = op->hosts[i].name;
+    op->addr = op->hosts[i].addr;
+}
+
+static int current_host(struct op *op) {
+    for (int i = 0; i < op->nhosts; i++) {
+        if (op->hosts[i].name == op->hostname)
+            return i;
+    }
+    return -1;
+}
+
+/* the order hosts are tried in: this one, those in good standing by
+ * latency, then those held back by how long for */
+static int host_rank(struct host_record *rec, const char *name, long long now, long long *value) {
+    if (rec->held_until > now) {
+        *value = rec->held_until;
+        return 2;
+    }
+    *value = rec->latency_ms;
+    return strcmp(name, fqdn.buf) ? 1 : 0;
+}
+
+/* Orders the hosts of op to be tried in, and points op at the first. */
+void route_op(struct op *op) {
+    static int seeded;
+    long long now = time(NULL), values[op->nhosts];
+    int ranks[op->nhosts], good = 0;
+
+    if (op->nhosts < 2)
+        return;
+    if (!seeded) {
+        srandom(getpid() ^ now);
+        seeded = 1;
+    }
+
+    load_records();
+    for (int i = 0; i < op->nhosts; i++)
+        ranks[i] = host_rank(find_record(op->hosts[i].name), op->hosts[i].name, now, &values[i]);
+
+    /* there are only ever a few */
+    for (int i = 1; i < op->nhosts; i++) {
+        for (int j = i; j > 0 && (ranks[j - 1] > ranks[j] ||
+                                  (ranks[j - 1] == ranks[j] && values[j - 1] > values[j])); j--) {
+            struct op_host host = op->hosts[j];
+            long long value = values[j];
+            int rank = ranks[j];
+
+            op->hosts[j] = op->hosts[j - 1];
+            values[j] = values[j - 1];
+            ranks[j] = ranks[j - 1];
+            op->hosts[j - 1] = host;
+            values[j - 1] = value;
+            ranks[j - 1] = rank;
+        }
+    }
+
+    for (int i = 0; i < op->nhosts; i++)
+        good += ranks[i] == 1;
+
+    /* of two picked at random, the one that sorts first */
+    if (ranks[0] == 1 && good > 1) {
+        int a = random() % good, b = random() % (good - 1);
+        int pick = b >= a ? a : b;
+        struct op_host host = op->hosts[pick];
+
+        memmove(&op->hosts[1], &op->hosts[0], pick * sizeof(*op->hosts));
+        op->hosts[0] = host;
+    }
+
+    use_host(op, 0);
+}
+
+/* Points op at the next host to try. Returns -1 if there are no more. */
+int next_route(struct op *op) {
+    int i = current_host(op) + 1;
+
+    if (i >= op->nhosts)
+        return -1;
+    use_host(op, i);
+    debug("trying %s for op %s", op->hostname, op->name);
+    return 0;
+}
+
+/* Points op at hostname. Returns -1 if op does not run there. */
+int route_to(struct op *op, const char *hostname) {
+    for (int i = 0; i < op->nhosts; i++) {
+        if (!strcmp(op->hosts[i].name, hostname)) {
+            use_host(op, i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Holds back the host op points at, because it could not be reached or
+ * stopped answering, or for retry_ms because it is busy. */
+void route_failed(struct op *op, uint32_t retry_ms) {
+    struct host_record *rec;
+
+    if (op->nhosts < 2)
+        return;
+
+    load_records();
+    rec = find_record(op->hostname);
+    rec->held_until = time(NULL) + (retry_ms ? (retry_ms + 999) / 1000 : ceod_host_holdoff);
+    save_records();
+}
+
+/* Counts a request that the host op points at answered in ms. */
+void route_done(struct op *op, long long ms) {
+    struct host_record *rec;
+
+    if (op->nhosts < 2)
+        return;
+
+    load_records();
+    rec = find_record(op->hostname);
+    /* 0 is for hosts we have yet to time */
+    ms = ms > 0 ? ms : 1;
+    rec->latency_ms = rec->latency_ms ? (rec->latency_ms * 3 + ms) / 4 : ms;
+    rec->held_until = 0;
+    save_records();
+}
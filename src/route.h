@@ -0,0 +1,8 @@
+/* route.c */
+struct op;
+
+void route_op(struct op *op);
+int next_route(struct op *op);
+int route_to(struct op *op, const char *hostname);
+void route_failed(struct op *op, uint32_t retry_ms);
+void route_done(struct op *op, long long ms);
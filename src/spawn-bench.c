@@ -0,0 +1,85 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "util.h"
+
+/* Compares the cost of spawning a trivial program through spawn_process()
+ * with a plain fork() and execve() as the parent's resident set grows. */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_fork(const char *path, char **argv, int count) {
+    double start = now();
+
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            fatalpe("fork");
+        if (!pid) {
+            execve(path, argv, environ);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return (now() - start) / count;
+}
+
+static double time_spawn(const char *path, char **argv, int count) {
+    double start = now();
+
+    for (int i = 0; i < count; i++) {
+        pid_t pid = spawn_process(path, argv, environ, NULL, NULL, 0, -1);
+        if (pid < 0)
+            fatal("spawn failed");
+        waitpid(pid, NULL, 0);
+    }
+
+    return (now() - start) / count;
+}
+
+int main(int argc, char *argv[]) {
+    char *path = "/bin/true";
+    char *child_argv[] = { path, NULL };
+    int count = 200, max_mb = 1024;
+    size_t rss = 0;
+    char *ballast = NULL;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (argc > 2)
+        max_mb = atoi(argv[2]);
+    if (count <= 0 || max_mb < 0) {
+        fprintf(stderr, "usage: %s [spawns per step] [max rss in MiB]\n", argv[0]);
+        exit(2);
+    }
+
+    printf("%8s %12s %12s\n", "rss MiB", "fork us", "spawn us");
+
+    for (int mb = 0; mb <= max_mb; mb = mb ? mb * 2 : 16) {
+        size_t want = (size_t)mb << 20;
+
+        if (want > rss) {
+            ballast = xrealloc(ballast, want);
+            memset(ballast + rss, 1, want - rss);
+            rss = want;
+        }
+
+        printf("%8d %12.1f %12.1f\n", mb,
+               time_fork(path, child_argv, count) * 1e6,
+               time_spawn(path, child_argv, count) * 1e6);
+        fflush(stdout);
+    }
+
+    free(ballast);
+
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _ATFILE_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
@@ -9,6 +10,13 @@
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
 
 #include "util.h"
 #include "strbuf.h"
@@ -152,13 +160,13 @@ int spawnv(const char *path, char *const argv[]) {
     fflush(stdout);
     fflush(stderr);
 
-    pid = fork();
-    if (pid < 0)
-        fatalpe("fork");
-    else if (pid)
-        waitpid(pid, &status, 0);
-    else
-        exit(execv(path, argv));
+    /* as a forked child that cannot exec exits 127 */
+    pid = spawn_process(path, argv, environ, NULL, NULL, 0, -1);
+    if (pid < 0) {
+        error("cannot run %s", path);
+        return 127 << 8;
+    }
+    waitpid(pid, &status, 0);
     return status;
 }
 
@@ -167,6 +175,8 @@ int full_write(int fd, const void *buf, size_t count) {
 
     while (total < count) {
         ssize_t wcount = write(fd, (char *)buf + total, count - total);
+        if (wcount < 0 && errno == EINTR)
+            continue;
         if (wcount < 0)
             return wcount;
         total += wcount;
@@ -175,88 +185,535 @@ int full_write(int fd, const void *buf, size_t count) {
     return 0;
 }
 
+void become_user(const char *user) {
+    struct passwd *pw = getpwnam(user);
+    if (!pw)
+        fatalpe("getpwnam: %s", user);
+    if (initgroups(user, pw->pw_gid))
+        fatalpe("initgroups: %s", user);
+    if (setregid(pw->pw_gid, pw->pw_gid))
+        fatalpe("setregid: %s", user);
+    if (setreuid(pw->pw_uid, pw->pw_uid))
+        fatalpe("setreuid");
+}
+
+/* Process creation. By default children are started with
+ * clone(CLONE_VM|CLONE_VFORK), which borrows the parent's address space
+ * until the exec instead of copying its page tables, so spawning costs the
+ * same no matter how big the parent has grown; build with SPAWN=fork to use
+ * plain fork() instead. The child may only use raw system calls: anything
+ * that allocates or takes a lock could corrupt the suspended parent. So the
+ * user's ids and groups are looked up beforehand, and the credential switch
+ * uses the raw syscalls rather than the libc wrappers, which would try to
+ * apply it to every thread of the parent as well. */
+
+/* some 32-bit architectures keep 16-bit ids in the original calls */
+#ifdef SYS_setreuid32
+#define SYS_SETGROUPS SYS_setgroups32
+#define SYS_SETREGID SYS_setregid32
+#define SYS_SETREUID SYS_setreuid32
+#else
+#define SYS_SETGROUPS SYS_setgroups
+#define SYS_SETREGID SYS_setregid
+#define SYS_SETREUID SYS_setreuid
+#endif
+
+struct spawn_args {
+    const char *path;
+    char *const *argv;
+    char *const *envp;
+    const int *fds;
+    const char *user;
+    int flags;
+    int cgroup_fd;
+    uid_t uid;
+    gid_t gid;
+    gid_t *groups;
+    int ngroups;
+    volatile int err;
+    const char *failed;
+};
+
+static int lookup_user(struct spawn_args *args) {
+    struct passwd pwbuf, *pw;
+    char buf[4096];
+    int ngroups = 64;
+
+    if (getpwnam_r(args->user, &pwbuf, buf, sizeof(buf), &pw) || !pw) {
+        error("getpwnam: %s: no such user", args->user);
+        return -1;
+    }
+
+    args->uid = pw->pw_uid;
+    args->gid = pw->pw_gid;
+
+    for (;;) {
+        args->groups = xrealloc(args->groups, ngroups * sizeof(gid_t));
+        args->ngroups = ngroups;
+        if (getgrouplist(args->user, args->gid, args->groups, &args->ngroups) >= 0)
+            return 0;
+        if (args->ngroups <= ngroups) {
+            error("getgrouplist: %s failed", args->user);
+            return -1;
+        }
+        ngroups = args->ngroups;
+    }
+}
+
+static int spawn_child(void *arg) {
+    struct spawn_args *args = arg;
+    struct sigaction sa;
+    sigset_t sigs;
+
+    /* handlers would run on the parent's memory */
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) || sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL)
+            continue;
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, NULL);
+    }
+    sigemptyset(&sigs);
+    sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+    /* "0" moves the writer, and we must still be root to do it */
+    if (args->cgroup_fd >= 0 && write(args->cgroup_fd, "0", 1) != 1) {
+        args->failed = "cgroup.procs";
+        goto fail;
+    }
+
+    if ((args->flags & SPAWN_PGRP) && setpgid(0, 0)) {
+        args->failed = "setpgid";
+        goto fail;
+    }
+
+    for (int i = 0; args->fds && i < SPAWN_FDS; i++) {
+        int ret;
+
+        if (args->fds[i] < 0)
+            continue;
+        else if (args->fds[i] == i)
+            ret = fcntl(i, F_SETFD, 0);
+        else
+            ret = dup2(args->fds[i], i);
+
+        if (ret < 0) {
+            args->failed = "dup2";
+            goto fail;
+        }
+    }
+
+    if (args->user) {
+        if (syscall(SYS_SETGROUPS, args->ngroups, args->groups)) {
+            args->failed = "setgroups";
+            goto fail;
+        }
+        if (syscall(SYS_SETREGID, args->gid, args->gid)) {
+            args->failed = "setregid";
+            goto fail;
+        }
+        if (syscall(SYS_SETREUID, args->uid, args->uid)) {
+            args->failed = "setreuid";
+            goto fail;
+        }
+    }
+
+    execve(args->path, args->argv, args->envp);
+    args->failed = "execve";
+
+fail:
+    args->err = errno;
+#ifdef CEO_SPAWN_FORK
+    errorpe("%s: %s", args->failed, args->path);
+#endif
+    _exit(127);
+}
+
+/* Starts path as user (if not NULL) with fds[0..SPAWN_FDS-1] (if not NULL;
+ * -1 keeps the parent's) as its first descriptors, in a process group of its own
+ * if flags has SPAWN_PGRP and in the cgroup whose cgroup.procs is open as
+ * cgroup_fd (unless -1), and returns its pid, or -1 after logging an error.
+ * All other descriptors should be close-on-exec. */
+pid_t spawn_process(const char *path, char *const *argv, char *const *envp, const int *fds, const char *user, int flags, int cgroup_fd) {
+    struct spawn_args args = {
+        .path = path, .argv = argv, .envp = envp, .fds = fds, .user = user,
+        .flags = flags, .cgroup_fd = cgroup_fd,
+    };
+    pid_t pid;
+
+    if (user && lookup_user(&args)) {
+        free(args.groups);
+        return -1;
+    }
+
+#ifdef CEO_SPAWN_FORK
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (!pid)
+        spawn_child(&args);
+    if (pid < 0)
+        errorpe("fork");
+#else
+    /* we stay suspended until the child has exec'd or exited */
+    static const size_t stack_size = 64 * 1024;
+    char *stack = xmalloc(stack_size);
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pid = clone(spawn_child, stack + stack_size, CLONE_VM|CLONE_VFORK|SIGCHLD, &args);
+    if (pid < 0)
+        errorpe("clone");
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    free(stack);
+
+    if (pid > 0 && args.err) {
+        errno = args.err;
+        errorpe("%s: %s", args.failed, path);
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+#endif
+
+    free(args.groups);
+
+    return pid;
+}
+
+long long monotonic_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static long ms_until(const struct timespec *deadline) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/* Waits up to timeout ms (forever if negative) for pid to exit. Returns 1
+ * if it is still running, or -1 with *status set to -1 if it cannot be
+ * waited for. */
+static int wait_child(pid_t pid, int pidfd, int *status, long timeout) {
+    for (;;) {
+        pid_t wpid = waitpid(pid, status, timeout < 0 ? 0 : WNOHANG);
+        if (wpid == pid)
+            return 0;
+        if (wpid < 0 && errno != EINTR) {
+            errorpe("waitpid");
+            *status = -1;
+            return -1;
+        }
+        if (!timeout)
+            return 1;
+
+        if (pidfd >= 0) {
+            struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+            if (!poll(&pfd, 1, timeout))
+                timeout = 0;
+        } else if (timeout > 0) {
+            long step = timeout < 50 ? timeout : 50;
+            usleep(step * 1000);
+            timeout -= step;
+        }
+    }
+}
+
+/* SIGTERM, then after a grace period SIGKILL, the child's process group */
+static void kill_child(pid_t pid, int pidfd, int *status) {
+    kill(-pid, SIGTERM);
+    if (wait_child(pid, pidfd, status, SPAWN_KILL_GRACE * 1000) > 0) {
+        kill(-pid, SIGKILL);
+        wait_child(pid, pidfd, status, -1);
+    } else {
+        /* anything the child left behind */
+        kill(-pid, SIGKILL);
+    }
+}
+
+/* for children started with SPAWN_PGRP; returns the leader's wait status */
+int kill_process_group(pid_t pid) {
+    int pidfd = -1, status;
+
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    kill_child(pid, pidfd, &status);
+    if (pidfd >= 0)
+        close(pidfd);
+
+    return status;
+}
+
 int spawnvem(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr) {
     return spawnvemu(path, argv, envp, output, input, cap_stderr, NULL);
 }
 
 int spawnvemu(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr, char *user) {
-    int pid, wpid, status;
+    return spawnvemut(path, argv, envp, output, input, cap_stderr, user, 0, -1, -1, NULL, NULL);
+}
+
+/* Hands every packet waiting on the progress socket fd to report(), and
+ * returns -1 once the child has closed its end. */
+static int read_progress(int fd, const struct spawn_progress *progress, struct strbuf *buf) {
+    for (;;) {
+        ssize_t len = recv(fd, NULL, 0, MSG_PEEK|MSG_TRUNC|MSG_DONTWAIT);
+        if (len < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        if (!len)
+            return -1;
+
+        strbuf_reset(buf);
+        strbuf_grow(buf, len);
+        len = recv(fd, buf->buf, len, MSG_DONTWAIT);
+        if (len <= 0)
+            return -1;
+
+        progress->report(progress->ctx, buf->buf, len);
+    }
+}
+
+/* Like spawnvemu(), but the child runs in its own process group, which is
+ * killed if it is still running after timeout seconds (unless zero) or if
+ * cancel_fd (unless -1), normally the client's socket, is hung up, and in
+ * the cgroup given by cgroup_fd (see spawn_process()). If feed is not NULL,
+ * whatever it has is written to the child after output, and if progress is
+ * not NULL, it gets the child's progress reports. Returns the child's wait
+ * status, -1 if it could not be run or watched (it is then killed), or
+ * SPAWN_TIMEDOUT or SPAWN_CANCELLED (also if feed failed). */
+int spawnvemut(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr, char *user, int timeout, int cancel_fd, int cgroup_fd, const struct spawn_feed *feed, const struct spawn_progress *progress) {
+    int pid, pidfd = -1, status, result = 0, failed = 0;
     int tochild[2];
     int fmchild[2];
+    int reports[2] = { -1, -1 };
+    size_t written = 0;
+    struct timespec deadline;
+    struct strbuf discard = STRBUF_INIT, more = STRBUF_INIT, report = STRBUF_INIT;
+    const struct strbuf *pending = output;
+
+    /* close-on-exec keeps other threads' children from holding our pipes */
+    if (pipe2(tochild, O_CLOEXEC)) {
+        errorpe("pipe");
+        return -1;
+    }
+    if (pipe2(fmchild, O_CLOEXEC)) {
+        errorpe("pipe");
+        close(tochild[0]);
+        close(tochild[1]);
+        return -1;
+    }
+    if (progress && socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, reports)) {
+        errorpe("socketpair");
+        close(tochild[0]);
+        close(tochild[1]);
+        close(fmchild[0]);
+        close(fmchild[1]);
+        return -1;
+    }
 
-    if (pipe(tochild))
-        fatalpe("pipe");
-    if (pipe(fmchild))
-        fatalpe("pipe");
+    int fds[SPAWN_FDS] = { tochild[0], fmchild[1], cap_stderr ? fmchild[1] : -1, reports[1] };
 
     fflush(stdout);
     fflush(stderr);
 
-    pid = fork();
-    if (pid < 0)
-        fatalpe("fork");
-    if (!pid) {
-        dup2(tochild[0], STDIN_FILENO);
-        dup2(fmchild[1], STDOUT_FILENO);
-        if (cap_stderr)
-            dup2(STDOUT_FILENO, STDERR_FILENO);
+    pid = spawn_process(path, argv, envp, fds, user, SPAWN_PGRP, cgroup_fd);
+    if (pid < 0) {
         close(tochild[0]);
         close(tochild[1]);
         close(fmchild[0]);
         close(fmchild[1]);
-
-        if (user) {
-            struct passwd *pw = getpwnam(user);
-            if (!pw)
-                fatalpe("getpwnam: %s", user);
-            if (initgroups(user, pw->pw_gid))
-                fatalpe("initgroups: %s", user);
-            if (setregid(pw->pw_gid, pw->pw_gid))
-                fatalpe("setregid: %s", user);
-            if (setreuid(pw->pw_uid, pw->pw_uid))
-                fatalpe("setreuid");
+        if (progress) {
+            close(reports[0]);
+            close(reports[1]);
         }
-        execve(path, argv, envp);
-        fatalpe("execve");
-    } else {
-        close(tochild[0]);
-        close(fmchild[1]);
-        full_write(tochild[1], output->buf, output->len);
+        return -1;
+    }
+
+    close(tochild[0]);
+    close(fmchild[1]);
+    if (progress)
+        close(reports[1]);
+
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+    fcntl(tochild[1], F_SETFL, O_NONBLOCK);
+    fcntl(fmchild[0], F_SETFL, O_NONBLOCK);
+
+    if (!input)
+        input = &discard;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+
+    if (!output->len && !feed) {
         close(tochild[1]);
+        tochild[1] = -1;
+    }
+
+    while (fmchild[0] >= 0) {
+        struct pollfd pfd[4];
+        int nfds = 0, ret, in = -1, rep = -1;
+        long wait = -1;
+
+        if (timeout) {
+            wait = ms_until(&deadline);
+            if (wait <= 0) {
+                result = SPAWN_TIMEDOUT;
+                break;
+            }
+        }
+
+        pfd[nfds++] = (struct pollfd) { .fd = fmchild[0], .events = POLLIN };
+        if (tochild[1] >= 0) {
+            in = nfds;
+            pfd[nfds++] = (struct pollfd) { .fd = tochild[1], .events = POLLOUT };
+        }
+        if (reports[0] >= 0) {
+            rep = nfds;
+            pfd[nfds++] = (struct pollfd) { .fd = reports[0], .events = POLLIN };
+        }
+        if (cancel_fd >= 0)
+            pfd[nfds++] = (struct pollfd) { .fd = cancel_fd, .events = POLLRDHUP };
+
+        ret = poll(pfd, nfds, wait);
+        /* other threads are running ops too, so only this one fails */
+        if (ret < 0 && errno != EINTR) {
+            errorpe("poll");
+            failed = 1;
+            break;
+        }
+        if (ret <= 0)
+            continue;
+
+        if (cancel_fd >= 0 && pfd[nfds - 1].revents) {
+            result = SPAWN_CANCELLED;
+            break;
+        }
+
+        if (rep >= 0 && pfd[rep].revents && read_progress(reports[0], progress, &report)) {
+            close(reports[0]);
+            reports[0] = -1;
+        }
+
+        if (in >= 0 && pfd[in].revents) {
+            ssize_t wcount = write(tochild[1], pending->buf + written, pending->len - written);
+            if (wcount > 0)
+                written += wcount;
+            if (written == pending->len && feed) {
+                /* blocks until there is more, but not past the timeout */
+                strbuf_reset(&more);
+                ret = feed->more(feed->ctx, &more, timeout ? monotonic_ms() + ms_until(&deadline) : 0);
+                if (ret < 0) {
+                    result = timeout && ms_until(&deadline) <= 0 ? SPAWN_TIMEDOUT : SPAWN_CANCELLED;
+                    break;
+                }
+                if (ret)
+                    feed = NULL;
+                pending = &more;
+                written = 0;
+            }
+            if ((wcount < 0 && errno != EAGAIN && errno != EINTR) || written == pending->len) {
+                close(tochild[1]);
+                tochild[1] = -1;
+            }
+        }
+
+        if (pfd[0].revents) {
+            ssize_t rcount;
+
+            strbuf_grow(input, 8192);
+            rcount = read(fmchild[0], input->buf + input->len, strbuf_avail(input));
+            if (rcount > 0)
+                strbuf_setlen(input, input->len + rcount);
+            if (!rcount || (rcount < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(fmchild[0]);
+                fmchild[0] = -1;
+            }
+        }
+    }
 
-        if (input)
-            strbuf_read(input, fmchild[0], 0);
+    /* reports sent just before the child finished its output */
+    if (reports[0] >= 0) {
+        if (!result && !failed)
+            read_progress(reports[0], progress, &report);
+        close(reports[0]);
+    }
+    if (tochild[1] >= 0)
+        close(tochild[1]);
+    if (fmchild[0] >= 0)
         close(fmchild[0]);
+    strbuf_release(&discard);
+    strbuf_release(&more);
+    strbuf_release(&report);
+
+    if (failed) {
+        kill_child(pid, pidfd, &status);
+        if (pidfd >= 0)
+            close(pidfd);
+        return -1;
     }
 
-    wpid = waitpid(pid, &status, 0);
-    if (wpid < 0)
-        fatalpe("waitpid");
-    else if (wpid != pid)
-        fatal("waitpid is broken");
+    if (!result && timeout) {
+        long wait = ms_until(&deadline);
+        if (wait <= 0 || wait_child(pid, pidfd, &status, wait) > 0)
+            result = SPAWN_TIMEDOUT;
+    } else if (!result) {
+        wait_child(pid, pidfd, &status, -1);
+    }
 
-    if (WIFEXITED(status) && WEXITSTATUS(status))
+    if (result) {
+        kill_child(pid, pidfd, &status);
+        if (result == SPAWN_TIMEDOUT)
+            notice("child %s timed out after %d seconds", path, timeout);
+        else
+            notice("child %s cancelled", path);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status)) {
         notice("child %s exited with status %d", path, WEXITSTATUS(status));
-    else if (WIFSIGNALED(status))
+    } else if (WIFSIGNALED(status)) {
         notice("child %s killed by signal %d", path, WTERMSIG(status));
+    }
 
-    return status;
+    if (pidfd >= 0)
+        close(pidfd);
+
+    return result ? result : status;
 }
 
 int spawnv_msg(const char *path, char *const *argv, const struct strbuf *output) {
     return spawnvem(path, argv, environ, output, NULL, 0);
 }
 
-int check_group(char *username, char *group) {
-    struct group *grp = getgrnam(group);
-    char **members;
+/* reentrant, since ceod's op runner threads use it too */
+int check_group(const char *username, const char *group) {
+    struct group grbuf, *grp = NULL;
+    size_t buflen = 8192;
+    char *buf = NULL, **members;
+    int ret = 0, err;
+
+    for (;;) {
+        buf = xrealloc(buf, buflen);
+        err = getgrnam_r(group, &grbuf, buf, buflen, &grp);
+        if (err != ERANGE || buflen >= 1024 * 1024)
+            break;
+        buflen *= 2;
+    }
 
-    if (grp)
+    if (!err && grp)
         for (members = grp->gr_mem; *members; members++)
             if (!strcmp(username, *members))
-                return 1;
+                ret = 1;
 
-    return 0;
+    free(buf);
+
+    return ret;
 }
 
 FILE *fopenat(DIR *d, const char *path, int flags) {
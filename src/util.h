@@ -25,17 +25,51 @@
 
 extern char **environ;
 
+#define SPAWN_PGRP 1
+
+/* the descriptors spawn_process() sets up: stdin, stdout, stderr and a
+ * socket for progress reports (see struct spawn_progress) */
+#define SPAWN_FDS 4
+#define SPAWN_PROGRESS_FD 3
+
+#define SPAWN_TIMEDOUT -2
+#define SPAWN_CANCELLED -3
+
+/* seconds between SIGTERM and SIGKILL for a child that overstays */
+#define SPAWN_KILL_GRACE 5
+
 int spawnv(const char *path, char *const *argv);
 int spawnv_msg(const char *path, char *const *argv, const struct strbuf *output);
 int spawnvem(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr);
 int spawnvemu(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr, char *user);
+/* A source of more input for spawnvemut(). more() appends to buf and returns
+ * 0, returns 1 once there is nothing left, or -1 if it failed or if there
+ * was none by deadline (a monotonic_ms() time, unless 0). */
+struct spawn_feed {
+    int (*more)(void *ctx, struct strbuf *buf, long long deadline);
+    void *ctx;
+};
+
+/* Somewhere for spawnvemut()'s child to report progress to: the child gets
+ * a SOCK_SEQPACKET socket as SPAWN_PROGRESS_FD, and report() is called with
+ * every packet it sends there, before spawnvemut() returns. */
+struct spawn_progress {
+    void (*report)(void *ctx, const char *msg, size_t len);
+    void *ctx;
+};
+
+int spawnvemut(const char *path, char *const *argv, char *const *envp, const struct strbuf *output, struct strbuf *input, int cap_stderr, char *user, int timeout, int cancel_fd, int cgroup_fd, const struct spawn_feed *feed, const struct spawn_progress *progress);
+void become_user(const char *user);
+int kill_process_group(pid_t pid);
+pid_t spawn_process(const char *path, char *const *argv, char *const *envp, const int *fds, const char *user, int flags, int cgroup_fd);
 int full_write(int fd, const void *buf, size_t count);
+long long monotonic_ms(void);
 ssize_t full_read(int fd, void *buf, size_t len);
 FILE *fopenat(DIR *d, const char *path, int flags);
 void make_env(char **envp, ...);
 void free_env(char **envp);
 void init_log(const char *ident, int option, int facility, int lstderr);
-int check_group(char *username, char *group);
+int check_group(const char *username, const char *group);
 void log_set_maxprio(int prio);
 
 PRINTF_LIKE(0) NORETURN void fatal(const char *, ...);